@@ -0,0 +1,87 @@
+/* Benchmark for --batch: time to run many small programs, each in a process of its own */
+/* against all of them in one `stackc --batch` on 1 thread up to as many as there are CPUs. */
+/* One program in PROGRAMS / LONG_PROGRAMS runs far longer than the rest, for work stealing to spread. */
+/* Run from the repository root after building stackc. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PROGRAMS 2000
+#define LONG_PROGRAMS 100
+#define RUNS 3
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Writes program i: a word counting down from a number, long ones from a larger one. */
+static void generate(FILE *file, int i) {
+  fprintf(file, "def countdown // n -> 0\n  while dup 0 > then 1 - end\nend\n");
+  fprintf(file, "\"program %d\" . '\\n' .\n%d countdown .\n", i, i % (PROGRAMS / LONG_PROGRAMS) == 0 ? 2000000 : 2000);
+}
+
+/* Best of RUNS runs of command, with its output discarded. */
+static double timeCommand(char *command) {
+  double best = 0;
+  int run;
+  for (run = 0; run < RUNS; run++) {
+    double start = now();
+    if (system(command) != 0) {
+      fprintf(stderr, "Failed: %s\n", command);
+      exit(1);
+    }
+    double elapsed = now() - start;
+    if (run == 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return best;
+}
+
+int main(void) {
+  char directory[] = "/tmp/stackc-batch-XXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fprintf(stderr, "Could not create a directory for the generated programs.\n");
+    return 1;
+  }
+  int i;
+  for (i = 0; i < PROGRAMS; i++) {
+    char filename[256];
+    snprintf(filename, sizeof(filename), "%s/program%04d.stc", directory, i);
+    FILE *file = fopen(filename, "w");
+    if (file == NULL) {
+      fprintf(stderr, "Could not write %s.\n", filename);
+      return 1;
+    }
+    generate(file, i);
+    fclose(file);
+  }
+
+  char command[512];
+  printf("%-16s %10s %14s %10s\n", "mode", "time", "programs/s", "speedup");
+  snprintf(command, sizeof(command), "for f in %s/*.stc; do ./stackc $f || exit 1; done > /dev/null", directory);
+  double processes = timeCommand(command);
+  printf("%-16s %8.3f s %14.0f %9.2fx\n", "processes", processes, PROGRAMS / processes, 1.0);
+  long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  long threads = 1;
+  while (1) {
+    snprintf(command, sizeof(command), "./stackc --batch -j %ld %s > /dev/null", threads, directory);
+    double batch = timeCommand(command);
+    char mode[32];
+    snprintf(mode, sizeof(mode), "batch -j %ld", threads);
+    printf("%-16s %8.3f s %14.0f %9.2fx\n", mode, batch, PROGRAMS / batch, processes / batch);
+    if (threads == cpus) {
+      break;
+    }
+    /* Doubling, and last with every CPU. */
+    threads = threads * 2 < cpus ? threads * 2 : cpus;
+  }
+
+  snprintf(command, sizeof(command), "rm -rf %s", directory);
+  return system(command) != 0;
+}
@@ -0,0 +1,79 @@
+/* Benchmark for the program cache: time to run a generated program of several megabytes */
+/* that does little work, lexed and compiled each time against loaded from its cache with -C. */
+/* Run from the repository root after building stackc. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SOURCE_SIZE (8 * 1024 * 1024)
+#define RUNS 5
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Writes a program of about SOURCE_SIZE bytes of definitions, each called once. */
+static void generate(FILE *file) {
+  long written = 0;
+  int i = 0;
+  while (written < SOURCE_SIZE) {
+    written += fprintf(file, "def word%d // n -> n + %d\n  if dup 0 < then \"negative\" . elseif 1 then %d + end\nend\n", i, i, i);
+    written += fprintf(file, "%d word%d drop\n", i, i);
+    i++;
+  }
+}
+
+/* Best of RUNS runs of command, with its output discarded. */
+static double timeCommand(char *command) {
+  double best = 0;
+  int run;
+  for (run = 0; run < RUNS; run++) {
+    double start = now();
+    if (system(command) != 0) {
+      fprintf(stderr, "Failed: %s\n", command);
+      exit(1);
+    }
+    double elapsed = now() - start;
+    if (run == 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return best;
+}
+
+int main(void) {
+  char filename[] = "/tmp/stackc-cache-XXXXXX.stc";
+  int fd = mkstemps(filename, 4);
+  if (fd == -1) {
+    fprintf(stderr, "Could not create the generated program.\n");
+    return 1;
+  }
+  FILE *file = fdopen(fd, "w");
+  generate(file);
+  fclose(file);
+
+  char command[256], cache[256];
+  snprintf(cache, sizeof(cache), "%sb", filename);
+  /* The cache is of the program as compiled, the optimizer and analysis still run with it. */
+  static char *options[] = { "", "-O0 " };
+  int i;
+  printf("%-10s %12s %12s %12s\n", "options", "no cache", "writing", "cached");
+  for (i = 0; i < 2; i++) {
+    snprintf(command, sizeof(command), "./stackc %s%s > /dev/null", options[i], filename);
+    double uncached = timeCommand(command);
+    snprintf(command, sizeof(command), "rm -f %s && ./stackc -C %s%s > /dev/null", cache, options[i], filename);
+    double writing = timeCommand(command);
+    snprintf(command, sizeof(command), "./stackc -C %s%s > /dev/null", options[i], filename);
+    double cached = timeCommand(command);
+    printf("%-10s %10.3f s %10.3f s %10.3f s\n", i == 0 ? "default" : "-O0", uncached, writing, cached);
+  }
+
+  unlink(cache);
+  unlink(filename);
+  return 0;
+}
@@ -0,0 +1,89 @@
+/* Microbenchmark for instruction dispatch: time per op through execute(), */
+/* against calling the parsers through a function-pointer table as parseQueue() used to. */
+/* Build with -DSTACKC_NO_THREADING to measure the switch fallback of execute(). */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <time.h>
+
+#define STACKC_NO_MAIN
+#include "../stackc.c"
+
+#define GROUPS 256
+#define RUNS 20000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* The old path: a table of parsers is built on every call, then called indirectly. */
+static void callThroughRebuiltTable(Stack *stack, Instr *instr) {
+  void (*parsers[OPS_COUNT]) (PARSE_FUNC_TYPE) = {
+    NULL, parseINT, parseCHAR, NULL, parseADD, parseSUB, parseMUL, parseDIV, parseREM,
+    parseEQU, parseNEQU, parseGTE, parseLTE, parseGT, parseLT, parsePOP, parseSIZE, parsePSTACK,
+    parseDUP, parseDROP, parseSWAP, parseOVER, parseROT, NULL, NULL, NULL, NULL, NULL, NULL,
+    parseCASTINT, parseCASTCHAR, NULL, NULL, NULL, NULL,
+  };
+  parsers[instr->op](stack, instr->token, 1);
+}
+
+static void (*const staticParsers[OPS_COUNT]) (PARSE_FUNC_TYPE) = {
+  NULL, parseINT, parseCHAR, NULL, parseADD, parseSUB, parseMUL, parseDIV, parseREM,
+  parseEQU, parseNEQU, parseGTE, parseLTE, parseGT, parseLT, parsePOP, parseSIZE, parsePSTACK,
+  parseDUP, parseDROP, parseSWAP, parseOVER, parseROT, NULL, NULL, NULL, NULL, NULL, NULL,
+  parseCASTINT, parseCASTCHAR, NULL, NULL, NULL, NULL,
+};
+
+static void report(char *name, double elapsed, long ops) {
+  printf("%-28s %10.2f ns/op\n", name, elapsed * 1e9 / ops);
+}
+
+int main(int argc, char *argv[]) {
+  thisName = argv[0];
+  arena = newArena();
+  (void) argc;
+  Stack *stack = newStack();
+  Program *program = newProgram();
+  Token token;
+  memset(&token, 0, sizeof(token));
+
+  /* `1 dup + drop` repeated, leaving the stack empty. */
+  int i;
+  for (i = 0; i < GROUPS; i++) {
+    emit(program, OP_INT, 1, &token);
+    emit(program, OP_DUP, 0, &token);
+    emit(program, OP_ADD, 0, &token);
+    emit(program, OP_DROP, 0, &token);
+  }
+  emit(program, OP_HALT, 0, &token);
+  long ops = (long) GROUPS * 4 * RUNS;
+  token.value = 1;
+
+  int run;
+  double start = now();
+  for (run = 0; run < RUNS; run++) {
+    int ip;
+    for (ip = 0; program->code[ip].op != OP_HALT; ip++) {
+      callThroughRebuiltTable(stack, &program->code[ip]);
+    }
+  }
+  report("function pointers (rebuilt)", now() - start, ops);
+
+  start = now();
+  for (run = 0; run < RUNS; run++) {
+    int ip;
+    for (ip = 0; program->code[ip].op != OP_HALT; ip++) {
+      staticParsers[program->code[ip].op](stack, program->code[ip].token, 1);
+    }
+  }
+  report("function pointers (static)", now() - start, ops);
+
+  start = now();
+  for (run = 0; run < RUNS; run++) {
+    execute(stack, program, 0);
+  }
+  report(THREADED_DISPATCH ? "execute (threaded)" : "execute (switch)", now() - start, ops);
+  return 0;
+}
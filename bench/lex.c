@@ -0,0 +1,149 @@
+/* Benchmark for the lexer: MB/s lexing a generated program of several megabytes, */
+/* against the getline() loop main() used to lex with, copying each word into a cleared buffer. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define STACKC_NO_MAIN
+#include "../stackc.c"
+
+#define SOURCE_SIZE (8 * 1024 * 1024)
+#define RUNS 10
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Writes a program of about SOURCE_SIZE bytes mixing words, numbers, literals and comments. */
+static void generate(FILE *file) {
+  static const char *lines[] = {
+    "def square dup * end // n -> n * n\n",
+    "1 2 + 3 * 4 - dup . drop\n",
+    "\"hello, world\\n\" . 'a' '\\n' (int) .\n",
+    "0 while dup 10 < then dup square . 1 + end drop\n",
+    "if 1 2 < then \"less\" elseif 1 then \"more\" end .\n",
+    "12345 -678 swap over rot .s .stack\n",
+  };
+  long written = 0;
+  int i = 0;
+  while (written < SOURCE_SIZE) {
+    written += fprintf(file, "%s", lines[i++ % (sizeof(lines) / sizeof(lines[0]))]);
+  }
+}
+
+/* The old lexer, kept as it was apart from passing the length to makeToken(). */
+static void lexWithGetline(Tokens *tokens, FILE *source) {
+  char word[MAX_WORD_SIZE];
+  memset(word, 0, sizeof(word));
+  char *line = NULL;
+  int row = 0;
+  ssize_t lengthOfLine;
+  size_t len = 0;
+  int parsingString = 0;
+  while ((lengthOfLine = getline(&line, &len, source)) != -1) {
+    int wordIndex = 0;
+    memset(word, 0, sizeof(word));
+    int lineIndex;
+    for (lineIndex = 0; lineIndex < lengthOfLine; lineIndex++) {
+      char c = line[lineIndex];
+      if (c == '\'' && wordIndex == 0) {
+        char next = line[++lineIndex];
+        if (next == '\\') {
+          next = unescape(line[++lineIndex]);
+        }
+        int col = lineIndex - wordIndex + 1;
+        if (line[++lineIndex] != '\'') {
+          assert(0, arenaPrintf(arena, "Invalid character at %d %d", row + 1, col));
+        }
+        Token *token = makeToken(tokens, row + 1, lineIndex - wordIndex + 1, &next, 1);
+        token->OP_TYPE = OP_CHAR;
+        token->value = next;
+        wordIndex = 0;
+      } else if (parsingString == 1) {
+        if (c == '\\') {
+          word[wordIndex++] = unescape(line[++lineIndex]);
+        } else if (c == '"') {
+          parsingString = 0;
+          Token *token = makeToken(tokens, row + 1, lineIndex - wordIndex, word, wordIndex);
+          token->OP_TYPE = OP_STR;
+          wordIndex = 0;
+          memset(word, 0, sizeof(word));
+        } else {
+          assert(wordIndex < MAX_WORD_SIZE, "Word is too long!");
+          word[wordIndex++] = c;
+        }
+      } else if (c == '"') {
+        parsingString = 1;
+      } else if (c == '/' && lineIndex < lengthOfLine - 1 && line[lineIndex+1] == '/') {
+        break;
+      } else if (c == ' ' || c == '\n') {
+        if (wordIndex == 0) {
+          continue;
+        }
+        makeToken(tokens, row + 1, lineIndex - wordIndex + 1, word, wordIndex);
+        wordIndex = 0;
+        memset(word, 0, sizeof(word));
+      } else {
+        assert(wordIndex < MAX_WORD_SIZE, "Word is too long!");
+        word[wordIndex++] = c;
+      }
+    }
+    row++;
+  }
+  free(line);
+}
+
+static void report(char *name, double elapsed, size_t size, int count) {
+  printf("%-10s %10.2f MB/s %12d tokens\n", name, size * (double) RUNS / elapsed / 1e6, count);
+}
+
+int main(int argc, char *argv[]) {
+  thisName = argv[0];
+  (void) argc;
+  arena = newArena();
+  initKeywords();
+
+  char filename[] = "/tmp/stackc-lex-XXXXXX";
+  int fd = mkstemp(filename);
+  assert(fd != -1, "Could not create the generated program.");
+  FILE *file = fdopen(fd, "w");
+  generate(file);
+  fclose(file);
+
+  Tokens *tokens = NULL;
+  size_t size = 0;
+  int run;
+  double elapsed = 0;
+  for (run = 0; run < RUNS; run++) {
+    resetArena(arena);
+    strings = newStrings();
+    tokens = newTokens();
+    FILE *source = fopen(filename, "r");
+    double start = now();
+    lexWithGetline(tokens, source);
+    elapsed += now() - start;
+    size = ftell(source);
+    fclose(source);
+  }
+  report("getline", elapsed, size, tokens->size);
+
+  elapsed = 0;
+  for (run = 0; run < RUNS; run++) {
+    resetArena(arena);
+    strings = newStrings();
+    tokens = newTokens();
+    double start = now();
+    char *source = mapSource(filename, &size);
+    lex(tokens, source, size);
+    elapsed += now() - start;
+    munmap(source, size);
+  }
+  report("mmap", elapsed, size, tokens->size);
+
+  unlink(filename);
+  return 0;
+}
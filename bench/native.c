@@ -0,0 +1,67 @@
+/* Benchmark for the native compiler: time per run of each program in bench/programs, */
+/* interpreted by stackc against compiled with `stackc -o` into a standalone executable. */
+/* Run from the repository root after building stackc. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS 5
+
+static char *programs[] = { "fib", "isprime", "fizzbuzz" };
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Best of RUNS runs of command, with its output discarded. */
+static double timeCommand(char *command) {
+  double best = 0;
+  int run;
+  for (run = 0; run < RUNS; run++) {
+    double start = now();
+    if (system(command) != 0) {
+      fprintf(stderr, "Failed: %s\n", command);
+      exit(1);
+    }
+    double elapsed = now() - start;
+    if (run == 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return best;
+}
+
+int main(void) {
+  char directory[] = "/tmp/stackc-native-XXXXXX";
+  if (mkdtemp(directory) == NULL) {
+    fprintf(stderr, "Could not create a directory for the executables.\n");
+    return 1;
+  }
+
+  printf("%-10s %12s %12s %10s\n", "program", "interpreted", "compiled", "speedup");
+  char command[512];
+  size_t i;
+  for (i = 0; i < sizeof(programs) / sizeof(programs[0]); i++) {
+    char binary[256];
+    snprintf(binary, sizeof(binary), "%s/%s", directory, programs[i]);
+    snprintf(command, sizeof(command), "./stackc -o %s bench/programs/%s.stc", binary, programs[i]);
+    if (system(command) != 0) {
+      fprintf(stderr, "Failed: %s\n", command);
+      return 1;
+    }
+
+    snprintf(command, sizeof(command), "./stackc bench/programs/%s.stc > /dev/null", programs[i]);
+    double interpreted = timeCommand(command);
+    snprintf(command, sizeof(command), "%s > /dev/null", binary);
+    double compiled = timeCommand(command);
+    printf("%-10s %10.3f s %10.3f s %9.2fx\n", programs[i], interpreted, compiled, interpreted / compiled);
+    unlink(binary);
+  }
+  rmdir(directory);
+  return 0;
+}
@@ -0,0 +1,70 @@
+/* Benchmark for the data stack: allocations and time per stack operation. */
+/* Builds against stackc.c directly, counting every block its arena allocates. */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static long allocations = 0;
+
+static void *countingMalloc(size_t size) {
+  allocations++;
+  return malloc(size);
+}
+
+#define malloc countingMalloc
+#define STACKC_NO_MAIN
+#include "../stackc.c"
+#undef malloc
+
+#define WINDOWS 8
+#define OPS_PER_WINDOW 4000000
+/* Values kept live on the stack while the loop runs, forcing it to grow in the first window. */
+#define LIVE_VALUES 100000
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]) {
+  thisName = argv[0];
+  arena = newArena();
+  (void) argc;
+  Stack *stack = newStack();
+  Token token;
+  memset(&token, 0, sizeof(token));
+  token.OP_TYPE = OP_INT;
+
+  printf("%-8s %12s %14s %10s\n", "window", "ops", "allocs/op", "ns/op");
+  int window;
+  for (window = 0; window < WINDOWS; window++) {
+    long allocationsBefore = allocations;
+    double start = now();
+    long ops = 0;
+    if (window == 0) {
+      for (; ops < LIVE_VALUES; ops++) {
+        token.value = (int) ops;
+        parseINT(stack, &token, 1);
+      }
+    }
+    /* `dup 1 + swap drop` keeps the depth constant: 5 ops per round. */
+    while (ops < OPS_PER_WINDOW) {
+      parseDUP(stack, &token, 1);
+      token.value = 1;
+      parseINT(stack, &token, 1);
+      parseADD(stack, &token, 1);
+      parseSWAP(stack, &token, 1);
+      parseDROP(stack, &token, 1);
+      ops += 5;
+    }
+    double elapsed = now() - start;
+    printf("%-8d %12ld %14.6f %10.2f\n", window, ops,
+      (double) (allocations - allocationsBefore) / ops, elapsed * 1e9 / ops);
+  }
+  printf("stack size: %d cells, capacity: %d cells\n", stack->size, stack->capacity);
+  printf("arena: %zu bytes in %d blocks\n", arena->bytes, arena->blocks);
+  return 0;
+}
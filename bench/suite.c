@@ -0,0 +1,237 @@
+/* Benchmark suite: runs each program in bench/programs, and a generated program of several */
+/* megabytes for lexing, several times through stackc. Reports the median time of each, the ops */
+/* it ran per second and its peak resident memory, optionally against a baseline saved before. */
+/* Run from the repository root after building stackc. */
+/*   -r runs       runs of each program (default 5) */
+/*   -w file       writes the results as JSON, to be used as a baseline */
+/*   -b file       compares against a baseline, exiting with 1 if anything regressed */
+/*   -t percent    how much slower than the baseline is a regression (default 10) */
+
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RUNS 5
+#define MAX_RUNS 100
+#define THRESHOLD 10
+#define SOURCE_SIZE (8 * 1024 * 1024)
+
+typedef struct Benchmark {
+  char *name;
+  char *path;           /* of the program, generated for lex */
+  double median;        /* seconds */
+  double opsPerSecond;
+  long peakRss;         /* kilobytes */
+  double baseline;      /* median of the baseline, 0 if it has none */
+} Benchmark;
+
+static Benchmark benchmarks[] = {
+  { "fib", "bench/programs/fib.stc", 0, 0, 0, 0 },
+  { "isprime", "bench/programs/isprime.stc", 0, 0, 0, 0 },
+  { "fizzbuzz", "bench/programs/fizzbuzz.stc", 0, 0, 0, 0 },
+  { "strings", "bench/programs/strings.stc", 0, 0, 0, 0 },
+  { "nesting", "bench/programs/nesting.stc", 0, 0, 0, 0 },
+  { "lex", NULL, 0, 0, 0, 0 },
+};
+#define BENCHMARKS ((int) (sizeof(benchmarks) / sizeof(benchmarks[0])))
+
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Writes a program of about SOURCE_SIZE bytes of definitions, each called once. */
+static void generate(FILE *file) {
+  long written = 0;
+  int i = 0;
+  while (written < SOURCE_SIZE) {
+    written += fprintf(file, "def word%d // n -> n + %d\n  if dup 0 < then \"negative\" . elseif 1 then %d + end\nend\n", i, i, i);
+    written += fprintf(file, "%d word%d drop\n", i, i);
+    i++;
+  }
+}
+
+/* Runs stackc with option (if not NULL) on path, with its output discarded. */
+/* Returns the time it took, and sets rss to its peak resident memory. */
+static double run(char *option, char *path, long *rss) {
+  double start = now();
+  pid_t pid = fork();
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, STDOUT_FILENO);
+    if (option != NULL) {
+      execl("./stackc", "./stackc", option, path, (char*) NULL);
+    } else {
+      execl("./stackc", "./stackc", path, (char*) NULL);
+    }
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  if (pid == -1 || wait4(pid, &status, 0, &usage) != pid || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    fprintf(stderr, "Failed: ./stackc %s%s%s\n", option != NULL ? option : "", option != NULL ? " " : "", path);
+    exit(1);
+  }
+  *rss = usage.ru_maxrss;
+  return now() - start;
+}
+
+static int compareTimes(const void *a, const void *b) {
+  double x = *(double*) a, y = *(double*) b;
+  return (x > y) - (x < y);
+}
+
+/* The ops a program runs, as counted by stackc -s. */
+static long countOps(char *path) {
+  char stats[] = "/tmp/stackc-stats-XXXXXX";
+  int fd = mkstemp(stats);
+  if (fd == -1) {
+    return 0;
+  }
+  close(fd);
+  char option[64];
+  snprintf(option, sizeof(option), "-s%s", stats);
+  long rss, ops = 0;
+  run(option, path, &rss);
+  FILE *file = fopen(stats, "r");
+  char line[256];
+  while (file != NULL && fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, " \"ops\": %ld", &ops) == 1) {
+      break;
+    }
+  }
+  if (file != NULL) {
+    fclose(file);
+  }
+  unlink(stats);
+  return ops;
+}
+
+/* Reads the medians of a baseline written with -w. */
+static int readBaseline(char *path) {
+  FILE *file = fopen(path, "r");
+  if (file == NULL) {
+    return 0;
+  }
+  char line[256], name[64];
+  double median;
+  while (fgets(line, sizeof(line), file) != NULL) {
+    if (sscanf(line, " {\"name\": \"%63[^\"]\", \"median\": %lf", name, &median) == 2) {
+      int i;
+      for (i = 0; i < BENCHMARKS; i++) {
+        if (strcmp(benchmarks[i].name, name) == 0) {
+          benchmarks[i].baseline = median;
+        }
+      }
+    }
+  }
+  fclose(file);
+  return 1;
+}
+
+static int writeResults(char *path, int runs) {
+  FILE *file = fopen(path, "w");
+  if (file == NULL) {
+    return 0;
+  }
+  fprintf(file, "{\n  \"runs\": %d,\n  \"benchmarks\": [\n", runs);
+  int i;
+  for (i = 0; i < BENCHMARKS; i++) {
+    Benchmark *benchmark = &benchmarks[i];
+    fprintf(file, "    {\"name\": \"%s\", \"median\": %.6f, \"opsPerSecond\": %.0f, \"peakRssKb\": %ld}%s\n",
+      benchmark->name, benchmark->median, benchmark->opsPerSecond, benchmark->peakRss, i < BENCHMARKS - 1 ? "," : "");
+  }
+  fprintf(file, "  ]\n}\n");
+  return fclose(file) == 0;
+}
+
+int main(int argc, char *argv[]) {
+  int runs = RUNS;
+  double threshold = THRESHOLD;
+  char *baseline = NULL, *results = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "r:w:b:t:")) != -1) {
+    switch (opt) {
+      case 'r': runs = atoi(optarg); break;
+      case 'w': results = optarg; break;
+      case 'b': baseline = optarg; break;
+      case 't': threshold = atof(optarg); break;
+      default:
+        fprintf(stderr, "Usage: `%s [-r runs] [-w results.json] [-b baseline.json] [-t percent]`\n", argv[0]);
+        return 1;
+    }
+  }
+  if (runs < 1 || runs > MAX_RUNS) {
+    fprintf(stderr, "Runs must be between 1 and %d.\n", MAX_RUNS);
+    return 1;
+  }
+  if (baseline != NULL && !readBaseline(baseline)) {
+    fprintf(stderr, "Baseline `%s` not found.\n", baseline);
+    return 1;
+  }
+
+  char generated[] = "/tmp/stackc-lex-XXXXXX.stc";
+  int fd = mkstemps(generated, 4);
+  if (fd == -1) {
+    fprintf(stderr, "Could not create the generated program.\n");
+    return 1;
+  }
+  FILE *file = fdopen(fd, "w");
+  generate(file);
+  fclose(file);
+
+  printf("%-10s %12s %14s %10s", "program", "median", "ops/s", "peak RSS");
+  if (baseline != NULL) {
+    printf(" %12s %8s", "baseline", "change");
+  }
+  printf("\n");
+  int regressions = 0;
+  int i;
+  for (i = 0; i < BENCHMARKS; i++) {
+    Benchmark *benchmark = &benchmarks[i];
+    if (benchmark->path == NULL) {
+      benchmark->path = generated;
+    }
+    double times[MAX_RUNS];
+    int j;
+    for (j = 0; j < runs; j++) {
+      long rss;
+      times[j] = run(NULL, benchmark->path, &rss);
+      if (rss > benchmark->peakRss) {
+        benchmark->peakRss = rss;
+      }
+    }
+    qsort(times, runs, sizeof(double), compareTimes);
+    benchmark->median = runs % 2 == 1 ? times[runs / 2] : (times[runs / 2 - 1] + times[runs / 2]) / 2;
+    benchmark->opsPerSecond = countOps(benchmark->path) / benchmark->median;
+    printf("%-10s %10.3f s %14.0f %7.1f MB", benchmark->name, benchmark->median,
+      benchmark->opsPerSecond, benchmark->peakRss / 1024.0);
+    if (benchmark->baseline > 0) {
+      double change = (benchmark->median / benchmark->baseline - 1) * 100;
+      printf(" %10.3f s %+7.1f%%", benchmark->baseline, change);
+      if (change > threshold) {
+        printf("  regressed");
+        regressions++;
+      }
+    }
+    printf("\n");
+  }
+  unlink(generated);
+
+  if (results != NULL && !writeResults(results, runs)) {
+    fprintf(stderr, "Could not write results to `%s`.\n", results);
+    return 1;
+  }
+  if (regressions > 0) {
+    printf("%d of %d programs regressed by more than %.0f%%.\n", regressions, BENCHMARKS, threshold);
+    return 1;
+  }
+  return 0;
+}
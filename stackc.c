@@ -1,13 +1,41 @@
+#define _GNU_SOURCE
+#include <dirent.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <errno.h>
 #include <unistd.h>
 
+#include "stackc.h"
+
 #define DEF_SIZE 64
 #define MAX_WORD_SIZE 1024
-#define PARSE_FUNC_TYPE Stack* stack, Queue* instructions, Definitions* definitions, Token* token
+#define STACK_INIT_SIZE 256
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 16
+#define OUTPUT_SIZE (64 * 1024)
+#define HOT_LOOP 1000
+#define PARSE_FUNC_TYPE Stack* stack, Token* token, int checked
+
+/* The globals of a context are per thread, so that --batch runs a context on each. */
+static __thread char *thisName;
+/* Reports what the interpreter does to speed up a program. */
+static int verbose = 0;
 
-static char *thisName;
+#define printUsage fprintf(stderr, "Usage: `%s [-clvCDJS] [-O0] [-o output] [-p|--profile profile] [-s[stats]|--stats[=stats]] filename`\n" \
+  "       `%s --batch [-cvDJ] [-O0] [-j threads] [-d directory] programs...`\n", thisName, thisName)
 
 typedef enum TYPE {
   TYPE_INT,
@@ -16,114 +44,355 @@ typedef enum TYPE {
   TYPE_COUNT,
 } TYPE;
 
+/* A cell holds a value and its type code in a single 64-bit word. */
+/* The type code is in the top byte and the value in the low 32 bits, */
+/* or for strings, a pointer to the string in the low 56 bits. */
+typedef uint64_t Cell;
+#define CELL_TYPE_SHIFT 56
+#define makeCell(type, value) (((Cell) (type) << CELL_TYPE_SHIFT) | (uint32_t) (value))
+#define makePointerCell(type, pointer) (((Cell) (type) << CELL_TYPE_SHIFT) | (uintptr_t) (pointer))
+#define cellType(cell) ((int) ((cell) >> CELL_TYPE_SHIFT))
+#define cellValue(cell) ((int) (uint32_t) (cell))
+#define cellPointer(cell) ((void*) (uintptr_t) ((cell) & (((Cell) 1 << CELL_TYPE_SHIFT) - 1)))
+
+/* Every operation in the order of enum OPS, with its word in a program ("" if it has none). */
+/* The enum, the keyword table and the dispatch table of execute() are all generated from this list. */
+#define FOR_EACH_OP(OP)                 \
+  OP(OP_UNKNOWN, "")                    \
+  OP(OP_INT, "")                        \
+  OP(OP_CHAR, "")                       \
+  OP(OP_STR, "")                        \
+  OP(OP_ADD, "+")                       \
+  OP(OP_SUB, "-")                       \
+  OP(OP_MUL, "*")                       \
+  OP(OP_DIV, "/")                       \
+  OP(OP_REM, "%")                       \
+  OP(OP_EQU, "=")                       \
+  OP(OP_NEQU, "!=")                     \
+  OP(OP_GTE, ">=")                      \
+  OP(OP_LTE, "<=")                      \
+  OP(OP_GT, ">")                        \
+  OP(OP_LT, "<")                        \
+  OP(OP_POP, ".")                       \
+  OP(OP_SIZE, ".s")                     \
+  OP(OP_PSTACK, ".stack")               \
+  OP(OP_DUP, "dup")                     \
+  OP(OP_DROP, "drop")                   \
+  OP(OP_SWAP, "swap")                   \
+  OP(OP_OVER, "over")                   \
+  OP(OP_ROT, "rot")                     \
+  OP(OP_IF, "if")                       \
+  OP(OP_ELSEIF, "elseif")               \
+  OP(OP_WHILE, "while")                 \
+  OP(OP_THEN, "then")                   \
+  OP(OP_DEF, "def")                     \
+  OP(OP_END, "end")                     \
+  OP(OP_CAST_INT, "(int)")              \
+  OP(OP_CAST_CHAR, "(char)")            \
+  /* Only generated by the compiler. */ \
+  OP(OP_JUMP, "")                       \
+  OP(OP_CALL, "")                       \
+  OP(OP_RETURN, "")                     \
+  OP(OP_HALT, "")                       \
+  /* Fused by the optimizer. */         \
+  OP(OP_CONST, "")                      \
+  OP(OP_ADD_CONST, "")                  \
+  OP(OP_EQU_CONST, "")                  \
+  OP(OP_NEQU_CONST, "")                 \
+  OP(OP_LT_CONST, "")                   \
+  OP(OP_GT_CONST, "")                   \
+  OP(OP_NEG, "")                        \
+  OP(OP_DUP2, "")                       \
+  OP(OP_NIP, "")                        \
+  OP(OP_ROT2, "")                       \
+  OP(OP_NOP, "")                        \
+  /* Installed in hot loops while running. */ \
+  OP(OP_DUP_CMP_THEN, "")               \
+  OP(OP_CMP_THEN, "")                   \
+  OP(OP_CMP2_THEN, "")                  \
+  OP(OP_ADD_CONST_JUMP, "")             \
+  /* Run where analyze() proved that the checks pass. */ \
+  FOR_EACH_UNCHECKED_OP(UNCHECKED_OP, OP) \
+  OP(OP_THEN_UNCHECKED, "")
+
+/* Operations with an _UNCHECKED variant, which calls their parser without checking the operands. */
+#define FOR_EACH_UNCHECKED_OP(X, OP)    \
+  X(OP, OP_ADD, parseADD)               \
+  X(OP, OP_SUB, parseSUB)               \
+  X(OP, OP_MUL, parseMUL)               \
+  X(OP, OP_DIV, parseDIV)               \
+  X(OP, OP_REM, parseREM)               \
+  X(OP, OP_EQU, parseEQU)               \
+  X(OP, OP_NEQU, parseNEQU)             \
+  X(OP, OP_GTE, parseGTE)               \
+  X(OP, OP_LTE, parseLTE)               \
+  X(OP, OP_GT, parseGT)                 \
+  X(OP, OP_LT, parseLT)                 \
+  X(OP, OP_POP, parsePOP)               \
+  X(OP, OP_DUP, parseDUP)               \
+  X(OP, OP_DROP, parseDROP)             \
+  X(OP, OP_SWAP, parseSWAP)             \
+  X(OP, OP_OVER, parseOVER)             \
+  X(OP, OP_ROT, parseROT)               \
+  X(OP, OP_CAST_INT, parseCASTINT)      \
+  X(OP, OP_CAST_CHAR, parseCASTCHAR)
+#define UNCHECKED_OP(OP, name, parser) OP(name##_UNCHECKED, "")
+
+#define OP_ENUM(name, word) name,
 typedef enum OPS {
-  OP_UNKNOWN,
-  OP_INT,
-  OP_CHAR,
-  OP_STR,
-  OP_ADD,
-  OP_SUB,
-  OP_MUL,
-  OP_DIV,
-  OP_REM,
-  OP_EQU,
-  OP_NEQU,
-  OP_GTE,
-  OP_LTE,
-  OP_GT,
-  OP_LT,
-  OP_POP,
-  OP_SIZE,
-  OP_PSTACK,
-  OP_DUP,
-  OP_DROP,
-  OP_SWAP,
-  OP_OVER,
-  OP_ROT,
-  OP_IF,
-  OP_ELSEIF,
-  OP_WHILE,
-  OP_THEN,
-  OP_DEF,
-  OP_END,
-  OP_CAST_INT,
-  OP_CAST_CHAR,
+  FOR_EACH_OP(OP_ENUM)
   OPS_COUNT /* size of enum OPS */
 } OPS;
 
-typedef struct Queue Queue;
-typedef struct QueueElem QueueElem;
-typedef struct Node Node;
+#define OP_WORD(name, word) word,
+static const char *const opWords[OPS_COUNT] = {
+  FOR_EACH_OP(OP_WORD)
+};
+
+#define OP_NAME(name, word) #name,
+static const char *const opNames[OPS_COUNT] = {
+  FOR_EACH_OP(OP_NAME)
+};
+
+/* Use threaded dispatch with computed gotos where the compiler supports them. */
+#if defined(__GNUC__) && !defined(STACKC_NO_THREADING)
+#define THREADED_DISPATCH 1
+#else
+#define THREADED_DISPATCH 0
+#endif
+
+typedef struct Arena Arena;
+typedef struct ArenaBlock ArenaBlock;
+typedef struct Output Output;
+typedef struct Strings Strings;
+typedef struct Tokens Tokens;
+typedef struct Instr Instr;
+typedef struct Program Program;
+typedef struct Sample Sample;
+typedef struct String String;
 typedef struct Stack Stack;
+typedef struct ReturnStack ReturnStack;
 typedef struct Token Token;
 typedef struct Definitions Definitions;
 typedef struct DefWord DefWord;
 
-/* Doubly Linked List implementation of a queue. */
-/* Does not break links between elements when polling. */
+/* Machine code compiled by the JIT, returning the instruction to carry on interpreting from. */
+typedef int (*JitCode)(Stack* stack, ReturnStack* calls);
+
+/* Region allocator: objects are carved out of large blocks and released all at once. */
+/* Nothing allocated from an arena is freed on its own; resetArena() rewinds the whole */
+/* arena in O(1) and keeps its blocks for reuse, freeArena() returns them to the system. */
+
+typedef struct Arena {
+  ArenaBlock *first;
+  ArenaBlock *current; /* blocks after current are free, left over from before a reset */
+  size_t bytes; /* bytes allocated since the last reset */
+  int blocks; /* blocks held */
+} Arena;
+
+typedef struct ArenaBlock {
+  ArenaBlock *next;
+  size_t size; /* bytes of data */
+  size_t used;
+  char *data;
+} ArenaBlock;
+
+/* Buffer for everything a program prints to stdout. */
+/* It is written out when full and at exit, after any error message on stderr. */
+/* When line buffered, it is also written out after every new line. */
+
+typedef struct Output {
+  int size;
+  int lineBuffered;
+  char buffer[OUTPUT_SIZE];
+} Output;
+
+/* Pool of interned strings, each distinct string is stored once. */
+/* A string is identified by the offset of its first character in chars, and is NULL terminated. */
+/* slots is an open addressing hash table of those offsets, -1 for an empty slot. */
+
+typedef struct Strings {
+  int size;
+  int capacity;
+  char* chars;
+  int count;
+  int slotsCapacity; /* a power of 2 */
+  int* slots;
+} Strings;
+
+/* Growable array of tokens, in the order they appear in the source. */
 
-typedef struct Queue {
+typedef struct Tokens {
   int size;
-  QueueElem* head;
-  QueueElem* tail;
-} Queue;
+  int capacity;
+  Token* tokens;
+} Tokens;
 
-typedef struct QueueElem {
+/* A compiled instruction. */
+/* arg is the jump target for `then` (when false) and OP_JUMP, or the body of the word for OP_CALL. */
+/* An op fused by optimize() stands for the len instructions starting at it, see optimize(). */
+
+typedef struct Instr {
+  uint16_t op; /* an OPS */
+  uint16_t len;
+  int arg;
   Token* token;
-  QueueElem* prev;
-  QueueElem* next;
-} QueueElem;
+} Instr;
 
-/* Linked List implementation of a stack. */
+/* Growable array of instructions, executed with an instruction pointer. */
+/* OP_STR pushes literals[arg], the string of its token. */
+/* counts holds the times each backward jump is taken and each word is called (at its first */
+/* instruction), NULL when not optimizing. jitted holds the machine code run in their place */
+/* once they are hot, NULL when the JIT is disabled. */
 
-typedef struct Node {
-  int value;
-  Node* next;
-} Node;
+typedef struct Program {
+  int size;
+  int capacity;
+  Instr* code;
+  int literalCount;
+  int literalCapacity;
+  String** literals;
+  int* counts;
+  Sample* sample;     /* counts of the hot loop being sampled for superinstructions */
+  JitCode* jitted;
+} Program;
+
+/* Reference counted string, shared by every cell holding it. */
+/* Strings are immutable, and freed when the last reference is released. */
+
+typedef struct String {
+  int refs;
+  int size;
+  char chars[]; /* NULL terminated */
+} String;
+
+/* Growable array implementation of a stack of cells. */
+/* The top of the stack is at values[size - 1]. */
+/* A string takes a single cell, holding a reference to it. */
 
 typedef struct Stack {
   int size;
-  Node* root;
+  int capacity;
+  Cell* values;
 } Stack;
 
+/* Growable array of the instructions to return to after each word being executed. */
+/* Calls do not recurse in C, so the depth of calls is only limited by memory. */
+
+typedef struct ReturnStack {
+  int size;
+  int capacity;
+  int* addresses;
+} ReturnStack;
+
 typedef struct Token {
   int row;
   int col;
   OPS OP_TYPE;
   int value;
-  char word[MAX_WORD_SIZE];
+  int word; /* the word, or contents of a string, in strings */
 } Token;
 
+/* Hash table of word definitions, keyed on the interned word. */
+/* Buckets are chained and doubled once there are more words than buckets. */
+
 typedef struct Definitions {
-  DefWord *head;
+  int size;
+  int capacity; /* number of buckets, a power of 2 */
+  DefWord **buckets;
 } Definitions;
 
 typedef struct DefWord {
-  char word[MAX_WORD_SIZE];
-  Queue *block;
+  int word; /* in strings */
+  int body; /* index of the first instruction of the word */
+  int constant; /* number of literals the body pushes if that is all it does, else -1 */
   DefWord *next;
 } DefWord;
 
+/* Everything of the program being run is allocated from arena. */
+static __thread Arena *arena;
+
+/* Strings of the program being run. */
+static __thread Strings *strings;
+
+#define stringAt(strings, id) ((strings)->chars + (id))
+
+/* Executable pages the code of a context's program is copied into once it is compiled. */
+typedef struct JitMemory {
+  unsigned char *pages;
+  size_t size;
+  size_t used;
+  struct JitMemory *full;  /* pages filled before these, allocated to keep track of them */
+} JitMemory;
+
+/* An interpreter: everything of the programs it loads and runs, for embedding StackC. */
+/* The globals above are those of the context being used, set by enterContext(). */
+struct StackC {
+  char *name;              /* printed in errors, as thisName */
+  int options;             /* STACKC_* */
+  Arena *arena;
+  Strings *strings;
+  Stack *stack;
+  Tokens *tokens;
+  Definitions *definitions;
+  Program *program;        /* NULL until a program is loaded */
+  char *cache;             /* where to cache the compiled program, for -C */
+  int native;              /* whether the program is compiled by compileNative() instead of run */
+  JitMemory jit;           /* code compiled from the program */
+  jmp_buf *escape;         /* where errors return to, exiting if NULL */
+  char *capture;           /* where output goes, NULL for stdout */
+  size_t captureCapacity;
+  size_t captured;         /* bytes printed, even past captureCapacity */
+  int growCapture;         /* whether capture is grown to fit instead of cut off, and freed with the context */
+  FILE *diagnostics;       /* errors and .stack, stderr unless output is captured */
+  char *diagnosticText;
+  size_t diagnosticSize;
+  char error[256];         /* message of the error that stopped the program, if any */
+};
+
+/* The context being used, NULL before there is one. */
+static __thread StackC *current = NULL;
+
+/* Where errors and .stack are printed. */
+static inline FILE* errorOutput(void) {
+  return current != NULL && current->diagnostics != NULL ? current->diagnostics : stderr;
+}
+
 /* Print Token for debugging. */
 void printToken(Token* token) {
-  fprintf(stderr, "-- [%s] Token --\n", thisName);
-  fprintf(stderr, "Position: %d %d\n", token->row, token->col);
-  fprintf(stderr, "OP_TYPE: %d\n", token->OP_TYPE);
-  fprintf(stderr, "Value: %d\n", token->value);
-  fprintf(stderr, "Word: %s\n", token->word);
+  FILE *file = errorOutput();
+  fprintf(file, "-- [%s] Token --\n", thisName);
+  fprintf(file, "Position: %d %d\n", token->row, token->col);
+  fprintf(file, "OP_TYPE: %d\n", token->OP_TYPE);
+  fprintf(file, "Value: %d\n", token->value);
+  fprintf(file, "Word: %s\n", stringAt(strings, token->word));
+}
+
+/* Reports a failed assertion. */
+void printAssertion(char *message, Token* token) {
+  fprintf(errorOutput(), "[%s] Assertion Error: %s\n", thisName, message);
+  if (token != NULL) {
+    printToken(token);
+  }
+}
+
+/* Reports a failed assertion and exits, or returns to the caller of the context with an error. */
+/* Kept out of line so that passing checks compile to a single branch. */
+_Noreturn void assertionError(char *message, Token* token) {
+  printAssertion(message, token);
+  if (current != NULL && current->escape != NULL) {
+    snprintf(current->error, sizeof(current->error), "%s", message);
+    longjmp(*current->escape, 1);
+  }
+  exit(1);
 }
 
 /* Assert with Token. */
-int assertWithToken(int truth, char *message, Token* token) {
+static inline int assertWithToken(int truth, char *message, Token* token) {
   if (truth == 0) {
-    fprintf(stderr, "[%s] Assertion Error: %s\n", thisName, message);
-    if (token != NULL) {
-      printToken(token);
-    }
-    exit(1);
-  } else {
-    return 1;
+    assertionError(message, token);
   }
+  return 1;
 }
 
 /* Python-like assertions. */
@@ -131,192 +400,549 @@ int assert(int truth, char *message) {
   return assertWithToken(truth, message, NULL);
 }
 
-/* Initialise a new queue. */
-Queue* newQueue(void) {
-  Queue *queue;
-  queue = (Queue*) malloc(sizeof(Queue));
-  queue->size = 0;
-  queue->head = NULL;
-  queue->tail = NULL;
-  return queue;
+/* Calls of malloc and the bytes they asked for, reported by -s. */
+static __thread long mallocCalls = 0;
+static __thread long mallocBytes = 0;
+
+/* Allocates with malloc, counting it. */
+void* allocate(size_t size) {
+  mallocCalls++;
+  mallocBytes += size;
+  return malloc(size);
 }
 
-/* Checking if a queue is empty. */
-int isEmptyQueue(Queue* queue) {
-  return queue->size == 0;
+/* Initialise an empty arena, its first block is only allocated when needed. */
+Arena* newArena(void) {
+  Arena *region = (Arena*) allocate(sizeof(Arena));
+  assert(region != NULL, "Out of memory while allocating arena.");
+  region->first = NULL;
+  region->current = NULL;
+  region->bytes = 0;
+  region->blocks = 0;
+  return region;
 }
 
-/* Push to queue. */
-void pushQueue(Queue* queue, Token* token) {
-  QueueElem *elem;
-  elem = (QueueElem*) malloc(sizeof(QueueElem));
-  elem->token = token;
-  elem->next = NULL;
-  if (isEmptyQueue(queue)) {
-    queue->head = elem;
-    queue->tail = elem;
-    elem->prev = NULL;
+/* Allocates a block holding at least size bytes, placed right after the current one. */
+static ArenaBlock* newArenaBlock(Arena* region, size_t size) {
+  size_t header = (sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if (size < ARENA_BLOCK_SIZE) {
+    size = ARENA_BLOCK_SIZE;
+  }
+  ArenaBlock *block = (ArenaBlock*) allocate(header + size);
+  assert(block != NULL, "Out of memory while growing arena.");
+  block->size = size;
+  block->used = 0;
+  block->data = (char*) block + header;
+  if (region->current == NULL) {
+    block->next = region->first;
+    region->first = block;
   } else {
-    QueueElem *prevLast = queue->tail;
-    prevLast->next = elem;
-    elem->prev = prevLast;
-    queue->tail = elem;
+    block->next = region->current->next;
+    region->current->next = block;
+  }
+  region->blocks++;
+  return block;
+}
+
+/* Allocates size bytes, aligned for any type. */
+void* arenaAlloc(Arena* region, size_t size) {
+  size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  ArenaBlock *block = region->current;
+  if (block == NULL || block->size - block->used < size) {
+    /* Blocks left over from before a reset are reused when large enough. */
+    ArenaBlock *next = block == NULL ? region->first : block->next;
+    if (next != NULL && next->size >= size) {
+      next->used = 0;
+      block = next;
+    } else {
+      block = newArenaBlock(region, size);
+    }
+    region->current = block;
   }
-  queue->size++;
+  void *pointer = block->data + block->used;
+  block->used += size;
+  region->bytes += size;
+  return pointer;
 }
 
-/* Poll head of queue. */
-QueueElem* pollQueue(Queue* queue) {
-  assert(!isEmptyQueue(queue), "Polling from empty queue.");
-  QueueElem *prevHead = queue->head;
-  QueueElem *newHead = prevHead->next;
-  queue->head = newHead;
-  /* newHead will maintain the reference to the now polled prev. */
-  queue->size--;
-  return prevHead;
+/* Resizes an allocation of oldSize bytes to newSize bytes, returning where it now is. */
+/* The last allocation grows in place if its block has room, otherwise it is copied. */
+void* arenaGrow(Arena* region, void* pointer, size_t oldSize, size_t newSize) {
+  ArenaBlock *block = region->current;
+  oldSize = (oldSize + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  newSize = (newSize + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+  if (block != NULL && (char*) pointer + oldSize == block->data + block->used
+      && block->size - block->used >= newSize - oldSize) {
+    block->used += newSize - oldSize;
+    region->bytes += newSize - oldSize;
+    return pointer;
+  }
+  void *moved = arenaAlloc(region, newSize);
+  memcpy(moved, pointer, oldSize < newSize ? oldSize : newSize);
+  return moved;
 }
 
-/* Peek head of queue. */
-QueueElem* peekQueue(Queue* queue) {
-  assert(!isEmptyQueue(queue), "Peeking empty queue.");
-  return queue->head;
+/* Formats a message into the arena, like asprintf. */
+char* arenaPrintf(Arena* region, const char *format, ...) {
+  va_list args;
+  va_start(args, format);
+  int length = vsnprintf(NULL, 0, format, args);
+  va_end(args);
+  char *message = (char*) arenaAlloc(region, length + 1);
+  va_start(args, format);
+  vsnprintf(message, length + 1, format, args);
+  va_end(args);
+  return message;
 }
 
-/* Get previous queue even when polled. */
-QueueElem* prevQueueElem(QueueElem* currentElem) {
-  QueueElem *prevElem = currentElem->prev;
-  assert(prevElem != NULL, "Previous element should not be null.");
-  return prevElem;
+/* Releases everything allocated from the arena at once, keeping its blocks. */
+void resetArena(Arena* region) {
+  region->current = NULL;
+  region->bytes = 0;
 }
 
-/* Copy a queue. */
-Queue* copyQueue(Queue* queue) {
-  Queue *result = newQueue();
-  QueueElem *elem = queue->head;
-  while (elem != NULL) {
-    pushQueue(result, elem->token);
-    elem = elem->next;
+/* Returns the blocks of an arena to the system. */
+void freeArena(Arena* region) {
+  ArenaBlock *block = region->first;
+  while (block != NULL) {
+    ArenaBlock *next = block->next;
+    free(block);
+    block = next;
   }
-  return result;
+  free(region);
 }
 
-/* Concats 2 queues, value is saved in the second. */
-void concatQueues(Queue *block, Queue *instructions) {
-  if (isEmptyQueue(block)) {
-    /* do nothing */
-  } else if (isEmptyQueue(instructions)) {
-    instructions->size = block->size;
-    instructions->head = block->head;
-    instructions->tail = block->tail;
-  } else {
-    instructions->size += block->size;
-    block->tail->next = instructions->head;
-    instructions->head->prev = block->tail;
-    instructions->head = block->head;
+/* FNV-1a hash of the first length characters of a word. */
+uint32_t hashWord(const char *word, size_t length) {
+  uint32_t hash = 2166136261u;
+  size_t i;
+  for (i = 0; i < length; i++) {
+    hash ^= (unsigned char) word[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+/* Initialise an empty pool of strings. */
+Strings* newStrings(void) {
+  Strings *pool;
+  pool = (Strings*) arenaAlloc(arena, sizeof(Strings));
+  pool->size = 0;
+  pool->capacity = 1024;
+  pool->chars = (char*) arenaAlloc(arena, pool->capacity);
+  pool->count = 0;
+  pool->slotsCapacity = 256;
+  pool->slots = (int*) arenaAlloc(arena, sizeof(int) * pool->slotsCapacity);
+  memset(pool->slots, -1, sizeof(int) * pool->slotsCapacity);
+  return pool;
+}
+
+/* Slot of a word in the pool: the slot holding it, or the empty slot where it belongs. */
+static inline int findStringSlot(Strings* pool, const char *word, size_t length, uint32_t hash) {
+  int mask = pool->slotsCapacity - 1;
+  int slot = hash & mask;
+  while (pool->slots[slot] != -1) {
+    char *existing = pool->chars + pool->slots[slot];
+    if (strncmp(existing, word, length) == 0 && existing[length] == '\0') {
+      break;
+    }
+    slot = (slot + 1) & mask;
+  }
+  return slot;
+}
+
+/* Doubles the slots of the pool, rehashing every string. */
+void growStringSlots(Strings* pool) {
+  int *old = pool->slots, oldCapacity = pool->slotsCapacity;
+  pool->slotsCapacity *= 2;
+  pool->slots = (int*) arenaAlloc(arena, sizeof(int) * pool->slotsCapacity);
+  memset(pool->slots, -1, sizeof(int) * pool->slotsCapacity);
+  int i;
+  for (i = 0; i < oldCapacity; i++) {
+    if (old[i] != -1) {
+      char *word = pool->chars + old[i];
+      size_t length = strlen(word);
+      pool->slots[findStringSlot(pool, word, length, hashWord(word, length))] = old[i];
+    }
+  }
+}
+
+/* Id of the first length characters of word, adding them to the pool if they are new. */
+int internString(Strings* pool, const char *word, size_t length) {
+  uint32_t hash = hashWord(word, length);
+  int slot = findStringSlot(pool, word, length, hash);
+  if (pool->slots[slot] != -1) {
+    return pool->slots[slot];
+  }
+  if (pool->size + (int) length + 1 > pool->capacity) {
+    int capacity = pool->capacity;
+    while (pool->size + (int) length + 1 > capacity) {
+      capacity *= 2;
+    }
+    pool->chars = (char*) arenaGrow(arena, pool->chars, pool->capacity, capacity);
+    pool->capacity = capacity;
+  }
+  int id = pool->size;
+  memcpy(pool->chars + id, word, length);
+  pool->chars[id + length] = '\0';
+  pool->size += length + 1;
+  pool->slots[slot] = id;
+  if (++pool->count * 2 > pool->slotsCapacity) {
+    growStringSlots(pool);
+  }
+  return id;
+}
+
+/* Initialise a new array of tokens. */
+Tokens* newTokens(void) {
+  Tokens *tokens;
+  tokens = (Tokens*) arenaAlloc(arena, sizeof(Tokens));
+  tokens->size = 0;
+  tokens->capacity = 64;
+  tokens->tokens = (Token*) arenaAlloc(arena, sizeof(Token) * tokens->capacity);
+  return tokens;
+}
+
+/* Append an empty token, returning it. */
+/* The token moves when more are appended, so its address should not be kept while lexing. */
+Token* pushTokens(Tokens* tokens) {
+  if (tokens->size == tokens->capacity) {
+    tokens->tokens = (Token*) arenaGrow(arena, tokens->tokens,
+      sizeof(Token) * tokens->capacity, sizeof(Token) * tokens->capacity * 2);
+    tokens->capacity *= 2;
+  }
+  return &tokens->tokens[tokens->size++];
+}
+
+/* Initialise an empty program. */
+Program* newProgram(void) {
+  Program *program;
+  program = (Program*) arenaAlloc(arena, sizeof(Program));
+  program->size = 0;
+  program->capacity = 64;
+  program->code = (Instr*) arenaAlloc(arena, sizeof(Instr) * program->capacity);
+  program->literalCount = 0;
+  program->literalCapacity = 16;
+  program->literals = (String**) arenaAlloc(arena, sizeof(String*) * program->literalCapacity);
+  program->counts = NULL;
+  program->sample = NULL;
+  program->jitted = NULL;
+  return program;
+}
+
+/* Append an instruction, returning its index. */
+int emit(Program* program, OPS op, int arg, Token* token) {
+  if (program->size == program->capacity) {
+    program->code = (Instr*) arenaGrow(arena, program->code,
+      sizeof(Instr) * program->capacity, sizeof(Instr) * program->capacity * 2);
+    program->capacity *= 2;
   }
+  Instr *instr = &program->code[program->size];
+  instr->op = op;
+  instr->len = 1;
+  instr->arg = arg;
+  instr->token = token;
+  return program->size++;
 }
 
 /* Initialise a new stack. */
 Stack* newStack(void) {
   Stack *stack;
-  stack = (Stack*) malloc(sizeof(Stack));
+  stack = (Stack*) arenaAlloc(arena, sizeof(Stack));
   stack->size = 0;
-  stack->root = NULL;
+  stack->capacity = STACK_INIT_SIZE;
+  stack->values = (Cell*) arenaAlloc(arena, sizeof(Cell) * stack->capacity);
   return stack;
 }
 
 /* Checking if a stack is empty. */
-int isEmptyStack(Stack* stack) {
+static inline int isEmptyStack(Stack* stack) {
   return stack->size == 0;
 }
 
-/* Push an integer onto a stack. */
-int pushStack(Stack* stack, int value) {
-  Node* newNode;
-  newNode = (Node*) malloc(sizeof(Node));
-  newNode->value = value;
-  newNode->next = stack->root;
-  stack->root = newNode;
-  stack->size++;
+/* Doubles the capacity of a stack, so pushes are amortised O(1). */
+void growStack(Stack* stack) {
+  stack->values = (Cell*) arenaGrow(arena, stack->values,
+    sizeof(Cell) * stack->capacity, sizeof(Cell) * stack->capacity * 2);
+  stack->capacity *= 2;
+}
+
+/* Push a cell onto a stack. */
+static inline int pushStack(Stack* stack, Cell cell) {
+  if (stack->size == stack->capacity) {
+    growStack(stack);
+  }
+  stack->values[stack->size++] = cell;
   return 1;
 }
 
-/* Peek at the first element of the stack. */
-int peekStack(Stack* stack, Token* token) {
+/* Peek at the first cell of the stack. */
+static inline Cell peekStack(Stack* stack, Token* token) {
   assertWithToken(!isEmptyStack(stack), "Stack underflow while peeking stack.\n", token);
-  return stack->root->value;
+  return stack->values[stack->size - 1];
 }
 
-/* Pops the first element of the stack. */
-int popStack(Stack* stack, Token* token) {
+/* Pops the first cell of the stack. */
+static inline Cell popStack(Stack* stack, Token* token) {
   assertWithToken(!isEmptyStack(stack), "Stack underflow while popping stack.\n", token);
-  Node* poppedNode = stack->root;
-  stack->root = poppedNode->next;
-  stack->size--;
-  return poppedNode->value;
+  return stack->values[--stack->size];
+}
+
+/* Cell `depth` positions below the top of the stack, 0 being the top. */
+static inline Cell stackAt(Stack* stack, int depth) {
+  return stack->values[stack->size - 1 - depth];
+}
+
+/* Size of the stack as counted before cells were tagged and strings moved off the stack. */
+/* Ints and chars took 2 cells (value and type code), strings took size + 3. */
+int legacyStackSize(Stack* stack) {
+  int size = 0, i;
+  for (i = 0; i < stack->size; i++) {
+    Cell cell = stack->values[i];
+    size += cellType(cell) == TYPE_STR ? ((String*) cellPointer(cell))->size + 3 : 2;
+  }
+  return size;
 }
 
-/* Prints contents of a stack. */
+/* Prints contents of a stack, each value followed by its type code as before tagging. */
+/* A string is printed as its size followed by its characters and NULL character, as it was stored before. */
 void printStack(Stack* stack) {
-  Node *node = stack->root;
-  fprintf(stderr, "-- [%s] Stack (size: %d) --\n", thisName, stack->size);
-  while (node != NULL) {
-    fprintf(stderr, "%d ", node->value);
-    node = node->next;
+  FILE *file = errorOutput();
+  int i;
+  fprintf(file, "-- [%s] Stack (size: %d) --\n", thisName, legacyStackSize(stack));
+  for (i = stack->size - 1; i >= 0; i--) {
+    Cell cell = stack->values[i];
+    if (cellType(cell) == TYPE_STR) {
+      String *string = (String*) cellPointer(cell);
+      fprintf(file, "%d %d ", TYPE_STR, string->size);
+      int j;
+      for (j = 0; j <= string->size; j++) {
+        fprintf(file, "%d ", string->chars[j]);
+      }
+    } else {
+      fprintf(file, "%d %d ", cellType(cell), cellValue(cell));
+    }
+  }
+  fprintf(file, "EOS\n");
+}
+
+/* Allocates a string holding the first size characters of chars, with a single reference. */
+String* newString(const char *chars, int size) {
+  String *string = (String*) allocate(sizeof(String) + size + 1);
+  assert(string != NULL, "Out of memory while allocating string.");
+  string->refs = 1;
+  string->size = size;
+  memcpy(string->chars, chars, size);
+  string->chars[size] = '\0';
+  return string;
+}
+
+/* Takes another reference to the string in a cell, if it holds one. Returns the cell. */
+static inline Cell retainCell(Cell cell) {
+  if (cellType(cell) == TYPE_STR) {
+    ((String*) cellPointer(cell))->refs++;
+  }
+  return cell;
+}
+
+/* Gives up the reference to the string in a cell, if it holds one. */
+static inline void releaseCell(Cell cell) {
+  if (cellType(cell) == TYPE_STR) {
+    String *string = (String*) cellPointer(cell);
+    if (--string->refs == 0) {
+      free(string);
+    }
+  }
+}
+
+/* Adds the string of a token to the literals of a program, returning its index. */
+int addLiteral(Program* program, Token* token) {
+  char *word = stringAt(strings, token->word);
+  int size = strlen(word);
+  assertWithToken(size < MAX_WORD_SIZE, "String has no NULL terminating character.", token);
+  if (program->literalCount == program->literalCapacity) {
+    program->literals = (String**) arenaGrow(arena, program->literals,
+      sizeof(String*) * program->literalCapacity, sizeof(String*) * program->literalCapacity * 2);
+    program->literalCapacity *= 2;
+  }
+  program->literals[program->literalCount] = newString(word, size);
+  return program->literalCount++;
+}
+
+/* Standard output of the program being run. */
+static __thread Output output;
+
+/* Writes out everything in the output buffer, or copies it to where it is captured. */
+void flushOutput(void) {
+  if (current != NULL) {
+    if (current->growCapture && current->captured + output.size > current->captureCapacity) {
+      size_t capacity = current->captureCapacity * 2;
+      if (capacity < current->captured + output.size) {
+        capacity = current->captured + output.size;
+      }
+      current->capture = (char*) realloc(current->capture, capacity);
+      assert(current->capture != NULL, "Out of memory while capturing output.");
+      current->captureCapacity = capacity;
+    }
+    if (current->capture != NULL && current->captured < current->captureCapacity) {
+      size_t room = current->captureCapacity - current->captured;
+      memcpy(current->capture + current->captured, output.buffer, (size_t) output.size < room ? (size_t) output.size : room);
+    }
+    current->captured += output.size;
+    if (current->capture != NULL) {
+      output.size = 0;
+      return;
+    }
+  }
+  int written = 0;
+  while (written < output.size) {
+    ssize_t result = write(STDOUT_FILENO, output.buffer + written, output.size - written);
+    if (result < 0 && errno == EINTR) {
+      continue;
+    } else if (result <= 0) {
+      /* Nowhere to print to, the output is lost. */
+      break;
+    }
+    written += result;
+  }
+  output.size = 0;
+}
+
+/* Prints a character. */
+static inline void printChar(char c) {
+  if (output.size == OUTPUT_SIZE) {
+    flushOutput();
+  }
+  output.buffer[output.size++] = c;
+  if (c == '\n' && output.lineBuffered) {
+    flushOutput();
+  }
+}
+
+/* Prints an integer in decimal, formatting it from the last digit. */
+static inline void printInt(int value) {
+  char digits[12];
+  char *end = digits + sizeof(digits), *start = end;
+  uint32_t magnitude = value < 0 ? -(uint32_t) value : (uint32_t) value;
+  do {
+    *--start = '0' + magnitude % 10;
+    magnitude /= 10;
+  } while (magnitude != 0);
+  if (value < 0) {
+    *--start = '-';
+  }
+  if (output.size + (end - start) > OUTPUT_SIZE) {
+    flushOutput();
+  }
+  memcpy(output.buffer + output.size, start, end - start);
+  output.size += end - start;
+}
+
+/* Prints a string, copying it into the buffer a chunk at a time. */
+static inline void printString(String* string) {
+  int i = 0;
+  while (i < string->size) {
+    if (output.size == OUTPUT_SIZE) {
+      flushOutput();
+    }
+    int chunk = string->size - i < OUTPUT_SIZE - output.size ? string->size - i : OUTPUT_SIZE - output.size;
+    memcpy(output.buffer + output.size, string->chars + i, chunk);
+    output.size += chunk;
+    i += chunk;
+  }
+  if (output.lineBuffered && memchr(string->chars, '\n', string->size) != NULL) {
+    flushOutput();
   }
-  fprintf(stderr, "EOS\n");
+}
+
+/* Initialise a new return stack. */
+ReturnStack* newReturnStack(void) {
+  ReturnStack *calls;
+  calls = (ReturnStack*) arenaAlloc(arena, sizeof(ReturnStack));
+  calls->size = 0;
+  calls->capacity = STACK_INIT_SIZE;
+  calls->addresses = (int*) arenaAlloc(arena, sizeof(int) * calls->capacity);
+  return calls;
+}
+
+/* Push the instruction to return to. */
+static inline void pushReturn(ReturnStack* calls, int ip) {
+  if (calls->size == calls->capacity) {
+    calls->addresses = (int*) arenaGrow(arena, calls->addresses,
+      sizeof(int) * calls->capacity, sizeof(int) * calls->capacity * 2);
+    calls->capacity *= 2;
+  }
+  calls->addresses[calls->size++] = ip;
+}
+
+/* Pop the instruction to return to. */
+static inline int popReturn(ReturnStack* calls, Token* token) {
+  assertWithToken(calls->size > 0, "Return without a call.", token);
+  return calls->addresses[--calls->size];
 }
 
 /* Initialise Definitions. */
 Definitions* newDefinitions() {
-  Definitions *definitions = malloc(sizeof(*definitions) * DEF_SIZE);
-  int i;
-  for (i = 0; i < DEF_SIZE; i++) {
-    Definitions *definition;
-    definition = (Definitions*) malloc(sizeof(DefWord));
-    definition->head = NULL;
-    definitions[i] = *definition;
-  }
+  Definitions *definitions = (Definitions*) arenaAlloc(arena, sizeof(Definitions));
+  definitions->size = 0;
+  definitions->capacity = DEF_SIZE;
+  definitions->buckets = (DefWord**) arenaAlloc(arena, sizeof(DefWord*) * definitions->capacity);
+  memset(definitions->buckets, 0, sizeof(DefWord*) * definitions->capacity);
   return definitions;
 }
 
-int getHeadIndex(char *word) {
-  int headsSize = DEF_SIZE - 1;
-  char heads[] = {
-    'A','B','C','D','E','F','G','H','I','J','K','L','M','N','O','P','Q','R','S','T','U','V','W','X','Y','Z',
-    'a','b','c','d','e','f','g','h','i','j','k','l','m','n','o','p','q','r','s','t','u','v','w','x','y','z',
-    '0','1','2','3','4','5','6','7','8','9','_'
-  };
-  char first = word[0];
-  int index;
-  for (index = 0; index < headsSize; index++) {
-    char head = heads[index];
-    if (first == head) {
-      break;
+/* Hash of an interned word, spreading the offsets of interned strings over the buckets. */
+#define hashDefinition(word) ((uint32_t) (word) * 2654435761u)
+
+/* Doubles the number of buckets, moving every definition to its new bucket. */
+/* Shadowed definitions stay behind the ones shadowing them. */
+void growDefinitions(Definitions *definitions) {
+  int capacity = definitions->capacity * 2;
+  DefWord **buckets = (DefWord**) arenaAlloc(arena, sizeof(DefWord*) * capacity);
+  DefWord **tails = (DefWord**) arenaAlloc(arena, sizeof(DefWord*) * capacity);
+  memset(buckets, 0, sizeof(DefWord*) * capacity);
+  memset(tails, 0, sizeof(DefWord*) * capacity);
+  int i;
+  for (i = 0; i < definitions->capacity; i++) {
+    DefWord *definition = definitions->buckets[i];
+    while (definition != NULL) {
+      DefWord *next = definition->next;
+      int index = hashDefinition(definition->word) & (capacity - 1);
+      definition->next = NULL;
+      if (tails[index] == NULL) {
+        buckets[index] = definition;
+      } else {
+        tails[index]->next = definition;
+      }
+      tails[index] = definition;
+      definition = next;
     }
   }
-  return index;
+  definitions->buckets = buckets;
+  definitions->capacity = capacity;
 }
 
-/* Add a word definition. */
-void addDefinition(Definitions definitions[], char *word, Queue *block) {
-  int index = getHeadIndex(word);
-  Definitions *group = &definitions[index];
+/* Add a word definition, shadowing any previous definition of the word. */
+void addDefinition(Definitions *definitions, int word, int body) {
+  if (definitions->size >= definitions->capacity) {
+    growDefinitions(definitions);
+  }
   DefWord *definition;
-  definition = (DefWord*) malloc(sizeof(DefWord));
-  strncpy(definition->word, word, MAX_WORD_SIZE);
-  definition->block = block;
-  definition->next = group->head;
-  group->head = definition;
+  definition = (DefWord*) arenaAlloc(arena, sizeof(DefWord));
+  definition->word = word;
+  definition->body = body;
+  definition->constant = -1;
+  DefWord **bucket = &definitions->buckets[hashDefinition(word) & (definitions->capacity - 1)];
+  definition->next = *bucket;
+  *bucket = definition;
+  definitions->size++;
 }
 
 /* Find definition of a word, NULL if not found. */
-DefWord* findDefinition(Definitions definitions[], char *word) {
-  int index = getHeadIndex(word);
-  Definitions *group = &definitions[index];
-  DefWord *definition = group->head;
+DefWord* findDefinition(Definitions *definitions, int word) {
+  DefWord *definition = definitions->buckets[hashDefinition(word) & (definitions->capacity - 1)];
   while (definition != NULL) {
-    if (strncmp(word, definition->word, MAX_WORD_SIZE) == 0) {
+    if (definition->word == word) {
       return definition;
     }
     definition = definition->next;
@@ -324,25 +950,6 @@ DefWord* findDefinition(Definitions definitions[], char *word) {
   return NULL;
 }
 
-/* Checks if a string is a representation of an integer. */
-int isNumber(char* word) {
-  char current;
-  size_t i;
-  for (i = 0; i < MAX_WORD_SIZE; i++) {
-    current = word[i];
-    if (current == 0) {
-      /* 0 is the EOF character */
-      return 1;
-    } else if (i == 0 && current == '-' && word[i+1] != 0) {
-      /* okay to have `-` at the start, and make sure it is not a single `-` */
-    } else if (current < 48 || current > 57) {
-      return 0;
-    }
-  }
-  assert(0, "Word does not terminate.");
-  return 0;
-}
-
 int isString(char *word) {
   if (word[0] != '"') {
     return 0;
@@ -356,578 +963,215 @@ int isString(char *word) {
   return 0;
 }
 
-/* Declaration here to use it in controlIf. */
-void parseQueue(Stack* stack, Queue* instructions, Definitions* definitions, QueueElem* queueElem);
-
-void parseUNKNOWN(PARSE_FUNC_TYPE) {
-  DefWord *definition = findDefinition(definitions, token->word);
-  if (definition == NULL) {
-    char *message;
-    asprintf(&message, "Word `%s` not implemented yet.", token->word);
-    assertWithToken(0, message, token);
-  }
-  /* Add block to instructions. */
-  Queue *block = definition->block;
-  concatQueues(block, instructions);
-}
+/* Parsers are passed whether to check their operands. The checks are skipped for instructions */
+/* analyze() proved cannot fail, which run the _UNCHECKED variant of their op instead. */
+#define checkedAssert(truth, message) ((void) (!checked || assertWithToken(truth, message, token)))
+#define checkedPop() (checked ? popStack(stack, token) : stack->values[--stack->size])
+#define checkedPeek() (checked ? peekStack(stack, token) : stack->values[stack->size - 1])
 
-void parseINT(PARSE_FUNC_TYPE) {
-  pushStack(stack, token->value);
-  pushStack(stack, TYPE_INT);
+static inline void parseINT(PARSE_FUNC_TYPE) {
+  pushStack(stack, makeCell(TYPE_INT, token->value));
 }
 
-void parseCHAR(PARSE_FUNC_TYPE) {
-  pushStack(stack, token->value);
-  pushStack(stack, TYPE_CHAR);
+static inline void parseCHAR(PARSE_FUNC_TYPE) {
+  pushStack(stack, makeCell(TYPE_CHAR, token->value));
 }
 
-void parseSTR(PARSE_FUNC_TYPE) {
-  /* Parses a string. */
-  /* The string size will be at the top of the stack, followed by `n` characters in ascii and then the terminating NULL character. */
-  char *word = token->word;
-  Stack *chars = newStack();
-  int hasEnd = 0, size = 0;
-  char current;
-  int i;
-  for (i = 0; i < MAX_WORD_SIZE; i++) {
-    current = word[i];
-    if (current == '\0') {
-      pushStack(stack, 0);
-      hasEnd = 1;
-      break;
-    } else {
-      pushStack(chars, current);
-      size++;
-    }
-  }
-  assertWithToken(hasEnd == 1, "String has no NULL terminating character.", token);
-  while (!isEmptyStack(chars)) {
-    current = popStack(chars, token);
-    pushStack(stack, current);
-  }
-  pushStack(stack, size);
-  pushStack(stack, TYPE_STR);
+/* Pushes a string literal, whose first reference is held by the program. */
+static inline void parseSTR(Stack* stack, String* literal) {
+  literal->refs++;
+  pushStack(stack, makePointerCell(TYPE_STR, literal));
 }
 
 /* If both a or b are int, the result will be a int. Else, it will be a char. */
-void parseADD(PARSE_FUNC_TYPE) {
-  int a_type = popStack(stack, token);
-  int a = popStack(stack, token);
-  assertWithToken(a_type == TYPE_INT || a_type == TYPE_CHAR, "+ is only defined for int and char.", token);
-  int b_type = popStack(stack, token);
-  int b = popStack(stack, token);
-  assertWithToken(b_type == TYPE_INT || b_type == TYPE_CHAR, "+ is only defined for int and char.", token);
-  assertWithToken(a_type != TYPE_CHAR || b_type != TYPE_CHAR, "char char + not supported", token);
-  pushStack(stack, b + a);
+static inline void parseADD(PARSE_FUNC_TYPE) {
+  Cell a = checkedPop();
+  int a_type = cellType(a);
+  checkedAssert(a_type == TYPE_INT || a_type == TYPE_CHAR, "+ is only defined for int and char.");
+  Cell b = checkedPop();
+  int b_type = cellType(b);
+  checkedAssert(b_type == TYPE_INT || b_type == TYPE_CHAR, "+ is only defined for int and char.");
+  checkedAssert(a_type != TYPE_CHAR || b_type != TYPE_CHAR, "char char + not supported");
   if (a_type == TYPE_INT && b_type == TYPE_INT) {
-    pushStack(stack, TYPE_INT);
+    pushStack(stack, makeCell(TYPE_INT, cellValue(b) + cellValue(a)));
   } else {
-    pushStack(stack, TYPE_CHAR);
+    pushStack(stack, makeCell(TYPE_CHAR, cellValue(b) + cellValue(a)));
   }
 }
 
-void parseSUB(PARSE_FUNC_TYPE) {
-  int a_type = popStack(stack, token);
-  int a = popStack(stack, token);
-  assertWithToken(a_type == TYPE_INT || a_type == TYPE_CHAR, "- is only defined for int and char.", token);
-  int b_type = popStack(stack, token);
-  int b = popStack(stack, token);
-  assertWithToken(b_type == TYPE_INT || b_type == TYPE_CHAR, "- is only defined for int and char.", token);
-  pushStack(stack, b - a);
+static inline void parseSUB(PARSE_FUNC_TYPE) {
+  Cell a = checkedPop();
+  int a_type = cellType(a);
+  checkedAssert(a_type == TYPE_INT || a_type == TYPE_CHAR, "- is only defined for int and char.");
+  Cell b = checkedPop();
+  int b_type = cellType(b);
+  checkedAssert(b_type == TYPE_INT || b_type == TYPE_CHAR, "- is only defined for int and char.");
   if (a_type == TYPE_INT && b_type == TYPE_INT) {
-    pushStack(stack, TYPE_INT);
+    pushStack(stack, makeCell(TYPE_INT, cellValue(b) - cellValue(a)));
   } else if (a_type == TYPE_INT && b_type == TYPE_CHAR) {
-    pushStack(stack, TYPE_CHAR);
+    pushStack(stack, makeCell(TYPE_CHAR, cellValue(b) - cellValue(a)));
   } else {
-    assertWithToken(0, "- is only defined for int int - and char int -", token);
+    checkedAssert(0, "- is only defined for int int - and char int -");
   }
 }
 
-void parseMUL(PARSE_FUNC_TYPE) {
-  int a_type = popStack(stack, token);
-  int a = popStack(stack, token);
-  int b_type = popStack(stack, token);
-  int b = popStack(stack, token);
-  assertWithToken(a_type == TYPE_INT && b_type == TYPE_INT, "* is only defined for int", token);
-  pushStack(stack, b * a);
-  pushStack(stack, TYPE_INT);
+static inline void parseMUL(PARSE_FUNC_TYPE) {
+  Cell a = checkedPop();
+  Cell b = checkedPop();
+  checkedAssert(cellType(a) == TYPE_INT && cellType(b) == TYPE_INT, "* is only defined for int");
+  pushStack(stack, makeCell(TYPE_INT, cellValue(b) * cellValue(a)));
 }
 
-void parseDIV(PARSE_FUNC_TYPE) {
-  int a_type = popStack(stack, token);
-  int a = popStack(stack, token);
-  int b_type = popStack(stack, token);
-  int b = popStack(stack, token);
-  assertWithToken(a_type == TYPE_INT && b_type == TYPE_INT, "/ is only defined for int", token);
-  pushStack(stack, b / a);
-  pushStack(stack, TYPE_INT);
+static inline void parseDIV(PARSE_FUNC_TYPE) {
+  Cell a = checkedPop();
+  Cell b = checkedPop();
+  checkedAssert(cellType(a) == TYPE_INT && cellType(b) == TYPE_INT, "/ is only defined for int");
+  pushStack(stack, makeCell(TYPE_INT, cellValue(b) / cellValue(a)));
 }
 
-void parseREM(PARSE_FUNC_TYPE) {
-  int a_type = popStack(stack, token);
-  int a = popStack(stack, token);
-  int b_type = popStack(stack, token);
-  int b = popStack(stack, token);
-  assertWithToken(a_type == TYPE_INT && b_type == TYPE_INT, "% is only defined for int", token);
-  pushStack(stack, b % a);
-  pushStack(stack, TYPE_INT);
+static inline void parseREM(PARSE_FUNC_TYPE) {
+  Cell a = checkedPop();
+  Cell b = checkedPop();
+  checkedAssert(cellType(a) == TYPE_INT && cellType(b) == TYPE_INT, "% is only defined for int");
+  pushStack(stack, makeCell(TYPE_INT, cellValue(b) % cellValue(a)));
 }
 
-int checkEquality(Stack *stack, Token *token) {
-  int a_type = popStack(stack, token);
+static inline int checkEquality(Stack *stack, Token *token, int checked) {
+  Cell a = checkedPop();
+  int a_type = cellType(a);
   if (a_type == TYPE_STR) {
-    int sizeA = popStack(stack, token);
-    char wordA[sizeA + 1];
-    int i;
-    for (i = 0; i < sizeA + 1; i++) {
-      wordA[i] = popStack(stack, token);
-    }
-    int b_type = popStack(stack, token);
-    assertWithToken(b_type == TYPE_STR, "Can only compare strings with each other (=)", token);
-    int sizeB = popStack(stack, token);
-    int result = sizeA == sizeB;
-    char wordB[sizeB + 1];
-    for (i = 0; i < sizeB + 1; i++) {
-      wordB[i] = popStack(stack, token);
-      if (result != 0 && wordA[i] != wordB[i]) {
-        result = 0;
-      }
-    }
+    Cell b = checkedPop();
+    checkedAssert(cellType(b) == TYPE_STR, "Can only compare strings with each other (=)");
+    String *stringA = (String*) cellPointer(a), *stringB = (String*) cellPointer(b);
+    int result = stringA == stringB
+      || (stringA->size == stringB->size && memcmp(stringA->chars, stringB->chars, stringA->size) == 0);
+    releaseCell(a);
+    releaseCell(b);
     return result;
   } else {
-    int a = popStack(stack, token);
-    int b_type = popStack(stack, token);
-    int b = popStack(stack, token);
-    assertWithToken((a_type == TYPE_INT || a_type == TYPE_CHAR) && (b_type == TYPE_INT || b_type == TYPE_CHAR), "Invalid types for =", token);
-    return a == b;
+    Cell b = checkedPop();
+    int b_type = cellType(b);
+    checkedAssert((a_type == TYPE_INT || a_type == TYPE_CHAR) && (b_type == TYPE_INT || b_type == TYPE_CHAR), "Invalid types for =");
+    return cellValue(a) == cellValue(b);
   }
 }
 
-void parseEQU(PARSE_FUNC_TYPE) {
-  int result = checkEquality(stack, token);
-  pushStack(stack, result);
-  pushStack(stack, TYPE_INT);
+static inline void parseEQU(PARSE_FUNC_TYPE) {
+  int result = checkEquality(stack, token, checked);
+  pushStack(stack, makeCell(TYPE_INT, result));
 }
 
-void parseNEQU(PARSE_FUNC_TYPE) {
-  int result = !checkEquality(stack, token);
-  pushStack(stack, result);
-  pushStack(stack, TYPE_INT);
+static inline void parseNEQU(PARSE_FUNC_TYPE) {
+  int result = !checkEquality(stack, token, checked);
+  pushStack(stack, makeCell(TYPE_INT, result));
 }
 
-int checkLessThan(Stack *stack, Token *token, int swap) {
-  int b_type = popStack(stack, token);
-  int b = popStack(stack, token);
-  int a_type = popStack(stack, token);
-  int a = popStack(stack, token);
-  assertWithToken((a_type == TYPE_INT || a_type == TYPE_CHAR) && (b_type == TYPE_INT || b_type == TYPE_CHAR), "Invalid types for inequalities", token);
+static inline int checkLessThan(Stack *stack, Token *token, int checked, int swap) {
+  Cell b = checkedPop();
+  Cell a = checkedPop();
+  int a_type = cellType(a), b_type = cellType(b);
+  checkedAssert((a_type == TYPE_INT || a_type == TYPE_CHAR) && (b_type == TYPE_INT || b_type == TYPE_CHAR), "Invalid types for inequalities");
   if (swap == 0) {
-    return a < b;
+    return cellValue(a) < cellValue(b);
   } else {
-    return b < a;
+    return cellValue(b) < cellValue(a);
   }
 }
 
-void parseGTE(PARSE_FUNC_TYPE) {
+static inline void parseGTE(PARSE_FUNC_TYPE) {
   /* !(a < b) == b <= a == a <= b */
-  int result = !checkLessThan(stack, token, 0);
-  pushStack(stack, result);
-  pushStack(stack, TYPE_INT);
+  int result = !checkLessThan(stack, token, checked, 0);
+  pushStack(stack, makeCell(TYPE_INT, result));
 }
 
-void parseLTE(PARSE_FUNC_TYPE) {
+static inline void parseLTE(PARSE_FUNC_TYPE) {
   /* !(b < a) == a <= b */
-  int result = !checkLessThan(stack, token, 1);
-  pushStack(stack, result);
-  pushStack(stack, TYPE_INT);
+  int result = !checkLessThan(stack, token, checked, 1);
+  pushStack(stack, makeCell(TYPE_INT, result));
 }
 
-void parseGT(PARSE_FUNC_TYPE) {
+static inline void parseGT(PARSE_FUNC_TYPE) {
   /* b < a == a > b */
-  int result = checkLessThan(stack, token, 1);
-  pushStack(stack, result);
-  pushStack(stack, TYPE_INT);
+  int result = checkLessThan(stack, token, checked, 1);
+  pushStack(stack, makeCell(TYPE_INT, result));
 }
 
-void parseLT(PARSE_FUNC_TYPE) {
+static inline void parseLT(PARSE_FUNC_TYPE) {
   /* a < b */
-  int result = checkLessThan(stack, token, 0);
-  pushStack(stack, result);
-  pushStack(stack, TYPE_INT);
+  int result = checkLessThan(stack, token, checked, 0);
+  pushStack(stack, makeCell(TYPE_INT, result));
 }
 
-void parsePOP(PARSE_FUNC_TYPE) {
-  int type = popStack(stack, token);
+static inline void parsePOP(PARSE_FUNC_TYPE) {
+  Cell cell = checkedPop();
+  int type = cellType(cell);
   if (type == TYPE_INT) {
-    int value = popStack(stack, token);
-    printf("%d", value);
+    printInt(cellValue(cell));
   } else if (type == TYPE_CHAR) {
-    int value = popStack(stack, token);
-    printf("%c", value);
+    printChar(cellValue(cell));
   } else if (type == TYPE_STR) {
-    int size = popStack(stack, token);
-    int i;
-    for (i = 0; i < size; i++) {
-      fputc(popStack(stack, token), stdout);
-    }
-    int null = popStack(stack, token);
-    assertWithToken(null == '\0', "String must have a null character at the end", token);
+    printString((String*) cellPointer(cell));
+    releaseCell(cell);
   } else {
-    fprintf(stderr, "Invalid Type Code: %d\n", type);
+    fprintf(errorOutput(), "Invalid Type Code: %d\n", type);
     assertWithToken(0, "Invalid type code (.)", token);
   }
 }
 
-void parseSIZE(PARSE_FUNC_TYPE) {
-  int size = stack->size;
-  printf("%d", size);
+static inline void parseSIZE(PARSE_FUNC_TYPE) {
+  /* Reported in untagged cells, which is what programs have always seen. */
+  int size = legacyStackSize(stack);
+  printInt(size);
 }
 
-void parsePSTACK(PARSE_FUNC_TYPE) {
+static inline void parsePSTACK(PARSE_FUNC_TYPE) {
   printStack(stack);
 }
 
-/* ABC (n == 2) -> ABCBC */
-void copyNElements(Stack *stack, Node *node, int n) {
-  if (n == 0) {
-    return;
-  }
-  copyNElements(stack, node->next, n - 1);
-  pushStack(stack, node->value);
-}
-
-void parseDUP(PARSE_FUNC_TYPE) {
-  int top_type = peekStack(stack, token);
-  if (top_type == TYPE_INT) {
-    copyNElements(stack, stack->root, 2);
-  } else if (top_type == TYPE_CHAR) {
-    copyNElements(stack, stack->root, 2);
-  } else if (top_type == TYPE_STR) {
-    int size = stack->root->next->value;
-    Node *node = stack->root;
-    copyNElements(stack, node, size + 3);
-  } else {
-    fprintf(stderr, "Invalid Type Code: %d\n", top_type);
-    assertWithToken(0, "Invalid type code (dup)", token);
-  }
-}
-
-void parseDROP(PARSE_FUNC_TYPE) {
-  int type = popStack(stack, token);
-  if (type == TYPE_INT) {
-    popStack(stack, token);
-  } else if (type == TYPE_CHAR) {
-    popStack(stack, token);
-  } else if (type == TYPE_STR) {
-    int size = popStack(stack, token);
-    int i;
-    for (i = 0; i < size; i++) {
-      popStack(stack, token);
-    }
-    int null = popStack(stack, token);
-    assertWithToken(null == '\0', "String must have a null character at the end", token);
-  }
-}
-
-void parseSWAP(PARSE_FUNC_TYPE) {
-  Node *a_type = stack->root;
-  assertWithToken(a_type != NULL, "Not enough elements to swap", token);
-  int numberToIterate = 0;
-  /* numberToIterate from a_type to the node before b_type */
-  if (a_type->value == TYPE_INT) {
-    numberToIterate = 1;
-  } else if (a_type->value == TYPE_CHAR) {
-    numberToIterate = 1;
-  } else if (a_type->value == TYPE_STR) {
-    numberToIterate = a_type->next->value + 2;
-  } else {
-    fprintf(stderr, "Invalid Type Code: %d\n", a_type->value);
-    assertWithToken(0, "Invalid type code (swap)", token);
-  }
-  Node *before_b_type = a_type;
-  while (numberToIterate-- > 0) {
-    assertWithToken(before_b_type != NULL, "Not enough elements to swap", token);
-    before_b_type = before_b_type->next;
-  }
-  /* numberToIterate from b_type to the node before after */
-  Node *b_type = before_b_type->next;
-  assertWithToken(b_type != NULL, "Not enough elements to swap", token);
-  if (b_type->value == TYPE_INT) {
-    numberToIterate = 2;
-  } else if (b_type->value == TYPE_CHAR) {
-    numberToIterate = 2;
-  } else if (b_type->value == TYPE_STR) {
-    numberToIterate = b_type->next->value + 3;
-  } else {
-    fprintf(stderr, "Invalid Type Code: %d\n", b_type->value);
-    assertWithToken(0, "Invalid type code (swap)", token);
-  }
-  Node *before_after = before_b_type;
-  while (numberToIterate-- > 0) {
-    assertWithToken(before_after != NULL, "Not enough elements to swap", token);
-    before_after = before_after->next;
-  }
-  stack->root = before_b_type->next;
-  before_b_type->next = before_after->next;
-  before_after->next = a_type;
-}
-
-void parseOVER(PARSE_FUNC_TYPE) {
-  int top_type = peekStack(stack, token);
-  int numberToIterate = 0;
-  if (top_type == TYPE_INT) {
-    numberToIterate = 2;
-  } else if (top_type == TYPE_CHAR) {
-    numberToIterate = 2;
-  } else if (top_type == TYPE_STR) {
-    numberToIterate = stack->root->next->value + 3;
-  } else {
-    fprintf(stderr, "Invalid Type Code: %d\n", top_type);
-    assertWithToken(0, "Invalid type code (over)", token);
-  }
-  Node *node = stack->root;
-  while (numberToIterate-- > 0) {
-    node = node->next;
-    assertWithToken(node != NULL, "Not enough elements to over", token);
-  }
-  int second_type = node->value;
-  if (second_type == TYPE_INT) {
-    copyNElements(stack, node, 2);
-  } else if (second_type == TYPE_CHAR) {
-    copyNElements(stack, node, 2);
-  } else if (second_type == TYPE_STR) {
-    int size = node->next->value;
-    copyNElements(stack, node, size + 3);
-  } else {
-    fprintf(stderr, "Invalid Type Code: %d\n", second_type);
-    assertWithToken(0, "Invalid type code (over)", token);
-  }
-}
-
-void parseROT(PARSE_FUNC_TYPE) {
-  int a_type = peekStack(stack, token);
-  Node *root = stack->root;
-  int numberToIterate = 0;
-  if (a_type == TYPE_INT) {
-    numberToIterate = 2;
-  } else if (a_type == TYPE_CHAR) {
-    numberToIterate = 2;
-  } else if (a_type == TYPE_STR) {
-    int size = root->next->value;
-    numberToIterate = size + 3;
-  } else {
-    fprintf(stderr, "Invalid Type Code: %d\n", a_type);
-    assertWithToken(0, "Invalid type code (rot)", token);
-  }
-  Node *node = root;
-  while (numberToIterate-- > 0) {
-    node = node->next;
-    assertWithToken(node != NULL, "Not enough elements to rot", token);
-  }
-  int b_type = node->value;
-  if (b_type == TYPE_INT) {
-    numberToIterate = 1;
-  } else if (b_type == TYPE_CHAR) {
-    numberToIterate = 1;
-  } else if (b_type == TYPE_STR) {
-    int size = node->next->value;
-    numberToIterate = size + 2;
-  } else {
-    fprintf(stderr, "Invalid Type Code: %d\n", b_type);
-    assertWithToken(0, "Invalid type code (rot)", token);
-  }
-  while (numberToIterate-- > 0) {
-    node = node->next;
-    assertWithToken(node != NULL, "Not enough elements to rot", token);
-  }
-  /* node is now before c-type. */
-  assertWithToken(node->next != NULL, "Not enough elements to rot", token);
-  int c_type = node->next->value;
-  if (c_type == TYPE_INT) {
-    int count = 2;
-    numberToIterate = count;
-    stack->size -= count;
-    copyNElements(stack, node->next, count);
-  } else if (c_type == TYPE_CHAR) {
-    int count = 2;
-    numberToIterate = count;
-    stack->size -= count;
-    copyNElements(stack, node->next, count);
-  } else if (c_type == TYPE_STR) {
-    int size = node->next->next->value;
-    int count = size + 3;
-    numberToIterate = count;
-    stack->size -= count;
-    copyNElements(stack, node->next, count);
-  } else {
-    fprintf(stderr, "Invalid Type Code: %d\n", c_type);
-    assertWithToken(0, "Invalid type code (rot)", token);
-  }
-  Node *after = node->next;
-  while (numberToIterate-- > 0) {
-    assertWithToken(after != NULL, "Not enough elements to rot", token);
-    after = after->next;
-  }
-  node->next = after;
-}
-
-void parseIF(PARSE_FUNC_TYPE) {
-  int startType = token->OP_TYPE;
-  if (startType == OP_END) {
-    return;
-  }
-  assertWithToken(startType == OP_IF || startType == OP_ELSEIF, "controlIf must be called with `if` or `elseif` token", token);
-  /* Evaluate until `then` keyword */
-  int hasThen = 0, type;
-  while (!isEmptyQueue(instructions)) {
-    QueueElem *queueElem = pollQueue(instructions);
-    Token *current = queueElem->token;
-    type = current->OP_TYPE;
-    assertWithToken(type != OP_DEF, "No `def` in if", token);
-    if (type == OP_THEN) {
-      hasThen = 1;
-      break;
-    }
-    parseQueue(stack, instructions, definitions, queueElem);
-  }
-  assertWithToken(hasThen, "`then` not found after `if` or `elseif`", token);
-  int truth_type = popStack(stack, token);
-  assertWithToken(truth_type == TYPE_INT, "`then` must pop an integer/boolean.", token);
-  int truth = popStack(stack, token);
-  if (truth == 0) {
-    /* Jump to next block (elseif or end) for evaluation. */
-    int ends = 1, jumpType;
-    QueueElem *jumpElem;
-    Token *jumpToken;
-    while (ends > 0 && !isEmptyQueue(instructions)) {
-      jumpElem = pollQueue(instructions);
-      jumpToken = jumpElem->token;
-      jumpType = jumpToken->OP_TYPE;
-      assertWithToken(jumpType != OP_DEF, "No `def` in if", jumpToken);
-      if (jumpType == OP_IF || jumpType == OP_WHILE) {
-        ends++;
-      } else if (jumpType == OP_END) {
-        ends--;
-      }
-      if (jumpType == OP_ELSEIF || ends == 0) {
-        /* Jumps to either elseif block or end of if. */
-        break;
-      }
-    }
-    parseIF(stack, instructions, definitions, jumpToken);
-  } else {
-    int hasEnd = 0, type;
-    while (!isEmptyQueue(instructions)) {
-      QueueElem *queueElem = pollQueue(instructions);
-      Token *current = queueElem->token;
-      type = current->OP_TYPE;
-      assertWithToken(type != OP_DEF, "No `def` in if", token);
-      if (type == OP_ELSEIF) {
-        /* Jump to end. */
-        int ends = 1, jumpType;
-        QueueElem *jumpElem;
-        Token *jumpToken;
-        while (ends > 0 && !isEmptyQueue(instructions)) {
-          jumpElem = pollQueue(instructions);
-          jumpToken = jumpElem->token;
-          jumpType = jumpToken->OP_TYPE;
-          assertWithToken(jumpType != OP_DEF, "No `def` in if", jumpToken);
-          if (jumpType == OP_IF || jumpType == OP_WHILE) {
-            ends++;
-          } else if (jumpType == OP_END) {
-            ends--;
-          }
-          if (ends == 0) {
-            /* Jumps to end of if. */
-            break;
-          }
-        }
-        return;
-      }
-      if (current->OP_TYPE == OP_END) {
-        hasEnd = 1;
-        break;
-      }
-      parseQueue(stack, instructions, definitions, queueElem);
-    }
-    assertWithToken(hasEnd, "`end` not found after `if` or `elseif`", token);
-  }
+static inline void parseDUP(PARSE_FUNC_TYPE) {
+  Cell cell = checkedPeek();
+  pushStack(stack, retainCell(cell));
 }
 
-void parseELSEIF(PARSE_FUNC_TYPE) {
-  assertWithToken(0, "`elseif` without if", token);
+static inline void parseDROP(PARSE_FUNC_TYPE) {
+  releaseCell(checkedPop());
 }
 
-void parseWHILE(PARSE_FUNC_TYPE) {
-  Queue *evalInstructions = newQueue();
-  Queue *loopInstructions = newQueue();
-  QueueElem *elem;
-  int type;
-  /* Fill up evalInstructions. */
-  while (!isEmptyQueue(instructions)) {
-    elem = pollQueue(instructions);
-    token = elem->token;
-    type = token->OP_TYPE;
-    if (type == OP_THEN) {
-      break;
-    }
-    pushQueue(evalInstructions, token);
-  }
-  /* Fill up loopInstructions. */
-  int ends = 1;
-  while (ends > 0 && !isEmptyQueue(instructions)) {
-    elem = pollQueue(instructions);
-    token = elem->token;
-    type = token->OP_TYPE;
-    assertWithToken(type != OP_DEF, "No `def` in while loop", token);
-    if (type == OP_IF || type == OP_WHILE) {
-      ends++;
-    } else if (type == OP_END) {
-      ends--;
-    }
-    if (ends == 0) {
-      break;
-    }
-    pushQueue(loopInstructions, token);
-  }
-  while (1) {
-    /* Evaluate evalInstuctions. */
-    Queue *evalQueue = copyQueue(evalInstructions);
-    while (!isEmptyQueue(evalQueue)) {
-      parseQueue(stack, evalQueue, definitions, pollQueue(evalQueue));
-    }
-    int truth_type = popStack(stack, token);
-    assertWithToken(truth_type == TYPE_INT, "`then` must pop an integer/boolean.", token);
-    int truth = popStack(stack, token);
-    if (truth == 0) {
-      break;
-    }
-
-    Queue *loopQueue = copyQueue(loopInstructions);
-    while (!isEmptyQueue(loopQueue)) {
-      parseQueue(stack, loopQueue, definitions, pollQueue(loopQueue));
-    }
-  }
+static inline void parseSWAP(PARSE_FUNC_TYPE) {
+  checkedAssert(stack->size >= 2, "Not enough elements to swap");
+  Cell *values = stack->values + stack->size;
+  Cell temp = values[-1];
+  values[-1] = values[-2];
+  values[-2] = temp;
 }
 
-void parseTHEN(PARSE_FUNC_TYPE) {
-  assertWithToken(0, "`then` word without starting", token);
+static inline void parseOVER(PARSE_FUNC_TYPE) {
+  (void) checkedPeek();
+  checkedAssert(stack->size >= 2, "Not enough elements to over");
+  pushStack(stack, retainCell(stackAt(stack, 1)));
 }
 
-void parseEND(PARSE_FUNC_TYPE) {
-  assertWithToken(0, "`end` word without starting.", token);
+static inline void parseROT(PARSE_FUNC_TYPE) {
+  (void) checkedPeek();
+  checkedAssert(stack->size >= 3, "Not enough elements to rot");
+  /* c b a -> b a c */
+  Cell *values = stack->values + stack->size;
+  Cell c = values[-3];
+  values[-3] = values[-2];
+  values[-2] = values[-1];
+  values[-1] = c;
 }
 
-void parseCASTINT(PARSE_FUNC_TYPE) {
-  int type = popStack(stack, token);
-  assertWithToken(type == TYPE_CHAR, "Only can cast char -> int.", token);
-  pushStack(stack, TYPE_INT);
+static inline void parseCASTINT(PARSE_FUNC_TYPE) {
+  Cell cell = checkedPop();
+  checkedAssert(cellType(cell) == TYPE_CHAR, "Only can cast char -> int.");
+  pushStack(stack, makeCell(TYPE_INT, cellValue(cell)));
 }
 
-void parseCASTCHAR(PARSE_FUNC_TYPE) {
-  int type = popStack(stack, token);
-  assertWithToken(type == TYPE_INT, "Only can cast int -> char.", token);
-  pushStack(stack, TYPE_CHAR);
+static inline void parseCASTCHAR(PARSE_FUNC_TYPE) {
+  Cell cell = checkedPop();
+  checkedAssert(cellType(cell) == TYPE_INT, "Only can cast int -> char.");
+  pushStack(stack, makeCell(TYPE_CHAR, cellValue(cell)));
 }
 
 int validateWordName(char *word) {
@@ -952,127 +1196,2848 @@ int validateWordName(char *word) {
   return 1;
 }
 
-void parseDEF(PARSE_FUNC_TYPE) {
-  Token *wordNameToken = pollQueue(instructions)->token;
-  assertWithToken(wordNameToken->OP_TYPE == OP_UNKNOWN, "Word must not be defined before.", wordNameToken);
-  char *wordName = wordNameToken->word;
-  assertWithToken(validateWordName(wordName) == 1, "Word name contains invalid characters.", wordNameToken);
-  int ends = 1, hasEnd = 0, type;
-  Queue *block = newQueue();
-  Token *defToken;
-  while (!isEmptyQueue(instructions)) {
-    defToken = pollQueue(instructions)->token;
-    type = defToken->OP_TYPE;
-    assertWithToken(type != OP_DEF, "No nested `def`", defToken);
-    if (type == OP_IF || type == OP_WHILE) {
-      ends++;
-    } else if (type == OP_END) {
-      ends--;
-    }
-    if (ends == 0) {
-      hasEnd = 1;
+/* Value known while optimizing, an int or a char. */
+typedef struct Constant {
+  int type;
+  int value;
+} Constant;
+
+#define MAX_FOLD_DEPTH 16
+
+/* Number of instructions from start that only compute a single int, which is set in result. */
+/* The instructions are evaluated as they would run, stopping before any that would fail. */
+int foldConstants(Program *program, int start, int *result) {
+  Constant constants[MAX_FOLD_DEPTH];
+  int depth = 0, folded = 0, i;
+  for (i = start; i < program->size; i++) {
+    Instr *instr = &program->code[i];
+    if (instr->op == OP_INT || instr->op == OP_CHAR) {
+      if (depth == MAX_FOLD_DEPTH) {
+        break;
+      }
+      constants[depth].type = instr->op == OP_INT ? TYPE_INT : TYPE_CHAR;
+      constants[depth++].value = instr->arg;
+    } else if (instr->op == OP_CAST_INT || instr->op == OP_CAST_CHAR) {
+      if (depth < 1 || constants[depth - 1].type != (instr->op == OP_CAST_INT ? TYPE_CHAR : TYPE_INT)) {
+        break;
+      }
+      constants[depth - 1].type = instr->op == OP_CAST_INT ? TYPE_INT : TYPE_CHAR;
+    } else if (instr->op >= OP_ADD && instr->op <= OP_LT) {
+      if (depth < 2) {
+        break;
+      }
+      Constant a = constants[depth - 1], b = constants[depth - 2];
+      uint32_t x = b.value, y = a.value;
+      int ints = a.type == TYPE_INT && b.type == TYPE_INT;
+      Constant c = {TYPE_INT, 0};
+      if (instr->op == OP_ADD) {
+        if (!ints && a.type == b.type) {
+          break;
+        }
+        c.type = ints ? TYPE_INT : TYPE_CHAR;
+        c.value = x + y;
+      } else if (instr->op == OP_SUB) {
+        if (a.type != TYPE_INT) {
+          break;
+        }
+        c.type = b.type;
+        c.value = x - y;
+      } else if (instr->op == OP_MUL || instr->op == OP_DIV || instr->op == OP_REM) {
+        if (!ints || (instr->op != OP_MUL && (a.value == 0 || (a.value == -1 && b.value == INT32_MIN)))) {
+          break;
+        }
+        c.value = instr->op == OP_MUL ? (int) (x * y) : instr->op == OP_DIV ? b.value / a.value : b.value % a.value;
+      } else if (instr->op == OP_EQU || instr->op == OP_NEQU) {
+        c.value = (b.value == a.value) == (instr->op == OP_EQU);
+      } else if (instr->op == OP_GTE || instr->op == OP_LT) {
+        c.value = (b.value < a.value) == (instr->op == OP_LT);
+      } else {
+        c.value = (a.value < b.value) == (instr->op == OP_GT);
+      }
+      constants[--depth - 1] = c;
+    } else {
       break;
     }
-    pushQueue(block, defToken);
-  }
-  assertWithToken(hasEnd, "`end` not found after `def`", token);
-  addDefinition(definitions, wordName, block);
-}
-
-/* Parses a token. */
-void parseQueue(Stack* stack, Queue* instructions, Definitions* definitions, QueueElem* queueElem) {
-  assert(OPS_COUNT == 31, "Update control flow in parse().");
-  Token *token = queueElem->token;
-  void (*parsers[OPS_COUNT]) (PARSE_FUNC_TYPE) = {
-    parseUNKNOWN,
-    parseINT,
-    parseCHAR,
-    parseSTR,
-    parseADD,
-    parseSUB,
-    parseMUL,
-    parseDIV,
-    parseREM,
-    parseEQU,
-    parseNEQU,
-    parseGTE,
-    parseLTE,
-    parseGT,
-    parseLT,
-    parsePOP,
-    parseSIZE,
-    parsePSTACK,
-    parseDUP,
-    parseDROP,
-    parseSWAP,
-    parseOVER,
-    parseROT,
-    parseIF,
-    parseELSEIF,
-    parseWHILE,
-    parseTHEN,
-    parseDEF,
-    parseEND,
-    parseCASTINT,
-    parseCASTCHAR,
-  };
-  parsers[token->OP_TYPE](stack, instructions, definitions, token);
+    if (depth == 1 && constants[0].type == TYPE_INT) {
+      folded = i - start + 1;
+      *result = constants[0].value;
+    }
+  }
+  return folded;
 }
 
-Token* makeToken(int row, int col, char *word) {
-  Token* token;
-  token = (Token*) malloc(sizeof(Token));
+/* Marks a definition that ended at end as a constant, if its body only pushes literals. */
+/* A body computing a single int from literals, such as `60 60 *`, is folded into one literal first. */
+void findConstant(Program *program, DefWord *definition, int end) {
+  Instr *code = program->code;
+  int length = end - definition->body, i, value;
+  for (i = definition->body; i < end; i++) {
+    if (code[i].op != OP_INT && code[i].op != OP_CHAR && code[i].op != OP_STR) {
+      break;
+    }
+  }
+  if (i == end) {
+    definition->constant = length;
+  } else if (length > 1 && foldConstants(program, definition->body, &value) == length) {
+    /* The rest of the body is left after the return, never to run. */
+    Token *token = (Token*) arenaAlloc(arena, sizeof(Token));
+    *token = *code[definition->body].token;
+    token->OP_TYPE = OP_INT;
+    token->value = value;
+    code[definition->body].op = OP_INT;
+    code[definition->body].arg = value;
+    code[definition->body].token = token;
+    code[definition->body + 1] = code[end];
+    definition->constant = 1;
+  }
+}
+
+/* Blocks that are open while compiling. */
+typedef enum BLOCK {
+  BLOCK_IF,
+  BLOCK_WHILE,
+  BLOCK_DEF,
+} BLOCK;
+
+typedef struct Block {
+  BLOCK kind;
+  Token *token;   /* token that opened the block */
+  int start;      /* `while`: start of the condition, `def`: the jump over its body */
+  int inBody;     /* `then` has been seen for the current condition */
+  int branch;     /* `then` waiting for the index to jump to when false */
+  int jumps;      /* chain of jumps to `end`, linked through their arg, -1 terminated */
+} Block;
+
+/* Points every jump in the chain to target. */
+void patchJumps(Program *program, int jump, int target) {
+  while (jump != -1) {
+    int next = program->code[jump].arg;
+    program->code[jump].arg = target;
+    jump = next;
+  }
+}
+
+/* Compiles tokens into program, which is empty, resolving jump targets of control flow. */
+/* `if c1 then b1 elseif c2 then b2 end` compiles to */
+/*   c1 THEN(L1) b1 JUMP(END) L1: c2 THEN(END) b2 END: */
+/* `while c then b end` compiles to */
+/*   HEAD: c THEN(END) b JUMP(HEAD) END: */
+/* `def w b end` compiles to JUMP(END) b RETURN END:, and w is added to definitions. */
+/* Words are bound to their definition here, so running a program never looks them up. */
+/* A word binds to its latest definition before it. Inside a `def`, a word that is only */
+/* defined later binds to its last definition, which lets words call each other. */
+/* With inlineConstants, a word whose body only pushes literals is replaced by them instead of called. */
+void compile(Program *program, Tokens *tokens, Definitions *definitions, int inlineConstants) {
+  int unbound = -1; /* chain of calls to bind at the end, linked through their arg */
+  int depth = 0, capacity = 16;
+  Block *blocks = (Block*) arenaAlloc(arena, sizeof(Block) * capacity);
+  int i;
+  for (i = 0; i < tokens->size; i++) {
+    Token *token = &tokens->tokens[i];
+    Block *top = depth > 0 ? &blocks[depth - 1] : NULL;
+    if (token->OP_TYPE == OP_IF || token->OP_TYPE == OP_WHILE || token->OP_TYPE == OP_DEF) {
+      if (depth == capacity) {
+        blocks = (Block*) arenaGrow(arena, blocks, sizeof(Block) * capacity, sizeof(Block) * capacity * 2);
+        capacity *= 2;
+      }
+      Block *block = &blocks[depth++];
+      block->token = token;
+      block->start = program->size;
+      block->inBody = 0;
+      block->branch = -1;
+      block->jumps = -1;
+      if (token->OP_TYPE == OP_IF) {
+        block->kind = BLOCK_IF;
+      } else if (token->OP_TYPE == OP_WHILE) {
+        block->kind = BLOCK_WHILE;
+      } else {
+        block->kind = BLOCK_DEF;
+        block->inBody = 1;
+        assertWithToken(top == NULL || top->kind != BLOCK_IF, "No `def` in if", token);
+        assertWithToken(top == NULL || top->kind != BLOCK_WHILE, "No `def` in while loop", token);
+        assertWithToken(top == NULL, "No nested `def`", token);
+        assertWithToken(i + 1 < tokens->size, "Word name not found after `def`", token);
+        Token *wordNameToken = &tokens->tokens[++i];
+        assertWithToken(wordNameToken->OP_TYPE == OP_UNKNOWN, "Word must not be defined before.", wordNameToken);
+        assertWithToken(validateWordName(stringAt(strings, wordNameToken->word)) == 1, "Word name contains invalid characters.", wordNameToken);
+        block->start = emit(program, OP_JUMP, -1, wordNameToken);
+        addDefinition(definitions, wordNameToken->word, program->size);
+      }
+    } else if (token->OP_TYPE == OP_THEN) {
+      assertWithToken(top != NULL && top->kind != BLOCK_DEF && !top->inBody, "`then` word without starting", token);
+      top->inBody = 1;
+      top->branch = emit(program, OP_THEN, -1, token);
+    } else if (token->OP_TYPE == OP_ELSEIF) {
+      assertWithToken(top != NULL && top->kind == BLOCK_IF && top->inBody, "`elseif` without if", token);
+      int jump = emit(program, OP_JUMP, top->jumps, token);
+      top->jumps = jump;
+      program->code[top->branch].arg = program->size;
+      top->inBody = 0;
+      top->branch = -1;
+    } else if (token->OP_TYPE == OP_END) {
+      assertWithToken(top != NULL, "`end` word without starting.", token);
+      if (top->kind == BLOCK_IF) {
+        assertWithToken(top->inBody, "`then` not found after `if` or `elseif`", top->token);
+      } else if (top->kind == BLOCK_WHILE) {
+        assertWithToken(top->inBody, "`then` not found after `while`", top->token);
+        emit(program, OP_JUMP, top->start, token);
+      } else {
+        emit(program, OP_RETURN, 0, token);
+      }
+      if (top->branch != -1) {
+        program->code[top->branch].arg = program->size;
+      }
+      patchJumps(program, top->jumps, program->size);
+      if (top->kind == BLOCK_DEF) {
+        program->code[top->start].arg = program->size;
+        if (inlineConstants) {
+          Token *wordNameToken = program->code[top->start].token;
+          findConstant(program, findDefinition(definitions, wordNameToken->word), program->size - 1);
+        }
+      }
+      depth--;
+    } else if (token->OP_TYPE == OP_UNKNOWN) {
+      DefWord *definition = findDefinition(definitions, token->word);
+      if (definition != NULL && definition->constant >= 0) {
+        int k;
+        for (k = 0; k < definition->constant; k++) {
+          Instr literal = program->code[definition->body + k];
+          emit(program, literal.op, literal.arg, literal.token);
+        }
+      } else if (definition != NULL) {
+        emit(program, OP_CALL, definition->body, token);
+      } else if (depth > 0 && blocks[0].kind == BLOCK_DEF) {
+        unbound = emit(program, OP_UNKNOWN, unbound, token);
+      } else {
+        emit(program, OP_UNKNOWN, -1, token);
+      }
+    } else if (token->OP_TYPE == OP_STR) {
+      emit(program, OP_STR, addLiteral(program, token), token);
+    } else {
+      emit(program, token->OP_TYPE, token->value, token);
+    }
+  }
+  while (unbound != -1) {
+    Instr *instr = &program->code[unbound];
+    unbound = instr->arg;
+    DefWord *definition = findDefinition(definitions, instr->token->word);
+    if (definition != NULL && definition->constant == 1) {
+      *instr = program->code[definition->body];
+    } else if (definition != NULL) {
+      instr->op = OP_CALL;
+      instr->arg = definition->body;
+    } else {
+      instr->arg = -1;
+    }
+  }
+  if (depth > 0) {
+    Block *top = &blocks[depth - 1];
+    if (top->kind == BLOCK_IF) {
+      assertWithToken(top->inBody, "`then` not found after `if` or `elseif`", top->token);
+      assertWithToken(0, "`end` not found after `if` or `elseif`", top->token);
+    } else if (top->kind == BLOCK_WHILE) {
+      assertWithToken(0, "`end` not found after `while`", top->token);
+    } else {
+      assertWithToken(0, "`end` not found after `def`", top->token);
+    }
+  }
+  emit(program, OP_HALT, 0, NULL);
+}
+
+/* Whether the instructions from start are the given ops. */
+static int matchOps(Program *program, int start, int count, OPS first, OPS second, OPS third) {
+  OPS ops[3] = {first, second, third};
+  int i;
+  if (start + count > program->size) {
+    return 0;
+  }
+  for (i = 0; i < count; i++) {
+    if (program->code[start + i].op != ops[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Sets the op standing for the len instructions at index. */
+static void fuse(Program *program, int index, OPS op, int arg, int len) {
+  program->code[index].op = op;
+  program->code[index].arg = arg;
+  program->code[index].len = len;
+}
+
+/* Peephole optimizer: folds constant expressions and fuses common sequences of instructions. */
+/* A fused op only replaces the first instruction of its sequence, and skips the rest when it runs. */
+/* The rest are left as they were, so jumps into the middle of a sequence still run it as written. */
+/* Each fused op checks the types it needs first, and otherwise runs the instruction it replaced */
+/* (recovered from its token), so errors are reported exactly as without the optimizer. */
+/* Instructions are only ever matched against the ones after them, which are not fused yet. */
+void optimize(Program *program) {
+  int i;
+  for (i = 0; i < program->size; i++) {
+    Instr *instr = &program->code[i];
+    int value;
+    int folded = foldConstants(program, i, &value);
+    if (folded > 1) {
+      fuse(program, i, OP_CONST, value, folded);
+    } else if (matchOps(program, i, 3, OP_INT, OP_SWAP, OP_SUB) && instr->arg == 0) {
+      /* `0 swap -` */
+      fuse(program, i, OP_NEG, 0, 3);
+    } else if (matchOps(program, i, 2, OP_INT, OP_ADD, OP_UNKNOWN)) {
+      fuse(program, i, OP_ADD_CONST, instr->arg, 2);
+    } else if (matchOps(program, i, 2, OP_INT, OP_SUB, OP_UNKNOWN)) {
+      fuse(program, i, OP_ADD_CONST, -(uint32_t) instr->arg, 2);
+    } else if (matchOps(program, i, 2, OP_INT, OP_EQU, OP_UNKNOWN)) {
+      fuse(program, i, OP_EQU_CONST, instr->arg, 2);
+    } else if (matchOps(program, i, 2, OP_INT, OP_NEQU, OP_UNKNOWN)) {
+      fuse(program, i, OP_NEQU_CONST, instr->arg, 2);
+    } else if (matchOps(program, i, 2, OP_INT, OP_LT, OP_UNKNOWN)) {
+      fuse(program, i, OP_LT_CONST, instr->arg, 2);
+    } else if (matchOps(program, i, 2, OP_INT, OP_GT, OP_UNKNOWN)) {
+      fuse(program, i, OP_GT_CONST, instr->arg, 2);
+    } else if (matchOps(program, i, 2, OP_OVER, OP_OVER, OP_UNKNOWN)) {
+      fuse(program, i, OP_DUP2, 0, 2);
+    } else if (matchOps(program, i, 2, OP_SWAP, OP_DROP, OP_UNKNOWN)) {
+      fuse(program, i, OP_NIP, 0, 2);
+    } else if (matchOps(program, i, 3, OP_ROT, OP_ROT, OP_ROT)) {
+      /* No-op, as long as there are 3 values to rotate. */
+      fuse(program, i, OP_NOP, 3, 3);
+    } else if (matchOps(program, i, 2, OP_ROT, OP_ROT, OP_UNKNOWN)) {
+      fuse(program, i, OP_ROT2, 0, 2);
+    } else if (matchOps(program, i, 2, OP_SWAP, OP_SWAP, OP_UNKNOWN)) {
+      fuse(program, i, OP_NOP, 2, 2);
+    } else if (matchOps(program, i, 2, OP_DUP, OP_DROP, OP_UNKNOWN)) {
+      fuse(program, i, OP_NOP, 1, 2);
+    }
+  }
+  program->counts = (int*) arenaAlloc(arena, sizeof(int) * program->size);
+  memset(program->counts, 0, sizeof(int) * program->size);
+}
+
+/* Op an instruction was compiled to, before it was fused or made unchecked. */
+static inline OPS originalOp(Instr *instr) {
+  return instr->op > OP_HALT ? instr->token->OP_TYPE : instr->op;
+}
+
+/* Whether an op compares two values into a boolean. */
+static inline int isComparison(OPS op) {
+  return op >= OP_EQU && op <= OP_LT;
+}
+
+/* Outcomes a comparison is true for, as bits: 1 when x < k, 2 when x == k and 4 when x > k. */
+/* Superinstructions test them instead of switching on the comparison. */
+static int comparisonMask(OPS op) {
+  switch (op) {
+    case OP_EQU: return 2;
+    case OP_NEQU: return 5;
+    case OP_GTE: return 6;
+    case OP_LTE: return 3;
+    case OP_GT: return 4;
+    default: return 1;
+  }
+}
+
+/* Compares x to k as `x k op` would, mask being comparisonMask(op). */
+static inline int compareWith(int mask, int x, int k) {
+  return (mask >> ((x > k) - (x < k) + 1)) & 1;
+}
+
+/* Superinstructions: once a loop is hot and the JIT is not there to compile it, the instructions */
+/* it runs are sampled for SAMPLE_ROUNDS more rounds, counting how often each pair, triple and */
+/* run of four of them ran one after another. The sequences that ran straight through the most, */
+/* weighted by the dispatches they save, are replaced with a superinstruction specialized on them. */
+/* A superinstruction reads its constant and jump target from the instructions it stands for, */
+/* which are left in place as with optimize(). */
+
+#define SAMPLE_ROUNDS 100
+/* Instructions sampled at most, for a loop that is left or whose rounds run long. */
+#define SAMPLE_STEPS 100000
+/* Longest run of instructions counted, each superinstruction saving at most this many dispatches but one. */
+#define SAMPLE_RUN 4
+
+typedef struct Sample {
+  int start, end;             /* the loop, from start to its backward jump at end, end -1 when done */
+  int rounds;                 /* times the loop was taken while sampled */
+  int steps;
+  int recent[SAMPLE_RUN];     /* the instructions run last, the latest first, -1 for none */
+  int run;                    /* of them, how many ran one after another up to the latest */
+  int *runs;                  /* by instruction, times the 2 to SAMPLE_RUN run from it ran one after another */
+} Sample;
+
+/* A sequence of a loop that has a superinstruction. */
+typedef struct Candidate {
+  int start;
+  OPS op;
+  int arg;
+  int len;        /* instructions it stands for */
+  int runs;       /* times it ran straight through while sampled */
+  int saved;      /* dispatches it would have saved */
+} Candidate;
+
+/* Starts sampling the loop from start to its backward jump at end, unless another one is. */
+int startSample(Program *program, int start, int end) {
+  Sample *sample = program->sample;
+  if (sample == NULL) {
+    sample = program->sample = (Sample*) arenaAlloc(arena, sizeof(Sample));
+    sample->runs = (int*) arenaAlloc(arena, sizeof(int) * program->size * (SAMPLE_RUN - 1));
+  } else if (sample->end != -1) {
+    /* Tried again once it has gone round another half as many times. */
+    program->counts[end] = HOT_LOOP / 2;
+    return 0;
+  }
+  memset(sample->runs, 0, sizeof(int) * program->size * (SAMPLE_RUN - 1));
+  memset(sample->recent, -1, sizeof(sample->recent));
+  sample->start = start;
+  sample->end = end;
+  sample->rounds = 0;
+  sample->steps = 0;
+  sample->run = 0;
+  return 1;
+}
+
+/* Superinstruction of the sequence of ops from i, or OP_UNKNOWN if there is none, with its arg and length. */
+static OPS matchSuperinstruction(Program *program, int i, int end, int *arg, int *len) {
+  Instr *code = program->code;
+  if (i + 3 <= end && originalOp(&code[i]) == OP_DUP && originalOp(&code[i + 1]) == OP_INT
+      && isComparison(originalOp(&code[i + 2])) && originalOp(&code[i + 3]) == OP_THEN) {
+    /* `dup k < then` compares and branches without pushing anything. */
+    *arg = comparisonMask(originalOp(&code[i + 2]));
+    *len = 4;
+    return OP_DUP_CMP_THEN;
+  } else if (i + 2 <= end && originalOp(&code[i]) == OP_INT
+      && isComparison(originalOp(&code[i + 1])) && originalOp(&code[i + 2]) == OP_THEN) {
+    *arg = comparisonMask(originalOp(&code[i + 1]));
+    *len = 3;
+    return OP_CMP_THEN;
+  } else if (i + 1 <= end && isComparison(originalOp(&code[i])) && originalOp(&code[i + 1]) == OP_THEN) {
+    *arg = comparisonMask(originalOp(&code[i]));
+    *len = 2;
+    return OP_CMP2_THEN;
+  } else if (i + 2 <= end && originalOp(&code[i]) == OP_INT && originalOp(&code[i + 2]) == OP_JUMP
+      && (originalOp(&code[i + 1]) == OP_ADD || originalOp(&code[i + 1]) == OP_SUB)) {
+    /* `1 + end` steps a counter and goes round again. */
+    *arg = originalOp(&code[i + 1]) == OP_ADD ? code[i].token->value : -(uint32_t) code[i].token->value;
+    *len = 3;
+    return OP_ADD_CONST_JUMP;
+  }
+  return OP_UNKNOWN;
+}
+
+static int compareCandidates(const void *a, const void *b) {
+  const Candidate *x = (const Candidate*) a, *y = (const Candidate*) b;
+  if (x->saved != y->saved) {
+    return (x->saved < y->saved) - (x->saved > y->saved);
+  }
+  return x->start - y->start;
+}
+
+/* Installs superinstructions in the sampled loop from start to its backward jump at end. */
+/* Every sequence of the loop with a superinstruction is a candidate. The ones saving the most */
+/* dispatches are chosen first, as long as they ran straight through in at least half of the */
+/* rounds sampled, and do not overlap one chosen before or one installed in an inner loop. */
+void specialize(Program *program, int start, int end) {
+  Instr *code = program->code;
+  Sample *sample = program->sample;
+  int size = end - start + 1, count = 0, i, j;
+  Candidate *candidates = (Candidate*) arenaAlloc(arena, sizeof(Candidate) * size);
+  /* Instructions of the loop a superinstruction stands for, by its candidate plus one. */
+  int *taken = (int*) arenaAlloc(arena, sizeof(int) * size);
+  memset(taken, 0, sizeof(int) * size);
+  for (i = start; i <= end; i++) {
+    if (code[i].op >= OP_DUP_CMP_THEN && code[i].op <= OP_ADD_CONST_JUMP) {
+      for (j = i; j < i + code[i].len && j <= end; j++) {
+        taken[j - start] = -1;
+      }
+    }
+  }
+  for (i = start; i <= end; i++) {
+    Candidate *candidate = &candidates[count];
+    candidate->op = matchSuperinstruction(program, i, end, &candidate->arg, &candidate->len);
+    if (candidate->op == OP_UNKNOWN) {
+      continue;
+    }
+    /* The instructions run for the sequence, those optimize() fused counting as one. */
+    int steps = 0;
+    for (j = i; j < i + candidate->len; j += code[j].len) {
+      steps++;
+    }
+    if (j != i + candidate->len || steps < 2) {
+      continue;
+    }
+    candidate->start = i;
+    candidate->runs = sample->runs[i * (SAMPLE_RUN - 1) + steps - 2];
+    candidate->saved = candidate->runs * (steps - 1);
+    count += candidate->runs > 0 && candidate->runs * 2 >= sample->rounds;
+  }
+  qsort(candidates, count, sizeof(Candidate), compareCandidates);
+  for (i = 0; i < count; i++) {
+    Candidate *candidate = &candidates[i];
+    int clear = 1;
+    for (j = candidate->start; j < candidate->start + candidate->len; j++) {
+      clear = clear && taken[j - start] == 0;
+    }
+    for (j = candidate->start; clear && j < candidate->start + candidate->len; j++) {
+      taken[j - start] = i + 1;
+    }
+  }
+  for (i = start; i <= end; i++) {
+    if (taken[i - start] <= 0 || candidates[taken[i - start] - 1].start != i) {
+      continue;
+    }
+    Candidate *candidate = &candidates[taken[i - start] - 1];
+    fuse(program, i, candidate->op, candidate->arg, candidate->len);
+    if (verbose) {
+      fprintf(stderr, "[%s] Superinstruction at %d %d (run %d times in %d rounds of the loop):", thisName,
+        code[i].token->row, code[i].token->col, candidate->runs, sample->rounds);
+      for (j = i; j < i + candidate->len; j++) {
+        fprintf(stderr, " %s", stringAt(strings, code[j].token->word));
+      }
+      fprintf(stderr, "\n");
+    }
+  }
+}
+
+/* Counts the instruction run while a loop is sampled, installing its superinstructions once */
+/* it has been sampled long enough. Returns 1 then, when sampling is done. */
+int sampleStep(Program *program, Instr *instr) {
+  Sample *sample = program->sample;
+  int ip = instr - program->code, last = sample->recent[0], i;
+  if (last != -1 && ip == last + program->code[last].len) {
+    sample->run += sample->run < SAMPLE_RUN - 1;
+  } else {
+    sample->run = 0;
+  }
+  for (i = SAMPLE_RUN - 1; i > 0; i--) {
+    sample->recent[i] = sample->recent[i - 1];
+  }
+  sample->recent[0] = ip;
+  /* The latest instruction ends a run of i + 1 from the one i before it, for each i up to run. */
+  for (i = 1; i <= sample->run; i++) {
+    sample->runs[sample->recent[i] * (SAMPLE_RUN - 1) + i - 1]++;
+  }
+  sample->rounds += ip == sample->end;
+  if (sample->rounds < SAMPLE_ROUNDS && ++sample->steps < SAMPLE_STEPS) {
+    return 0;
+  }
+  specialize(program, sample->start, sample->end);
+  sample->end = -1;
+  return 1;
+}
+
+/* Static analysis of the stack: infers how many cells are on the stack and their types before */
+/* each instruction, following branches and loops to a fixed point and calls through the effect */
+/* of the word called. Instructions it proves cannot fail run the _UNCHECKED variants of their ops. */
+/* With -c, the errors it proves are reported before the program runs. */
+
+#define TYPE_ANY TYPE_COUNT
+#define TRACKED_TYPES 8
+#define DELTA_UNKNOWN INT32_MIN
+#define TYPES_NUMERIC ((1 << TYPE_INT) | (1 << TYPE_CHAR))
+#define POP_UNDERFLOW "Stack underflow while popping stack.\n"
+#define PEEK_UNDERFLOW "Stack underflow while peeking stack.\n"
+
+/* What is known of the stack before an instruction runs. */
+typedef struct StackState {
+  int reached;
+  int exact;    /* depth is the size of the whole stack, as at the top level */
+  int depth;    /* cells known to be on the stack */
+  int delta;    /* change in size since the start of the word, DELTA_UNKNOWN if it varies */
+  int low;      /* lowest delta the word has changed a cell at, -low cells of the caller's */
+  uint8_t types[TRACKED_TYPES]; /* types of the top cells, the top first, TYPE_ANY if unknown */
+} StackState;
+
+/* An instruction run on a StackState. */
+typedef struct Step {
+  StackState *state;
+  char *error;  /* the check that fails whenever the instruction runs */
+  int safe;     /* none of the checks can fail */
+} Step;
+
+typedef struct Analysis {
+  Program *program;
+  StackState *states;   /* before each instruction */
+  StackState *effects;  /* at the returns of the word with its body at each instruction */
+  char *words;          /* of the word with its body at each instruction: 0 not analyzed, 1 being analyzed, 2 done */
+  int *worklist;        /* instructions to run again, shared by the words being analyzed */
+  char *queued;
+  int pending;
+} Analysis;
+
+/* Notes that the word changed cells down to count cells below the top. */
+static void touchCells(StackState *state, int count) {
+  if (state->delta != DELTA_UNKNOWN && state->delta - count < state->low) {
+    state->low = state->delta - count;
+  }
+}
+
+/* Makes sure count cells are on the stack, failing with message if they cannot be. */
+/* If they are only not known to be, they are afterwards, as the check has passed. */
+static void stepNeed(Step *step, int count, char *message) {
+  StackState *state = step->state;
+  if (step->error != NULL || state->depth >= count) {
+    return;
+  }
+  if (state->exact) {
+    step->error = message;
+  } else {
+    step->safe = 0;
+    state->depth = count;
+  }
+}
+
+/* Makes sure type is one of allowed, a mask of types. */
+static void stepType(Step *step, int type, int allowed, char *message) {
+  if (step->error != NULL) {
+    return;
+  } else if (type == TYPE_ANY) {
+    step->safe = 0;
+  } else if ((allowed & (1 << type)) == 0) {
+    step->error = message;
+  }
+}
+
+static void stepFail(Step *step, char *message) {
+  if (step->error == NULL) {
+    step->error = message;
+  }
+}
+
+static void stepPush(Step *step, int type) {
+  StackState *state = step->state;
+  memmove(state->types + 1, state->types, TRACKED_TYPES - 1);
+  state->types[0] = type;
+  state->depth++;
+  if (state->delta != DELTA_UNKNOWN) {
+    state->delta++;
+  }
+}
+
+/* Pops a cell, returning its type. */
+static int stepPop(Step *step) {
+  StackState *state = step->state;
+  stepNeed(step, 1, POP_UNDERFLOW);
+  if (step->error != NULL) {
+    return TYPE_ANY;
+  }
+  int type = state->types[0];
+  memmove(state->types, state->types + 1, TRACKED_TYPES - 1);
+  state->types[TRACKED_TYPES - 1] = TYPE_ANY;
+  state->depth--;
+  if (state->delta != DELTA_UNKNOWN) {
+    state->delta--;
+    touchCells(state, 0);
+  }
+  return type;
+}
+
+/* Runs op on state as its parser would. Control flow is left to analyzeFrom(). */
+static Step stepState(StackState *state, OPS op, Token *token) {
+  Step step = {state, NULL, 1};
+  int a, b;
+  uint8_t *types = state->types;
+  switch (op) {
+    case OP_UNKNOWN:
+      stepFail(&step, arenaPrintf(arena, "Word `%s` not implemented yet.", stringAt(strings, token->word)));
+      break;
+    case OP_INT:
+      stepPush(&step, TYPE_INT);
+      break;
+    case OP_CHAR:
+      stepPush(&step, TYPE_CHAR);
+      break;
+    case OP_STR:
+      stepPush(&step, TYPE_STR);
+      break;
+    case OP_ADD:
+    case OP_SUB: {
+      char *message = op == OP_ADD ? "+ is only defined for int and char." : "- is only defined for int and char.";
+      a = stepPop(&step);
+      stepType(&step, a, TYPES_NUMERIC, message);
+      b = stepPop(&step);
+      stepType(&step, b, TYPES_NUMERIC, message);
+      if (a == TYPE_ANY || b == TYPE_ANY) {
+        stepPush(&step, TYPE_ANY);
+      } else if (op == OP_ADD && a == TYPE_CHAR && b == TYPE_CHAR) {
+        stepFail(&step, "char char + not supported");
+      } else if (op == OP_SUB && a == TYPE_CHAR) {
+        stepFail(&step, "- is only defined for int int - and char int -");
+      } else {
+        stepPush(&step, a == TYPE_INT && b == TYPE_INT ? TYPE_INT : TYPE_CHAR);
+      }
+      break;
+    }
+    case OP_MUL:
+    case OP_DIV:
+    case OP_REM: {
+      char *message = op == OP_MUL ? "* is only defined for int" : op == OP_DIV ? "/ is only defined for int" : "% is only defined for int";
+      a = stepPop(&step);
+      b = stepPop(&step);
+      stepType(&step, a, 1 << TYPE_INT, message);
+      stepType(&step, b, 1 << TYPE_INT, message);
+      stepPush(&step, TYPE_INT);
+      break;
+    }
+    case OP_EQU:
+    case OP_NEQU:
+      a = stepPop(&step);
+      b = stepPop(&step);
+      if (a == TYPE_STR) {
+        stepType(&step, b, 1 << TYPE_STR, "Can only compare strings with each other (=)");
+      } else if (a != TYPE_ANY) {
+        stepType(&step, b, TYPES_NUMERIC, "Invalid types for =");
+      } else {
+        step.safe = 0;
+      }
+      stepPush(&step, TYPE_INT);
+      break;
+    case OP_GTE:
+    case OP_LTE:
+    case OP_GT:
+    case OP_LT:
+      b = stepPop(&step);
+      a = stepPop(&step);
+      stepType(&step, a, TYPES_NUMERIC, "Invalid types for inequalities");
+      stepType(&step, b, TYPES_NUMERIC, "Invalid types for inequalities");
+      stepPush(&step, TYPE_INT);
+      break;
+    case OP_POP:
+    case OP_DROP:
+      stepPop(&step);
+      break;
+    case OP_DUP:
+      stepNeed(&step, 1, PEEK_UNDERFLOW);
+      stepPush(&step, types[0]);
+      break;
+    case OP_SWAP:
+      stepNeed(&step, 2, "Not enough elements to swap");
+      a = types[0];
+      types[0] = types[1];
+      types[1] = a;
+      touchCells(state, 2);
+      break;
+    case OP_OVER:
+      stepNeed(&step, 1, PEEK_UNDERFLOW);
+      stepNeed(&step, 2, "Not enough elements to over");
+      stepPush(&step, types[1]);
+      break;
+    case OP_ROT:
+      stepNeed(&step, 1, PEEK_UNDERFLOW);
+      stepNeed(&step, 3, "Not enough elements to rot");
+      /* c b a -> b a c */
+      a = types[2];
+      types[2] = types[1];
+      types[1] = types[0];
+      types[0] = a;
+      touchCells(state, 3);
+      break;
+    case OP_CAST_INT:
+      stepType(&step, stepPop(&step), 1 << TYPE_CHAR, "Only can cast char -> int.");
+      stepPush(&step, TYPE_INT);
+      break;
+    case OP_CAST_CHAR:
+      stepType(&step, stepPop(&step), 1 << TYPE_INT, "Only can cast int -> char.");
+      stepPush(&step, TYPE_CHAR);
+      break;
+    case OP_THEN:
+      stepType(&step, stepPop(&step), 1 << TYPE_INT, "`then` must pop an integer/boolean.");
+      break;
+    default:
+      break;
+  }
+  return step;
+}
+
+/* Joins state into into, keeping only what holds for both. Returns whether into changed. */
+static int joinState(StackState *into, StackState *state) {
+  if (!into->reached) {
+    *into = *state;
+    return 1;
+  }
+  StackState joined = *into;
+  joined.exact = into->exact && state->exact && into->depth == state->depth;
+  joined.depth = into->depth < state->depth ? into->depth : state->depth;
+  joined.delta = into->delta == state->delta ? into->delta : DELTA_UNKNOWN;
+  joined.low = joined.delta == DELTA_UNKNOWN ? 0 : into->low < state->low ? into->low : state->low;
+  int i;
+  for (i = 0; i < TRACKED_TYPES; i++) {
+    if (into->types[i] != state->types[i]) {
+      joined.types[i] = TYPE_ANY;
+    }
+  }
+  if (memcmp(&joined, into, sizeof(StackState)) == 0) {
+    return 0;
+  }
+  *into = joined;
+  return 1;
+}
+
+/* State of a stack nothing is known about. */
+static StackState unknownState(int delta) {
+  StackState state;
+  memset(&state, 0, sizeof(state));
+  state.reached = 1;
+  state.delta = delta;
+  memset(state.types, TYPE_ANY, TRACKED_TYPES);
+  return state;
+}
+
+/* Joins state into the state before ip, queueing ip to run again if it changed. */
+static void propagate(Analysis *analysis, int ip, StackState *state) {
+  if (joinState(&analysis->states[ip], state) && !analysis->queued[ip]) {
+    analysis->queued[ip] = 1;
+    analysis->worklist[analysis->pending++] = ip;
+  }
+}
+
+static void analyzeFrom(Analysis *analysis, int ip, StackState *entry, int word);
+
+/* Applies the effect of calling the word with its body at body to state. */
+/* Returns 0 if the word never returns. */
+static int callWord(Analysis *analysis, int body, StackState *state) {
+  if (analysis->words[body] == 0) {
+    analysis->words[body] = 1;
+    StackState entry = unknownState(0);
+    analyzeFrom(analysis, body, &entry, body);
+    analysis->words[body] = 2;
+  }
+  StackState *effect = &analysis->effects[body];
+  if (analysis->words[body] == 1 || (effect->reached && effect->delta == DELTA_UNKNOWN)) {
+    /* Recursive, or with an effect that depends on its arguments. */
+    *state = unknownState(DELTA_UNKNOWN);
+    return 1;
+  } else if (!effect->reached) {
+    return 0;
+  }
+  /* The word changed `popped` cells of the caller's, leaving `pushed` cells in their place. */
+  int popped = -effect->low, pushed = effect->delta - effect->low;
+  StackState after = *state;
+  int known = state->depth >= popped;
+  after.exact = state->exact && known;
+  after.depth = known ? state->depth - popped + pushed : 0;
+  if (after.depth < effect->depth) {
+    after.depth = effect->depth;
+  }
+  if (state->delta != DELTA_UNKNOWN) {
+    after.delta = state->delta + effect->delta;
+    if (state->delta + effect->low < after.low) {
+      after.low = state->delta + effect->low;
+    }
+  }
+  int i;
+  for (i = 0; i < TRACKED_TYPES; i++) {
+    int below = i - pushed + popped;
+    if (i < pushed) {
+      after.types[i] = effect->types[i];
+    } else if (known && below < TRACKED_TYPES) {
+      after.types[i] = state->types[below];
+    } else {
+      after.types[i] = TYPE_ANY;
+    }
+  }
+  *state = after;
+  return 1;
+}
+
+/* Runs the instructions reachable from ip until the state before each of them holds whenever */
+/* it runs. word is where the body being analyzed starts, -1 for the top level. */
+/* The worklist is shared with the callers being analyzed, whose instructions are left below base. */
+static void analyzeFrom(Analysis *analysis, int ip, StackState *entry, int word) {
+  int base = analysis->pending;
+  propagate(analysis, ip, entry);
+  while (analysis->pending > base) {
+    ip = analysis->worklist[--analysis->pending];
+    analysis->queued[ip] = 0;
+    Instr *instr = &analysis->program->code[ip];
+    StackState state = analysis->states[ip];
+    OPS op = originalOp(instr);
+    if (op == OP_JUMP) {
+      propagate(analysis, instr->arg, &state);
+    } else if (op == OP_CALL) {
+      if (callWord(analysis, instr->arg, &state)) {
+        propagate(analysis, ip + 1, &state);
+      }
+    } else if (op == OP_RETURN) {
+      if (word >= 0) {
+        joinState(&analysis->effects[word], &state);
+      }
+    } else if (op != OP_HALT && stepState(&state, op, instr->token).error == NULL) {
+      if (op == OP_THEN) {
+        propagate(analysis, instr->arg, &state);
+      }
+      propagate(analysis, ip + 1, &state);
+    }
+  }
+}
+
+/* Marks the instructions that only run on some paths through their word or the top level: */
+/* the bodies of branches and loops, and the conditions of `elseif`, between a `then` or a jump */
+/* past them and where it goes. Jumps over the body of a word, to just after its return, do not count. */
+static char* conditionalCode(Program *program) {
+  int size = program->size, i;
+  int *nesting = (int*) arenaAlloc(arena, sizeof(int) * (size + 1));
+  memset(nesting, 0, sizeof(int) * (size + 1));
+  for (i = 0; i < size; i++) {
+    Instr *instr = &program->code[i];
+    OPS op = originalOp(instr);
+    if ((op == OP_THEN || op == OP_JUMP) && instr->arg > i + 1
+        && (op == OP_THEN || originalOp(&program->code[instr->arg - 1]) != OP_RETURN)) {
+      nesting[i + 1]++;
+      nesting[instr->arg]--;
+    }
+  }
+  char *conditional = (char*) arenaAlloc(arena, size);
+  int depth = 0;
+  for (i = 0; i < size; i++) {
+    depth += nesting[i];
+    conditional[i] = depth > 0;
+  }
+  return conditional;
+}
+
+/* Analyzes a program from its first instruction. With report, reports the errors it proves */
+/* on stderr and returns how many there are. Errors in code that only runs on some paths are */
+/* not certain to happen, they are only reported with -v as ones that may. With unchecked, switches the instructions proved */
+/* not to fail to their _UNCHECKED variants. Fused instructions are analyzed as written and left as they are. */
+/* With emptyStack the stack starts empty, otherwise it holds cells left by the programs run before, */
+/* of a number and types that are not known. */
+int analyze(Program *program, int emptyStack, int report, int unchecked) {
+  int size = program->size;
+  Analysis analysis = {program, NULL, NULL, NULL, NULL, NULL, 0};
+  analysis.states = (StackState*) arenaAlloc(arena, sizeof(StackState) * size);
+  analysis.effects = (StackState*) arenaAlloc(arena, sizeof(StackState) * size);
+  analysis.words = (char*) arenaAlloc(arena, size);
+  analysis.worklist = (int*) arenaAlloc(arena, sizeof(int) * size);
+  analysis.queued = (char*) arenaAlloc(arena, size);
+  memset(analysis.states, 0, sizeof(StackState) * size);
+  memset(analysis.effects, 0, sizeof(StackState) * size);
+  memset(analysis.words, 0, size);
+  memset(analysis.queued, 0, size);
+
+  StackState entry = unknownState(0);
+  entry.exact = emptyStack;
+  analyzeFrom(&analysis, 0, &entry, -1);
+
+  char *conditional = report ? conditionalCode(program) : NULL;
+  int errors = 0, elided = 0, i;
+  for (i = 0; i < size; i++) {
+    Instr *instr = &program->code[i];
+    StackState state = analysis.states[i];
+    OPS op = originalOp(instr);
+    if (!state.reached || op == OP_JUMP || op == OP_CALL || op == OP_RETURN || op == OP_HALT) {
+      continue;
+    }
+    Step step = stepState(&state, op, instr->token);
+    if (step.error != NULL) {
+      if (report && !conditional[i]) {
+        printAssertion(step.error, instr->token);
+        errors++;
+      } else if (report && verbose) {
+        fprintf(stderr, "[%s] Analysis: may fail at %d %d: %.*s\n", thisName, instr->token->row, instr->token->col,
+          (int) strcspn(step.error, "\n"), step.error);
+      }
+    } else if (step.safe && unchecked && instr->op == op && instr->len == 1) {
+      switch (op) {
+#define UNCHECKED_SWITCH(OP, name, parser) case name: instr->op = name##_UNCHECKED; elided++; break;
+        FOR_EACH_UNCHECKED_OP(UNCHECKED_SWITCH, _)
+        case OP_THEN: instr->op = OP_THEN_UNCHECKED; elided++; break;
+        default: break;
+      }
+    }
+  }
+  if (verbose && unchecked) {
+    fprintf(stderr, "[%s] Analysis: %d of %d instructions run unchecked\n", thisName, elided, size);
+  }
+  return errors;
+}
+
+/* Just-in-time compiler: a loop that has gone round HOT_LOOP times, or a word that has been */
+/* called HOT_CALLS times, is compiled to x86-64 machine code and run from then on. */
+/* Compiled code keeps the stack in registers, %rbx the Stack, %r12 its values, %r13 its size, */
+/* and %r14 the return stack. Words call each other with `call`, through program->jitted. */
+/* Any guard that fails, on the type of an operand, too few cells or a full stack, returns to */
+/* the interpreter at the instruction being run, which then reports the error or handles the case */
+/* the compiled code does not, such as strings. Printing calls the parsers. */
+
+#define HOT_CALLS 1000
+#define JIT_PAGES_SIZE (256 * 1024)
+/* Machine stack compiled words may use calling each other, before going back to the interpreter. */
+#define JIT_STACK_SIZE (1024 * 1024)
+
+#if defined(__x86_64__)
+#define JIT_SUPPORTED 1
+#else
+#define JIT_SUPPORTED 0
+#endif
+
+/* Condition codes of jcc and setcc. */
+#define CC_B 0x2
+#define CC_AE 0x3
+#define CC_E 0x4
+#define CC_NE 0x5
+#define CC_A 0x7
+#define CC_L 0xc
+#define CC_GE 0xd
+#define CC_LE 0xe
+#define CC_G 0xf
+#define CC_ALWAYS -1
+
+/* Registers, as numbered in instructions. */
+#define RAX 0
+#define RCX 1
+#define RDX 2
+
+/* Target of the jump out of a word after a call that did not return. */
+#define JIT_EPILOGUE -1
+
+/* Prints the code of each loop and word compiled. */
+static int jitDump = 0;
+/* Lowest the machine stack may go before calls return to the interpreter. */
+/* Compiled code reads it at the address of the thread that compiled it. */
+static __thread uintptr_t jitStackLimit;
+
+typedef struct JitFixup {
+  int at;     /* offset of the rel32 to patch */
+  int target; /* instruction jumped to, or JIT_EPILOGUE */
+  int exit;   /* whether to return to the interpreter at target */
+} JitFixup;
+
+typedef struct Jit {
+  Program *program;
+  int start;            /* first instruction compiled, where the code is entered */
+  int end;              /* last instruction compiled */
+  int word;             /* whether a word is being compiled, else a loop */
+  unsigned char *code;
+  int size;
+  int capacity;
+  int *offsets;         /* offset of the code of each instruction, from start */
+  JitFixup *fixups;
+  int fixupCount;
+  int fixupCapacity;
+  struct Jit *caller;   /* being compiled when a call to this word was reached */
+} Jit;
+
+static void jitBytes(Jit *jit, const void *bytes, int length) {
+  if (jit->size + length > jit->capacity) {
+    jit->code = (unsigned char*) arenaGrow(arena, jit->code, jit->capacity, jit->capacity * 2);
+    jit->capacity *= 2;
+  }
+  memcpy(jit->code + jit->size, bytes, length);
+  jit->size += length;
+}
+
+/* Emits the bytes of a string literal, written as the instruction they encode. */
+#define JIT(jit, bytes) jitBytes(jit, bytes, sizeof(bytes) - 1)
+
+static void jitInt32(Jit *jit, uint32_t value) {
+  jitBytes(jit, &value, 4);
+}
+
+static void jitInt64(Jit *jit, uint64_t value) {
+  jitBytes(jit, &value, 8);
+}
+
+/* An instruction with the cell depth below the top as its memory operand, */
+/* -8 * (depth + 1)(%r12, %r13, 8). A depth of -1 is just above the top. */
+static void jitCell(Jit *jit, unsigned char opcode, int reg, int depth) {
+  unsigned char bytes[5] = {0x4b, opcode, 0x44 | reg << 3, 0xec, -8 * (depth + 1)};
+  jitBytes(jit, bytes, 5);
+}
+
+/* Jumps to target when condition holds, to be patched once the code of target is known. */
+static void jitJump(Jit *jit, int condition, int target, int exit) {
+  if (condition == CC_ALWAYS) {
+    JIT(jit, "\xe9");
+  } else {
+    unsigned char bytes[2] = {0x0f, 0x80 | condition};
+    jitBytes(jit, bytes, 2);
+  }
+  if (jit->fixupCount == jit->fixupCapacity) {
+    jit->fixups = (JitFixup*) arenaGrow(arena, jit->fixups,
+      sizeof(JitFixup) * jit->fixupCapacity, sizeof(JitFixup) * jit->fixupCapacity * 2);
+    jit->fixupCapacity *= 2;
+  }
+  JitFixup *fixup = &jit->fixups[jit->fixupCount++];
+  fixup->at = jit->size;
+  fixup->target = target;
+  fixup->exit = exit;
+  jitInt32(jit, 0);
+}
+
+/* Returns to the interpreter at ip when condition holds. */
+static void jitExit(Jit *jit, int condition, int ip) {
+  jitJump(jit, condition, ip, 1);
+}
+
+/* Jumps to the instruction target, in the compiled code if it is there. */
+static void jitGoto(Jit *jit, int condition, int target) {
+  jitJump(jit, condition, target, target < jit->start || target > jit->end);
+}
+
+/* Returns to the interpreter at ip unless there are count cells on the stack. */
+static void jitNeed(Jit *jit, int count, int ip) {
+  unsigned char bytes[4] = {0x49, 0x83, 0xfd, count}; /* cmp $count, %r13 */
+  jitBytes(jit, bytes, 4);
+  jitExit(jit, CC_B, ip);
+}
+
+/* Returns to the interpreter at ip if the stack has no room for another cell. */
+static void jitRoom(Jit *jit, int ip) {
+  JIT(jit, "\x44\x3b\x6b\x04"); /* cmp 4(%rbx), %r13d */
+  jitExit(jit, CC_AE, ip);
+}
+
+/* Returns to the interpreter at ip if the type of the cell in reg compares with type as condition. */
+/* Both is true to use the types of %rax and %rcx or'd together, which are at most 1 if both are. */
+static void jitType(Jit *jit, int reg, int both, int condition, int type, int ip) {
+  JIT(jit, "\x48\x89");
+  unsigned char modrm = 0xc2 | reg << 3; /* mov reg, %rdx */
+  jitBytes(jit, &modrm, 1);
+  if (both) {
+    JIT(jit, "\x48\x09\xca"); /* or %rcx, %rdx */
+  }
+  JIT(jit, "\x48\xc1\xea\x38"); /* shr $56, %rdx */
+  unsigned char compare[3] = {0x83, 0xfa, type}; /* cmp $type, %edx */
+  jitBytes(jit, compare, 3);
+  jitExit(jit, condition, ip);
+}
+
+/* Calls a C function with the arguments already in place, with the size of the stack stored */
+/* for it and loaded again after, as it may have pushed or grown the stack. */
+static void jitCallC(Jit *jit, uintptr_t function) {
+  JIT(jit, "\x44\x89\x2b"); /* mov %r13d, (%rbx) */
+  JIT(jit, "\x48\x89\xdf"); /* mov %rbx, %rdi */
+  JIT(jit, "\x48\xb8"); /* movabs $function, %rax */
+  jitInt64(jit, function);
+  JIT(jit, "\xff\xd0"); /* call *%rax */
+  JIT(jit, "\x4c\x8b\x63\x08"); /* mov 8(%rbx), %r12 */
+  JIT(jit, "\x4c\x63\x2b"); /* movslq (%rbx), %r13 */
+}
+
+/* Runs an instruction through its parser, with its checks. */
+static void jitParser(Jit *jit, void (*parser)(PARSE_FUNC_TYPE), Token *token) {
+  JIT(jit, "\x48\xbe"); /* movabs $token, %rsi */
+  jitInt64(jit, (uintptr_t) token);
+  JIT(jit, "\xba\x01\x00\x00\x00"); /* mov $1, %edx */
+  jitCallC(jit, (uintptr_t) parser);
+}
+
+/* Condition code of `x y op` comparing x to y, op being a comparison. */
+static int comparisonCondition(OPS op) {
+  switch (op) {
+    case OP_EQU: return CC_E;
+    case OP_NEQU: return CC_NE;
+    case OP_GTE: return CC_GE;
+    case OP_LTE: return CC_LE;
+    case OP_GT: return CC_G;
+    default: return CC_L;
+  }
+}
+
+/* Whether an instruction runs an op analyze() proved cannot fail. */
+static inline int isUnchecked(Instr *instr) {
+  return instr->op > OP_ADD_CONST_JUMP;
+}
+
+/* Whether any jump of the compiled code goes to the instruction at ip. */
+static int isJumpTarget(Jit *jit, int ip) {
+  int i;
+  for (i = jit->start; i <= jit->end; i++) {
+    OPS op = originalOp(&jit->program->code[i]);
+    if ((op == OP_THEN || op == OP_JUMP) && jit->program->code[i].arg == ip) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static void jitWord(Program *program, int body, Jit *caller);
+
+/* Emits the code of the instruction at ip, returning the number of instructions it stands for. */
+static int jitInstr(Jit *jit, int ip) {
+  Program *program = jit->program;
+  Instr *instr = &program->code[ip];
+  Token *token = instr->token;
+  OPS op = originalOp(instr);
+  int checked = !isUnchecked(instr);
+  switch (op) {
+    case OP_INT:
+      jitRoom(jit, ip);
+      JIT(jit, "\xb8"); /* mov $value, %eax */
+      jitInt32(jit, (uint32_t) token->value);
+      jitCell(jit, 0x89, RAX, -1);
+      JIT(jit, "\x49\xff\xc5"); /* inc %r13 */
+      return 1;
+    case OP_CHAR:
+      jitRoom(jit, ip);
+      JIT(jit, "\x48\xb8"); /* movabs $cell, %rax */
+      jitInt64(jit, makeCell(TYPE_CHAR, token->value));
+      jitCell(jit, 0x89, RAX, -1);
+      JIT(jit, "\x49\xff\xc5"); /* inc %r13 */
+      return 1;
+    case OP_STR:
+      JIT(jit, "\x48\xbe"); /* movabs $literal, %rsi */
+      jitInt64(jit, (uintptr_t) program->literals[instr->arg]);
+      jitCallC(jit, (uintptr_t) parseSTR);
+      return 1;
+    case OP_ADD:
+    case OP_SUB:
+    case OP_MUL:
+    case OP_DIV:
+    case OP_REM:
+      if (checked) {
+        jitNeed(jit, 2, ip);
+      }
+      jitCell(jit, 0x8b, op == OP_DIV || op == OP_REM ? RCX : RAX, 0);
+      jitCell(jit, 0x8b, op == OP_DIV || op == OP_REM ? RAX : RCX, 1);
+      if (op == OP_ADD || op == OP_SUB) {
+        JIT(jit, "\x48\x89\xc2"); /* mov %rax, %rdx */
+        JIT(jit, "\x48\xc1\xea\x38"); /* shr $56, %rdx */
+        JIT(jit, "\x48\x89\xce"); /* mov %rcx, %rsi */
+        JIT(jit, "\x48\xc1\xee\x38"); /* shr $56, %rsi */
+      }
+      if (op == OP_ADD) {
+        if (checked) {
+          JIT(jit, "\x83\xfa\x01"); /* cmp $1, %edx */
+          jitExit(jit, CC_A, ip);
+          JIT(jit, "\x83\xfe\x01"); /* cmp $1, %esi */
+          jitExit(jit, CC_A, ip);
+          JIT(jit, "\x89\xd7"); /* mov %edx, %edi */
+          JIT(jit, "\x21\xf7"); /* and %esi, %edi */
+          jitExit(jit, CC_NE, ip);
+        }
+        /* The sum is a char if either is. */
+        JIT(jit, "\x01\xc8"); /* add %ecx, %eax */
+        JIT(jit, "\x09\xf2"); /* or %esi, %edx */
+        JIT(jit, "\x48\xc1\xe2\x38"); /* shl $56, %rdx */
+        JIT(jit, "\x48\x09\xd0"); /* or %rdx, %rax */
+        jitCell(jit, 0x89, RAX, 1);
+      } else if (op == OP_SUB) {
+        if (checked) {
+          JIT(jit, "\x85\xd2"); /* test %edx, %edx */
+          jitExit(jit, CC_NE, ip);
+          JIT(jit, "\x83\xfe\x01"); /* cmp $1, %esi */
+          jitExit(jit, CC_A, ip);
+        }
+        /* The difference has the type of the cell subtracted from. */
+        JIT(jit, "\x29\xc1"); /* sub %eax, %ecx */
+        JIT(jit, "\x48\xc1\xe6\x38"); /* shl $56, %rsi */
+        JIT(jit, "\x48\x09\xf1"); /* or %rsi, %rcx */
+        jitCell(jit, 0x89, RCX, 1);
+      } else {
+        if (checked) {
+          jitType(jit, RAX, 1, CC_NE, TYPE_INT, ip);
+        }
+        if (op == OP_MUL) {
+          JIT(jit, "\x0f\xaf\xc1"); /* imul %ecx, %eax */
+        } else {
+          JIT(jit, "\x99\xf7\xf9"); /* cltd; idiv %ecx */
+          if (op == OP_REM) {
+            JIT(jit, "\x89\xd0"); /* mov %edx, %eax */
+          }
+        }
+        jitCell(jit, 0x89, RAX, 1);
+      }
+      JIT(jit, "\x49\xff\xcd"); /* dec %r13 */
+      return 1;
+    case OP_EQU:
+    case OP_NEQU:
+    case OP_GTE:
+    case OP_LTE:
+    case OP_GT:
+    case OP_LT: {
+      if (checked) {
+        jitNeed(jit, 2, ip);
+      }
+      jitCell(jit, 0x8b, RAX, 0);
+      jitCell(jit, 0x8b, RCX, 1);
+      if (checked || op == OP_EQU || op == OP_NEQU) {
+        /* Strings are compared by the interpreter. */
+        jitType(jit, RAX, 1, CC_A, TYPE_CHAR, ip);
+      }
+      int condition = comparisonCondition(op);
+      Instr *next = &program->code[ip + 1];
+      if (ip < jit->end && originalOp(next) == OP_THEN && !isJumpTarget(jit, ip + 1)) {
+        /* Compares and branches without pushing the result. */
+        JIT(jit, "\x49\x83\xed\x02"); /* sub $2, %r13 */
+        JIT(jit, "\x39\xc1"); /* cmp %eax, %ecx */
+        jitGoto(jit, condition ^ 1, next->arg);
+        jit->offsets[ip + 1 - jit->start] = jit->size;
+        return 2;
+      }
+      JIT(jit, "\x39\xc1"); /* cmp %eax, %ecx */
+      unsigned char set[3] = {0x0f, 0x90 | condition, 0xc0}; /* setcc %al */
+      jitBytes(jit, set, 3);
+      JIT(jit, "\x0f\xb6\xc0"); /* movzbl %al, %eax */
+      jitCell(jit, 0x89, RAX, 1);
+      JIT(jit, "\x49\xff\xcd"); /* dec %r13 */
+      return 1;
+    }
+    case OP_POP:
+      jitParser(jit, parsePOP, token);
+      return 1;
+    case OP_SIZE:
+      jitParser(jit, parseSIZE, token);
+      return 1;
+    case OP_PSTACK:
+      jitParser(jit, parsePSTACK, token);
+      return 1;
+    case OP_DUP:
+    case OP_OVER:
+      if (checked) {
+        jitNeed(jit, op == OP_DUP ? 1 : 2, ip);
+      }
+      jitRoom(jit, ip);
+      jitCell(jit, 0x8b, RAX, op == OP_DUP ? 0 : 1);
+      /* Strings are copied by the interpreter, which counts their references. */
+      jitType(jit, RAX, 0, CC_A, TYPE_CHAR, ip);
+      jitCell(jit, 0x89, RAX, -1);
+      JIT(jit, "\x49\xff\xc5"); /* inc %r13 */
+      return 1;
+    case OP_DROP:
+      if (checked) {
+        jitNeed(jit, 1, ip);
+      }
+      jitCell(jit, 0x8b, RAX, 0);
+      jitType(jit, RAX, 0, CC_A, TYPE_CHAR, ip);
+      JIT(jit, "\x49\xff\xcd"); /* dec %r13 */
+      return 1;
+    case OP_SWAP:
+      if (checked) {
+        jitNeed(jit, 2, ip);
+      }
+      jitCell(jit, 0x8b, RAX, 0);
+      jitCell(jit, 0x8b, RCX, 1);
+      jitCell(jit, 0x89, RAX, 1);
+      jitCell(jit, 0x89, RCX, 0);
+      return 1;
+    case OP_ROT:
+      if (checked) {
+        jitNeed(jit, 3, ip);
+      }
+      /* c b a -> b a c */
+      jitCell(jit, 0x8b, RAX, 0);
+      jitCell(jit, 0x8b, RCX, 1);
+      jitCell(jit, 0x8b, RDX, 2);
+      jitCell(jit, 0x89, RCX, 2);
+      jitCell(jit, 0x89, RAX, 1);
+      jitCell(jit, 0x89, RDX, 0);
+      return 1;
+    case OP_THEN:
+      if (checked) {
+        jitNeed(jit, 1, ip);
+      }
+      jitCell(jit, 0x8b, RAX, 0);
+      if (checked) {
+        jitType(jit, RAX, 0, CC_NE, TYPE_INT, ip);
+      }
+      JIT(jit, "\x49\xff\xcd"); /* dec %r13 */
+      JIT(jit, "\x85\xc0"); /* test %eax, %eax */
+      jitGoto(jit, CC_E, instr->arg);
+      return 1;
+    case OP_CAST_INT:
+    case OP_CAST_CHAR:
+      if (checked) {
+        jitNeed(jit, 1, ip);
+      }
+      jitCell(jit, 0x8b, RAX, 0);
+      if (checked) {
+        jitType(jit, RAX, 0, CC_NE, op == OP_CAST_INT ? TYPE_CHAR : TYPE_INT, ip);
+      }
+      if (op == OP_CAST_INT) {
+        JIT(jit, "\x89\xc0"); /* mov %eax, %eax */
+      } else {
+        JIT(jit, "\x48\xba"); /* movabs $cell, %rdx */
+        jitInt64(jit, makeCell(TYPE_CHAR, 0));
+        JIT(jit, "\x48\x09\xd0"); /* or %rdx, %rax */
+      }
+      jitCell(jit, 0x89, RAX, 0);
+      return 1;
+    case OP_JUMP:
+      jitGoto(jit, CC_ALWAYS, instr->arg);
+      return 1;
+    case OP_CALL: {
+      int body = instr->arg;
+      Jit *pending = jit;
+      while (pending != NULL && !(pending->word && pending->start == body)) {
+        pending = pending->caller;
+      }
+      if (program->jitted[body] == NULL && pending == NULL) {
+        jitWord(program, body, jit);
+      }
+      int end = program->code[body - 1].arg - 1;
+      /* Too deep on the machine stack, or the return stack is full. */
+      JIT(jit, "\x48\xb8"); /* movabs $jitStackLimit, %rax */
+      jitInt64(jit, (uintptr_t) &jitStackLimit);
+      JIT(jit, "\x48\x3b\x20"); /* cmp (%rax), %rsp */
+      jitExit(jit, CC_B, ip);
+      JIT(jit, "\x41\x8b\x06"); /* mov (%r14), %eax */
+      JIT(jit, "\x41\x3b\x46\x04"); /* cmp 4(%r14), %eax */
+      jitExit(jit, CC_AE, ip);
+      /* Pushes the instruction after the call, for the interpreter if the word does not return. */
+      JIT(jit, "\x49\x8b\x56\x08"); /* mov 8(%r14), %rdx */
+      JIT(jit, "\xc7\x04\x82"); /* movl $return, (%rdx, %rax, 4) */
+      jitInt32(jit, ip + 1);
+      JIT(jit, "\xff\xc0"); /* inc %eax */
+      JIT(jit, "\x41\x89\x06"); /* mov %eax, (%r14) */
+      JIT(jit, "\x4c\x89\xf6"); /* mov %r14, %rsi */
+      JIT(jit, "\x44\x89\x2b"); /* mov %r13d, (%rbx) */
+      JIT(jit, "\x48\x89\xdf"); /* mov %rbx, %rdi */
+      JIT(jit, "\x48\xb8"); /* movabs $slot, %rax */
+      jitInt64(jit, (uintptr_t) &program->jitted[body]);
+      JIT(jit, "\xff\x10"); /* call *(%rax) */
+      JIT(jit, "\x4c\x8b\x63\x08"); /* mov 8(%rbx), %r12 */
+      JIT(jit, "\x4c\x63\x2b"); /* movslq (%rbx), %r13 */
+      /* The word returned if it stopped at its RETURN, else the interpreter carries on in it. */
+      JIT(jit, "\x3d"); /* cmp $end, %eax */
+      jitInt32(jit, end);
+      jitJump(jit, CC_NE, JIT_EPILOGUE, 0);
+      JIT(jit, "\x41\xff\x0e"); /* decl (%r14) */
+      return 1;
+    }
+    default:
+      /* Everything else, including RETURN, is left to the interpreter. */
+      jitExit(jit, CC_ALWAYS, ip);
+      return 1;
+  }
+}
+
+/* Copies code into the executable pages of the context, returning where it is. */
+static void* jitInstall(unsigned char *code, size_t size) {
+  JitMemory *memory = &current->jit;
+  if (memory->pages == NULL || memory->used + size > memory->size) {
+    if (memory->pages != NULL) {
+      JitMemory *full = (JitMemory*) allocate(sizeof(JitMemory));
+      assert(full != NULL, "Out of memory while compiling code.");
+      *full = *memory;
+      memory->full = full;
+    }
+    size_t pagesSize = size > JIT_PAGES_SIZE ? size : JIT_PAGES_SIZE;
+    void *pages = mmap(NULL, pagesSize, PROT_READ | PROT_EXEC, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    assert(pages != MAP_FAILED, "Could not allocate memory for compiled code.");
+    memory->pages = (unsigned char*) pages;
+    memory->size = pagesSize;
+    memory->used = 0;
+  }
+  unsigned char *start = memory->pages + memory->used;
+  assert(mprotect(memory->pages, memory->size, PROT_READ | PROT_WRITE) == 0, "Could not write compiled code.");
+  memcpy(start, code, size);
+  assert(mprotect(memory->pages, memory->size, PROT_READ | PROT_EXEC) == 0, "Could not run compiled code.");
+  memory->used += (size + 15) & ~(size_t) 15;
+  return start;
+}
+
+/* Unmaps the pages filled before the last, and the last unless they are kept for the next program. */
+static void releaseJitMemory(JitMemory *memory, int keepLast) {
+  while (memory->full != NULL) {
+    JitMemory *full = memory->full;
+    munmap(full->pages, full->size);
+    memory->full = full->full;
+    free(full);
+  }
+  if (!keepLast && memory->pages != NULL) {
+    munmap(memory->pages, memory->size);
+    memory->pages = NULL;
+    memory->size = 0;
+  }
+  memory->used = 0;
+}
+
+/* Prints the bytes of the code from start to end, for -D. */
+static void dumpCode(unsigned char *code, int start, int end, char *label, Token *token) {
+  fprintf(stderr, "  %04x  %-12s", start, label);
+  if (token != NULL) {
+    fprintf(stderr, " %4d %-4d", token->row, token->col);
+  } else {
+    fprintf(stderr, " %9s", "");
+  }
+  int i;
+  for (i = start; i < end; i++) {
+    if (i > start && (i - start) % 16 == 0) {
+      fprintf(stderr, "\n  %28s", "");
+    }
+    fprintf(stderr, " %02x", code[i]);
+  }
+  fprintf(stderr, "\n");
+}
+
+/* Compiles the instructions from start to end, entered at start. */
+static JitCode jitCompile(Program *program, int start, int end, int word, Jit *caller) {
+  Jit jit;
+  jit.program = program;
+  jit.start = start;
+  jit.end = end;
+  jit.word = word;
+  jit.capacity = 256;
+  jit.size = 0;
+  jit.code = (unsigned char*) arenaAlloc(arena, jit.capacity);
+  jit.offsets = (int*) arenaAlloc(arena, sizeof(int) * (end - start + 1));
+  jit.fixupCapacity = 16;
+  jit.fixupCount = 0;
+  jit.fixups = (JitFixup*) arenaAlloc(arena, sizeof(JitFixup) * jit.fixupCapacity);
+  jit.caller = caller;
+
+  JIT(&jit, "\x53\x41\x54\x41\x55\x41\x56\x41\x57"); /* push %rbx, %r12, %r13, %r14, %r15 */
+  JIT(&jit, "\x48\x89\xfb"); /* mov %rdi, %rbx */
+  JIT(&jit, "\x49\x89\xf6"); /* mov %rsi, %r14 */
+  JIT(&jit, "\x4c\x8b\x63\x08"); /* mov 8(%rbx), %r12 */
+  JIT(&jit, "\x4c\x63\x2b"); /* movslq (%rbx), %r13 */
+  int prologue = jit.size;
+  int ip = start;
+  while (ip <= end) {
+    jit.offsets[ip - start] = jit.size;
+    ip += jitInstr(&jit, ip);
+  }
+  int body = jit.size;
+
+  JIT(&jit, "\x44\x89\x2b"); /* mov %r13d, (%rbx) */
+  JIT(&jit, "\x41\x5f\x41\x5e\x41\x5d\x41\x5c\x5b\xc3"); /* pop %r15, %r14, %r13, %r12, %rbx; ret */
+  int epilogue = body;
+  /* A stub per instruction returned to, at most one past the end for leaving a loop. */
+  int *exits = (int*) arenaAlloc(arena, sizeof(int) * (end - start + 2));
+  int i;
+  for (i = 0; i < end - start + 2; i++) {
+    exits[i] = -1;
+  }
+  int stubs = jit.size;
+  for (i = 0; i < jit.fixupCount; i++) {
+    JitFixup *fixup = &jit.fixups[i];
+    int target;
+    if (fixup->target == JIT_EPILOGUE) {
+      target = epilogue;
+    } else if (fixup->exit) {
+      assert(fixup->target >= start && fixup->target <= end + 1, "Compiled code leaves where it was entered.");
+      if (exits[fixup->target - start] == -1) {
+        exits[fixup->target - start] = jit.size;
+        JIT(&jit, "\xb8"); /* mov $ip, %eax */
+        jitInt32(&jit, fixup->target);
+        JIT(&jit, "\xe9"); /* jmp epilogue */
+        jitInt32(&jit, epilogue - (jit.size + 4));
+      }
+      target = exits[fixup->target - start];
+    } else {
+      target = jit.offsets[fixup->target - start];
+    }
+    int32_t relative = target - (fixup->at + 4);
+    memcpy(jit.code + fixup->at, &relative, 4);
+  }
+  JitCode code = (JitCode) jitInstall(jit.code, jit.size);
+
+  Token *token = program->code[word ? start - 1 : end].token;
+  if (verbose || jitDump) {
+    fprintf(stderr, "[%s] JIT compiled %s at %d %d: %d instructions, %d bytes\n", thisName,
+      word ? "word" : "loop", token->row, token->col, end - start + 1, jit.size);
+  }
+  if (jitDump) {
+    dumpCode(jit.code, 0, prologue, "entry", NULL);
+    for (ip = start; ip <= end; ip++) {
+      Instr *instr = &program->code[ip];
+      int next = ip < end ? jit.offsets[ip + 1 - start] : body;
+      char *label = originalOp(instr) == OP_STR ? "\"...\"" : stringAt(strings, instr->token->word);
+      dumpCode(jit.code, jit.offsets[ip - start], next, label, instr->token);
+    }
+    dumpCode(jit.code, body, stubs, "exit", NULL);
+    dumpCode(jit.code, stubs, jit.size, "returns", NULL);
+  }
+  return code;
+}
+
+/* Compiles the loop from start to its backward jump at end, entered in place of the jump. */
+void jitLoop(Program *program, int start, int end) {
+  program->jitted[end] = jitCompile(program, start, end, 0, NULL);
+}
+
+/* Compiles the word whose first instruction is body, up to its RETURN. */
+static void jitWord(Program *program, int body, Jit *caller) {
+  /* The JUMP over the body is just before it. */
+  int end = program->code[body - 1].arg - 1;
+  program->jitted[body] = jitCompile(program, body, end, 1, caller);
+}
+
+/* Enables the JIT for a program, which must have been optimized. */
+void enableJit(Program *program) {
+  program->jitted = (JitCode*) arenaAlloc(arena, sizeof(JitCode) * program->size);
+  memset(program->jitted, 0, sizeof(JitCode) * program->size);
+}
+
+/* Profiling with -p: every op run and every call of a word is counted, and where the time goes */
+/* is sampled from a timer, as gprof does. Each sample is charged to the op being run, the word */
+/* running it and the path of calls that led there. execute() only goes through profileStep() */
+/* while profiling, so running without it costs nothing. */
+
+#define PROFILE_INTERVAL 100 /* microseconds between samples */
+/* Paths of calls deeper than this are folded into the deepest node, recursion would grow the tree without end. */
+#define PROFILE_MAX_DEPTH 128
+
+typedef struct ProfileWord {
+  long calls;
+  int active;       /* calls of it being run */
+  long inclusive;   /* samples in the word and the words it called, recursion counted once */
+  long exclusive;   /* samples in the word itself */
+} ProfileWord;
+
+/* A node of the tree of paths of calls, written out as folded stacks. */
+typedef struct ProfileNode {
+  int word;     /* body of the word, 0 for the program */
+  int parent;
+  int child;    /* first child, -1 for none */
+  int sibling;
+  long samples;
+} ProfileNode;
+
+typedef struct Profile {
+  Program *program;
+  char *name;                   /* of the program, at the root of the folded stacks */
+  FILE *folded;
+  long ops[OPS_COUNT];
+  long sourceOps[OPS_COUNT];    /* ops as compiled, before they were fused or made unchecked */
+  long opSamples[OPS_COUNT];
+  ProfileWord *words;           /* by body, the program itself at 0 */
+  ProfileNode *nodes;
+  int nodeCount, nodeCapacity;
+  int node;                     /* the path of calls being run */
+  int *frames;                  /* the words being run, as the return stack */
+  int depth, frameCapacity;
+  /* The words being run at least once, in the order they were entered. A word entered after */
+  /* another returns before it, so this is a stack too. */
+  int *active;
+  int activeCount;
+  int op;                       /* the op being run */
+  int peakDepth;                /* of the data stack, in cells */
+  volatile sig_atomic_t pending; /* samples taken since the last op */
+  long samples;
+  struct timespec start;
+} Profile;
+
+static Profile *profile = NULL;
+
+static void profileAlarm(int signal) {
+  (void) signal;
+  profile->pending++;
+}
+
+/* Profiles the run of a program, writing folded stacks to path when it exits. */
+/* Without a path, it only counts, for -s. */
+Profile* newProfile(Program *program, char *filename, char *path) {
+  Profile *profile = (Profile*) arenaAlloc(arena, sizeof(Profile));
+  memset(profile, 0, sizeof(Profile));
+  profile->program = program;
+  char *name = strrchr(filename, '/');
+  profile->name = name == NULL ? filename : name + 1;
+  if (path != NULL) {
+    profile->folded = fopen(path, "w");
+    assert(profile->folded != NULL, "Could not open the file to write the profile to.");
+  }
+  profile->words = (ProfileWord*) arenaAlloc(arena, sizeof(ProfileWord) * program->size);
+  memset(profile->words, 0, sizeof(ProfileWord) * program->size);
+  profile->words[0].calls = 1;
+  profile->nodeCapacity = 64;
+  profile->nodes = (ProfileNode*) arenaAlloc(arena, sizeof(ProfileNode) * profile->nodeCapacity);
+  profile->nodes[0].word = 0;
+  profile->nodes[0].parent = -1;
+  profile->nodes[0].child = -1;
+  profile->nodes[0].sibling = -1;
+  profile->nodes[0].samples = 0;
+  profile->nodeCount = 1;
+  profile->frameCapacity = 64;
+  profile->frames = (int*) arenaAlloc(arena, sizeof(int) * profile->frameCapacity);
+  profile->active = (int*) arenaAlloc(arena, sizeof(int) * program->size);
+  profile->op = OP_HALT;
+  return profile;
+}
+
+/* Starts taking samples. */
+void startProfile(Profile *profile) {
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = profileAlarm;
+  action.sa_flags = SA_RESTART;
+  sigemptyset(&action.sa_mask);
+  assert(sigaction(SIGALRM, &action, NULL) == 0, "Could not start profiling.");
+  struct itimerval timer = {{0, PROFILE_INTERVAL}, {0, PROFILE_INTERVAL}};
+  assert(setitimer(ITIMER_REAL, &timer, NULL) == 0, "Could not start profiling.");
+  clock_gettime(CLOCK_MONOTONIC, &profile->start);
+}
+
+/* Charges the samples taken since the last op to it, to the word running it and its callers, */
+/* and to the path of calls. */
+static void profileSample(Profile *profile) {
+  int samples = profile->pending;
+  profile->pending -= samples;
+  profile->samples += samples;
+  profile->opSamples[profile->op] += samples;
+  profile->nodes[profile->node].samples += samples;
+  profile->words[profile->depth > 0 ? profile->frames[profile->depth - 1] : 0].exclusive += samples;
+  int i;
+  for (i = 0; i < profile->activeCount; i++) {
+    profile->words[profile->active[i]].inclusive += samples;
+  }
+}
+
+static void profileCall(Profile *profile, int word) {
+  if (profile->depth == profile->frameCapacity) {
+    profile->frames = (int*) arenaGrow(arena, profile->frames,
+      sizeof(int) * profile->frameCapacity, sizeof(int) * profile->frameCapacity * 2);
+    profile->frameCapacity *= 2;
+  }
+  profile->frames[profile->depth++] = word;
+  profile->words[word].calls++;
+  if (profile->words[word].active++ == 0) {
+    profile->active[profile->activeCount++] = word;
+  }
+  if (profile->depth > PROFILE_MAX_DEPTH) {
+    return;
+  }
+  int child = profile->nodes[profile->node].child;
+  while (child != -1 && profile->nodes[child].word != word) {
+    child = profile->nodes[child].sibling;
+  }
+  if (child == -1) {
+    if (profile->nodeCount == profile->nodeCapacity) {
+      profile->nodes = (ProfileNode*) arenaGrow(arena, profile->nodes,
+        sizeof(ProfileNode) * profile->nodeCapacity, sizeof(ProfileNode) * profile->nodeCapacity * 2);
+      profile->nodeCapacity *= 2;
+    }
+    child = profile->nodeCount++;
+    ProfileNode *node = &profile->nodes[child];
+    node->word = word;
+    node->parent = profile->node;
+    node->child = -1;
+    node->sibling = profile->nodes[profile->node].child;
+    node->samples = 0;
+    profile->nodes[profile->node].child = child;
+  }
+  profile->node = child;
+}
+
+static void profileReturn(Profile *profile) {
+  int word = profile->frames[--profile->depth];
+  if (--profile->words[word].active == 0) {
+    profile->activeCount--;
+  }
+  if (profile->depth < PROFILE_MAX_DEPTH) {
+    profile->node = profile->nodes[profile->node].parent;
+  }
+}
+
+/* Called by execute() before each instruction while profiling or collecting statistics. */
+static void profileStep(Profile *profile, Instr *instr, Stack *stack) {
+  if (profile->pending != 0) {
+    profileSample(profile);
+  }
+  if (stack->size > profile->peakDepth) {
+    profile->peakDepth = stack->size;
+  }
+  profile->op = instr->op;
+  profile->ops[instr->op]++;
+  /* A fused op runs every instruction it replaced. */
+  int i;
+  for (i = 0; i < (instr->len > 1 ? instr->len : 1); i++) {
+    profile->sourceOps[originalOp(&instr[i])]++;
+  }
+  if (instr->op == OP_CALL) {
+    profileCall(profile, instr->arg);
+  } else if (instr->op == OP_RETURN && profile->depth > 0) {
+    profileReturn(profile);
+  }
+}
+
+static char* profileWordName(Profile *profile, int word) {
+  /* The JUMP over the body of a word has its name for a token. */
+  return word == 0 ? profile->name : stringAt(strings, profile->program->code[word - 1].token->word);
+}
+
+/* Orders words and ops by their samples, the most first, then words by calls. */
+static int compareProfileWords(const void *a, const void *b) {
+  ProfileWord *x = &profile->words[*(int*) a], *y = &profile->words[*(int*) b];
+  if (x->exclusive != y->exclusive) {
+    return (x->exclusive < y->exclusive) - (x->exclusive > y->exclusive);
+  }
+  return (x->calls < y->calls) - (x->calls > y->calls);
+}
+
+static int compareProfileOps(const void *a, const void *b) {
+  int x = *(int*) a, y = *(int*) b;
+  if (profile->opSamples[x] != profile->opSamples[y]) {
+    return (profile->opSamples[x] < profile->opSamples[y]) - (profile->opSamples[x] > profile->opSamples[y]);
+  }
+  return (profile->ops[x] < profile->ops[y]) - (profile->ops[x] > profile->ops[y]);
+}
+
+/* Called by execute() when a fused op runs the instruction it replaced instead, which leaves the */
+/* rest of them to be counted as they run. */
+static void profileUnfuse(Profile *profile, Instr *instr) {
+  int i;
+  for (i = 1; i < instr->len; i++) {
+    profile->sourceOps[originalOp(&instr[i])]--;
+  }
+}
+
+/* Writes the folded stacks of the profile and prints its summary. Called at exit, */
+/* so that a program stopped by an error is profiled up to it. */
+void writeProfile(void) {
+  struct itimerval stop = {{0, 0}, {0, 0}};
+  setitimer(ITIMER_REAL, &stop, NULL);
+  /* The summary follows everything the program printed. */
+  flushOutput();
+  struct timespec end;
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  double seconds = (end.tv_sec - profile->start.tv_sec) + (end.tv_nsec - profile->start.tv_nsec) / 1e9;
+  profileSample(profile);
+  profile->words[0].inclusive = profile->samples;
+  double perSample = profile->samples > 0 ? seconds / profile->samples : 0;
+  double percent = profile->samples > 0 ? 100.0 / profile->samples : 0;
+
+  /* A line per path of calls sampled: the words on it from the program down, then its samples. */
+  int *path = (int*) arenaAlloc(arena, sizeof(int) * (PROFILE_MAX_DEPTH + 1));
+  int i;
+  for (i = 0; i < profile->nodeCount; i++) {
+    if (profile->nodes[i].samples == 0) {
+      continue;
+    }
+    int length = 0, node;
+    for (node = i; node != -1; node = profile->nodes[node].parent) {
+      path[length++] = profile->nodes[node].word;
+    }
+    while (length-- > 0) {
+      fprintf(profile->folded, "%s%c", profileWordName(profile, path[length]), length > 0 ? ';' : ' ');
+    }
+    fprintf(profile->folded, "%ld\n", profile->nodes[i].samples);
+  }
+  fclose(profile->folded);
+
+  long ops = 0;
+  for (i = 0; i < OPS_COUNT; i++) {
+    ops += profile->ops[i];
+  }
+  fprintf(stderr, "[%s] Profile: %ld ops in %.6f s, %ld samples\n", thisName, ops, seconds, profile->samples);
+  int size = profile->program->size;
+  int *order = (int*) arenaAlloc(arena, sizeof(int) * (size > OPS_COUNT ? size : OPS_COUNT));
+  int count = 0;
+  for (i = 0; i < size; i++) {
+    if (profile->words[i].calls > 0) {
+      order[count++] = i;
+    }
+  }
+  qsort(order, count, sizeof(int), compareProfileWords);
+  fprintf(stderr, "  %-20s %12s %12s %7s %12s %7s\n", "word", "calls", "inclusive s", "%", "exclusive s", "%");
+  for (i = 0; i < count; i++) {
+    ProfileWord *word = &profile->words[order[i]];
+    fprintf(stderr, "  %-20s %12ld %12.6f %6.2f%% %12.6f %6.2f%%\n", profileWordName(profile, order[i]), word->calls,
+      word->inclusive * perSample, word->inclusive * percent, word->exclusive * perSample, word->exclusive * percent);
+  }
+  count = 0;
+  for (i = 0; i < OPS_COUNT; i++) {
+    if (profile->ops[i] > 0) {
+      order[count++] = i;
+    }
+  }
+  qsort(order, count, sizeof(int), compareProfileOps);
+  fprintf(stderr, "  %-20s %12s %12s %7s\n", "op", "count", "time s", "%");
+  for (i = 0; i < count; i++) {
+    int op = order[i];
+    fprintf(stderr, "  %-20s %12ld %12.6f %6.2f%%\n", opNames[op] + 3, profile->ops[op],
+      profile->opSamples[op] * perSample, profile->opSamples[op] * percent);
+  }
+}
+
+/* Statistics with -s: the time taken by each phase of a run, the ops run, the memory allocated */
+/* and the deepest the stack went, written as JSON at exit. Ops and the stack are counted through */
+/* profileStep(), with a profile that takes no samples unless -p was also passed. */
+
+typedef enum PHASE {
+  PHASE_LEX,       /* reading and lexing the source */
+  PHASE_COMPILE,   /* compiling it, building definitions, or loading it from the cache */
+  PHASE_OPTIMIZE,  /* optimizing and analyzing it */
+  PHASE_EXECUTE,
+  PHASE_COUNT
+} PHASE;
+
+static const char *const phaseNames[PHASE_COUNT] = {"lex", "compile", "optimize", "execute"};
+
+typedef struct Stats {
+  FILE *file;
+  char *filename;
+  int phase;                  /* -1 before the first */
+  double wall[PHASE_COUNT];
+  double cpu[PHASE_COUNT];
+  double wallStart, cpuStart; /* of the current phase */
+  int cached;
+  int completed;              /* whether the program ran to its end */
+} Stats;
+
+static Stats *stats = NULL;
+
+static double clockSeconds(clockid_t clock) {
+  struct timespec now;
+  clock_gettime(clock, &now);
+  return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Collects statistics on the run of filename, written to path at exit, or to stderr if it is NULL. */
+Stats* newStats(char *filename, char *path) {
+  Stats *stats = (Stats*) arenaAlloc(arena, sizeof(Stats));
+  memset(stats, 0, sizeof(Stats));
+  stats->file = path == NULL ? stderr : fopen(path, "w");
+  assert(stats->file != NULL, "Could not open the file to write statistics to.");
+  stats->filename = filename;
+  stats->phase = -1;
+  return stats;
+}
+
+/* Ends the current phase of the run, if statistics are being collected, and starts the next. */
+void enterPhase(int phase) {
+  if (stats == NULL) {
+    return;
+  }
+  double wall = clockSeconds(CLOCK_MONOTONIC), cpu = clockSeconds(CLOCK_PROCESS_CPUTIME_ID);
+  if (stats->phase != -1) {
+    stats->wall[stats->phase] += wall - stats->wallStart;
+    stats->cpu[stats->phase] += cpu - stats->cpuStart;
+  }
+  stats->phase = phase;
+  stats->wallStart = wall;
+  stats->cpuStart = cpu;
+}
+
+/* Writes a JSON string. */
+static void writeJsonString(FILE *file, const char *string) {
+  fputc('"', file);
+  for (; *string != '\0'; string++) {
+    unsigned char c = *string;
+    if (c == '"' || c == '\\') {
+      fprintf(file, "\\%c", c);
+    } else if (c < 0x20) {
+      fprintf(file, "\\u%04x", c);
+    } else {
+      fputc(c, file);
+    }
+  }
+  fputc('"', file);
+}
+
+/* Writes the statistics as JSON. Called at exit, so that a program stopped by an error is */
+/* counted up to it. */
+void writeStats(void) {
+  enterPhase(stats->phase);
+  flushOutput();
+  FILE *file = stats->file;
+  fprintf(file, "{\n  \"program\": ");
+  writeJsonString(file, stats->filename);
+  fprintf(file, ",\n  \"cached\": %s,\n  \"completed\": %s,\n  \"phases\": {\n",
+    stats->cached ? "true" : "false", stats->completed ? "true" : "false");
+  int i;
+  for (i = 0; i < PHASE_COUNT; i++) {
+    fprintf(file, "    \"%s\": {\"wall\": %.9f, \"cpu\": %.9f}%s\n", phaseNames[i],
+      stats->wall[i], stats->cpu[i], i < PHASE_COUNT - 1 ? "," : "");
+  }
+  /* Ops are counted as written in the program, whatever they were optimized to. */
+  long ops = 0;
+  for (i = 0; profile != NULL && i < OPS_COUNT; i++) {
+    ops += profile->sourceOps[i];
+  }
+  fprintf(file, "  },\n  \"ops\": %ld,\n  \"opsByType\": {", ops);
+  int first = 1;
+  for (i = 0; profile != NULL && i < OPS_COUNT; i++) {
+    if (profile->sourceOps[i] > 0) {
+      fprintf(file, "%s\n    \"%s\": %ld", first ? "" : ",", opNames[i] + 3, profile->sourceOps[i]);
+      first = 0;
+    }
+  }
+  fprintf(file, "%s},\n", first ? "" : "\n  ");
+  fprintf(file, "  \"malloc\": {\"calls\": %ld, \"bytes\": %ld},\n", mallocCalls, mallocBytes);
+  fprintf(file, "  \"peakStackDepth\": %d\n}\n", profile != NULL ? profile->peakDepth : 0);
+  if (file != stderr) {
+    fclose(file);
+  }
+}
+
+/* Executes a program from instruction ip until it halts. */
+/* Words are called by pushing the instruction after the call onto a return stack and jumping to their body. */
+/* Each operation has its own label (or case, without threaded dispatch) generated from FOR_EACH_OP, */
+/* and jumps straight to the next operation's label when done. */
+/* A fused op runs the instruction it replaced with UNFUSE() when its fast path does not apply. */
+/* Hot loops and words are compiled by the JIT if it is enabled, and entered in place of their */
+/* backward jump or call. With a profile, each op is handed to profileStep() before it runs. */
+void execute(Stack* stack, Program* program, int ip) {
+  ReturnStack *calls = newReturnStack();
+  Instr *code = program->code;
+  Instr *instr;
+  Token *token;
+  Cell *top;
+  if (program->jitted != NULL) {
+    jitStackLimit = (uintptr_t) &code - JIT_STACK_SIZE;
+  }
+#if THREADED_DISPATCH
+#define OP_LABEL(name, word) &&LABEL_##name,
+  static void *const labels[OPS_COUNT] = {
+    FOR_EACH_OP(OP_LABEL)
+  };
+  /* While profiling, every op is dispatched to PROFILE first. */
+#define PROFILE_LABEL(name, word) &&PROFILE,
+  static void *const profiled[OPS_COUNT] = {
+    FOR_EACH_OP(PROFILE_LABEL)
+  };
+  /* While a hot loop is sampled, every op is dispatched to SAMPLE first, then to PROFILE if profiling. */
+#define SAMPLE_LABEL(name, word) &&SAMPLE,
+  static void *const sampled[OPS_COUNT] = {
+    FOR_EACH_OP(SAMPLE_LABEL)
+  };
+  void *const *dispatch = profile != NULL ? profiled : labels;
+#define CASE(name) LABEL_##name:
+#define NEXT() instr = &code[ip++]; token = instr->token; goto *dispatch[instr->op]
+#define UNFUSE() if (profile != NULL) profileUnfuse(profile, instr); goto *labels[token->OP_TYPE]
+#define START_SAMPLING() dispatch = sampled
+  NEXT();
+SAMPLE:
+  if (sampleStep(program, instr)) {
+    dispatch = profile != NULL ? profiled : labels;
+  }
+  if (profile != NULL) {
+    goto PROFILE;
+  }
+  goto *labels[instr->op];
+PROFILE:
+  profileStep(profile, instr, stack);
+  goto *labels[instr->op];
+#else
+#define CASE(name) case name:
+#define NEXT() break
+#define UNFUSE() if (profile != NULL) profileUnfuse(profile, instr); op = token->OP_TYPE; goto dispatch
+#define START_SAMPLING() sampling = 1
+  int op, sampling = 0;
+  while (1) {
+    instr = &code[ip++];
+    token = instr->token;
+    if (sampling && sampleStep(program, instr)) {
+      sampling = 0;
+    }
+    op = instr->op;
+    if (profile != NULL) {
+      profileStep(profile, instr, stack);
+    }
+dispatch:
+    switch (op) {
+#endif
+  CASE(OP_UNKNOWN) {
+    char *message = arenaPrintf(arena, "Word `%s` not implemented yet.", stringAt(strings, token->word));
+    assertWithToken(0, message, token);
+    NEXT();
+  }
+  CASE(OP_INT) parseINT(stack, token, 1); NEXT();
+  CASE(OP_CHAR) parseCHAR(stack, token, 1); NEXT();
+  CASE(OP_STR) parseSTR(stack, program->literals[instr->arg]); NEXT();
+  CASE(OP_ADD) parseADD(stack, token, 1); NEXT();
+  CASE(OP_SUB) parseSUB(stack, token, 1); NEXT();
+  CASE(OP_MUL) parseMUL(stack, token, 1); NEXT();
+  CASE(OP_DIV) parseDIV(stack, token, 1); NEXT();
+  CASE(OP_REM) parseREM(stack, token, 1); NEXT();
+  CASE(OP_EQU) parseEQU(stack, token, 1); NEXT();
+  CASE(OP_NEQU) parseNEQU(stack, token, 1); NEXT();
+  CASE(OP_GTE) parseGTE(stack, token, 1); NEXT();
+  CASE(OP_LTE) parseLTE(stack, token, 1); NEXT();
+  CASE(OP_GT) parseGT(stack, token, 1); NEXT();
+  CASE(OP_LT) parseLT(stack, token, 1); NEXT();
+  CASE(OP_POP) parsePOP(stack, token, 1); NEXT();
+  CASE(OP_SIZE) parseSIZE(stack, token, 1); NEXT();
+  CASE(OP_PSTACK) parsePSTACK(stack, token, 1); NEXT();
+  CASE(OP_DUP) parseDUP(stack, token, 1); NEXT();
+  CASE(OP_DROP) parseDROP(stack, token, 1); NEXT();
+  CASE(OP_SWAP) parseSWAP(stack, token, 1); NEXT();
+  CASE(OP_OVER) parseOVER(stack, token, 1); NEXT();
+  CASE(OP_ROT) parseROT(stack, token, 1); NEXT();
+  CASE(OP_IF)
+  CASE(OP_ELSEIF)
+  CASE(OP_WHILE)
+  CASE(OP_DEF)
+  CASE(OP_END)
+    assertWithToken(0, "Control flow word was not compiled.", token);
+    NEXT();
+  CASE(OP_THEN) {
+    Cell truth = popStack(stack, token);
+    assertWithToken(cellType(truth) == TYPE_INT, "`then` must pop an integer/boolean.", token);
+    if (cellValue(truth) == 0) {
+      ip = instr->arg;
+    }
+    NEXT();
+  }
+  CASE(OP_CAST_INT) parseCASTINT(stack, token, 1); NEXT();
+  CASE(OP_CAST_CHAR) parseCASTCHAR(stack, token, 1); NEXT();
+  CASE(OP_JUMP)
+    if (instr->arg < ip && program->counts != NULL) {
+      if (program->jitted != NULL && program->jitted[ip - 1] != NULL) {
+        ip = program->jitted[ip - 1](stack, calls);
+        NEXT();
+      }
+      if (++program->counts[ip - 1] == HOT_LOOP) {
+        if (program->jitted != NULL) {
+          jitLoop(program, instr->arg, ip - 1);
+        } else if (startSample(program, instr->arg, ip - 1)) {
+          START_SAMPLING();
+        }
+      }
+    }
+    ip = instr->arg;
+    NEXT();
+  CASE(OP_CALL)
+    pushReturn(calls, ip);
+    if (program->jitted != NULL) {
+      JitCode *jitted = &program->jitted[instr->arg];
+      if (*jitted == NULL && ++program->counts[instr->arg] == HOT_CALLS) {
+        jitWord(program, instr->arg, NULL);
+      }
+      if (*jitted != NULL) {
+        ip = (*jitted)(stack, calls);
+        NEXT();
+      }
+    }
+    ip = instr->arg;
+    NEXT();
+  CASE(OP_RETURN)
+    ip = popReturn(calls, token);
+    NEXT();
+  CASE(OP_HALT)
+    return;
+  CASE(OP_CONST)
+    pushStack(stack, makeCell(TYPE_INT, instr->arg));
+    ip += instr->len - 1;
+    NEXT();
+  CASE(OP_ADD_CONST)
+    top = &stack->values[stack->size - 1];
+    if (stack->size == 0 || (cellType(*top) != TYPE_INT && cellType(*top) != TYPE_CHAR)) {
+      UNFUSE();
+    }
+    *top = makeCell(cellType(*top), cellValue(*top) + (uint32_t) instr->arg);
+    ip++;
+    NEXT();
+  CASE(OP_EQU_CONST)
+  CASE(OP_NEQU_CONST)
+  CASE(OP_LT_CONST)
+  CASE(OP_GT_CONST)
+    top = &stack->values[stack->size - 1];
+    if (stack->size == 0 || (cellType(*top) != TYPE_INT && cellType(*top) != TYPE_CHAR)) {
+      UNFUSE();
+    }
+    if (instr->op == OP_EQU_CONST) {
+      *top = makeCell(TYPE_INT, cellValue(*top) == instr->arg);
+    } else if (instr->op == OP_NEQU_CONST) {
+      *top = makeCell(TYPE_INT, cellValue(*top) != instr->arg);
+    } else if (instr->op == OP_LT_CONST) {
+      *top = makeCell(TYPE_INT, cellValue(*top) < instr->arg);
+    } else {
+      *top = makeCell(TYPE_INT, cellValue(*top) > instr->arg);
+    }
+    ip++;
+    NEXT();
+  CASE(OP_NEG)
+    top = &stack->values[stack->size - 1];
+    if (stack->size == 0 || cellType(*top) != TYPE_INT) {
+      UNFUSE();
+    }
+    *top = makeCell(TYPE_INT, -(uint32_t) cellValue(*top));
+    ip += 2;
+    NEXT();
+  CASE(OP_DUP2)
+    if (stack->size < 2) {
+      UNFUSE();
+    }
+    pushStack(stack, retainCell(stackAt(stack, 1)));
+    pushStack(stack, retainCell(stackAt(stack, 1)));
+    ip++;
+    NEXT();
+  CASE(OP_NIP)
+    if (stack->size < 2) {
+      UNFUSE();
+    }
+    releaseCell(stackAt(stack, 1));
+    stack->values[stack->size - 2] = stack->values[stack->size - 1];
+    stack->size--;
+    ip++;
+    NEXT();
+  CASE(OP_ROT2) {
+    if (stack->size < 3) {
+      UNFUSE();
+    }
+    /* c b a -> a c b */
+    Cell *values = stack->values + stack->size;
+    Cell a = values[-1];
+    values[-1] = values[-2];
+    values[-2] = values[-3];
+    values[-3] = a;
+    ip++;
+    NEXT();
+  }
+  CASE(OP_NOP)
+    if (stack->size < instr->arg) {
+      UNFUSE();
+    }
+    ip += instr->len - 1;
+    NEXT();
+  CASE(OP_DUP_CMP_THEN)
+  CASE(OP_CMP_THEN) {
+    top = &stack->values[stack->size - 1];
+    if (stack->size == 0 || (cellType(*top) != TYPE_INT && cellType(*top) != TYPE_CHAR)) {
+      UNFUSE();
+    }
+    int dup = instr->op == OP_DUP_CMP_THEN;
+    if (!dup) {
+      stack->size--;
+    }
+    /* The constant is the INT at ip - 1 + dup, the THEN is two after it. */
+    if (compareWith(instr->arg, cellValue(*top), code[ip - 1 + dup].token->value)) {
+      ip += instr->len - 1;
+    } else {
+      ip = code[ip + dup + 1].arg;
+    }
+    NEXT();
+  }
+  CASE(OP_CMP2_THEN) {
+    Cell *below = &stack->values[stack->size - 2];
+    top = below + 1;
+    if (stack->size < 2 || (cellType(*below) != TYPE_INT && cellType(*below) != TYPE_CHAR)
+        || (cellType(*top) != TYPE_INT && cellType(*top) != TYPE_CHAR)) {
+      UNFUSE();
+    }
+    stack->size -= 2;
+    if (compareWith(instr->arg, cellValue(*below), cellValue(*top))) {
+      ip++;
+    } else {
+      ip = code[ip].arg;
+    }
+    NEXT();
+  }
+  CASE(OP_ADD_CONST_JUMP)
+    top = &stack->values[stack->size - 1];
+    if (stack->size == 0 || (cellType(*top) != TYPE_INT && cellType(*top) != TYPE_CHAR)) {
+      UNFUSE();
+    }
+    *top = makeCell(cellType(*top), cellValue(*top) + (uint32_t) instr->arg);
+    /* The JUMP is two after it. */
+    ip = code[ip + 1].arg;
+    NEXT();
+#define UNCHECKED_CASE(OP, name, parser) CASE(name##_UNCHECKED) parser(stack, token, 0); NEXT();
+  FOR_EACH_UNCHECKED_OP(UNCHECKED_CASE, _)
+  CASE(OP_THEN_UNCHECKED)
+    if (cellValue(stack->values[--stack->size]) == 0) {
+      ip = instr->arg;
+    }
+    NEXT();
+#if !THREADED_DISPATCH
+    default:
+      assertWithToken(0, "Invalid instruction.", token);
+    }
+  }
+#endif
+#undef CASE
+#undef NEXT
+}
+
+/* Native code generation: a program compiled to x86-64 assembly (GNU as syntax), linked with the C library. */
+/* The data stack is an array addressed by two registers, %r12 at its bottom and %rbx just past its top, */
+/* with cells tagged as in the interpreter. Words become functions, called with `call` and the */
+/* machine stack for their returns. Checks jump to stubs at the end of the code, which report errors */
+/* exactly as execute() would; instructions analyze() proved safe are compiled without them. */
+/* String literals are static, so they are never released. */
+
+#define NATIVE_STACK_SIZE (1 << 30)
+#define STRINGIFY(x) #x
+#define EXPAND_STRINGIFY(x) STRINGIFY(x)
+
+/* Helpers shared by every compiled program: errors, printing and `.s`/`.stack`. */
+static const char *const nativeRuntime =
+  "\t.text\n"
+  "stackc_error:\n" /* %rdi message, %rsi token: row, col, OP_TYPE, value, word */
+  "\tand $-16, %rsp\n"
+  "\tmov %rdi, %r14\n"
+  "\tmov %rsi, %r15\n"
+  "\tmov stderr@GOTPCREL(%rip), %rax\n"
+  "\tmov (%rax), %rdi\n"
+  "\tlea .Lerror(%rip), %rsi\n"
+  "\tmov stackc_name(%rip), %rdx\n"
+  "\tmov %r14, %rcx\n"
+  "\txor %eax, %eax\n"
+  "\tcall fprintf@PLT\n"
+  "\tpush 16(%r15)\n"
+  "\tmovslq 12(%r15), %rax\n"
+  "\tpush %rax\n"
+  "\tmov stderr@GOTPCREL(%rip), %rax\n"
+  "\tmov (%rax), %rdi\n"
+  "\tlea .Ltoken(%rip), %rsi\n"
+  "\tmov stackc_name(%rip), %rdx\n"
+  "\tmov (%r15), %ecx\n"
+  "\tmov 4(%r15), %r8d\n"
+  "\tmov 8(%r15), %r9d\n"
+  "\txor %eax, %eax\n"
+  "\tcall fprintf@PLT\n"
+  "\tmov $1, %edi\n"
+  "\tcall exit@PLT\n"
+  "stackc_print:\n" /* %rdi cell, ints are formatted into a buffer on the stack */
+  "\tsub $40, %rsp\n"
+  "\tmov %rdi, %rax\n"
+  "\tshr $56, %rax\n"
+  "\tcmp $1, %eax\n"
+  "\tje 1f\n"
+  "\tja 2f\n"
+  "\tlea 32(%rsp), %rsi\n"
+  "\tmov %edi, %eax\n"
+  "\ttest %eax, %eax\n"
+  "\tjns 4f\n"
+  "\tneg %eax\n"
+  "4:\tmov $10, %ecx\n"
+  "5:\txor %edx, %edx\n"
+  "\tdiv %ecx\n"
+  "\tadd $'0', %dl\n"
+  "\tdec %rsi\n"
+  "\tmov %dl, (%rsi)\n"
+  "\ttest %eax, %eax\n"
+  "\tjnz 5b\n"
+  "\ttest %edi, %edi\n"
+  "\tjns 6f\n"
+  "\tdec %rsi\n"
+  "\tmovb $'-', (%rsi)\n"
+  "6:\tmov %rsi, %rdi\n"
+  "\tlea 32(%rsp), %rdx\n"
+  "\tsub %rdi, %rdx\n"
+  "\tjmp 7f\n"
+  "1:\tmovzbl %dil, %edi\n"
+  "\tmov stdout@GOTPCREL(%rip), %rax\n"
+  "\tmov (%rax), %rsi\n"
+  "\tcall putc_unlocked@PLT\n"
+  "\tjmp 3f\n"
+  "2:\tshl $8, %rdi\n"
+  "\tshr $8, %rdi\n"
+  "\tmovslq 4(%rdi), %rdx\n"
+  "\tlea 8(%rdi), %rdi\n"
+  "7:\tmov $1, %esi\n"
+  "\tmov stdout@GOTPCREL(%rip), %rax\n"
+  "\tmov (%rax), %rcx\n"
+  "\tcall fwrite_unlocked@PLT\n"
+  "3:\tadd $40, %rsp\n"
+  "\tret\n"
+  "stackc_legacy_size:\n" /* returns the size `.s` prints in %eax */
+  "\txor %eax, %eax\n"
+  "\tmov %r12, %rcx\n"
+  "1:\tcmp %rbx, %rcx\n"
+  "\tjae 3f\n"
+  "\tmov (%rcx), %rdx\n"
+  "\tmov %rdx, %rsi\n"
+  "\tshr $56, %rsi\n"
+  "\tcmp $2, %esi\n"
+  "\tjne 2f\n"
+  "\tshl $8, %rdx\n"
+  "\tshr $8, %rdx\n"
+  "\tadd 4(%rdx), %eax\n"
+  "\tinc %eax\n"
+  "2:\tadd $2, %eax\n"
+  "\tadd $8, %rcx\n"
+  "\tjmp 1b\n"
+  "3:\tret\n"
+  "stackc_size:\n"
+  "\tsub $8, %rsp\n"
+  "\tcall stackc_legacy_size\n"
+  "\tmov %eax, %esi\n"
+  "\tlea .Lint(%rip), %rdi\n"
+  "\txor %eax, %eax\n"
+  "\tcall printf@PLT\n"
+  "\tadd $8, %rsp\n"
+  "\tret\n"
+  "stackc_pstack:\n"
+  "\tpush %r13\n"
+  "\tpush %r14\n"
+  "\tpush %r15\n"
+  "\tcall stackc_legacy_size\n"
+  "\tmov %eax, %ecx\n"
+  "\tmov stderr@GOTPCREL(%rip), %rax\n"
+  "\tmov (%rax), %rdi\n"
+  "\tlea .Lstack(%rip), %rsi\n"
+  "\tmov stackc_name(%rip), %rdx\n"
+  "\txor %eax, %eax\n"
+  "\tcall fprintf@PLT\n"
+  "\tmov %rbx, %r13\n"
+  "1:\tcmp %r12, %r13\n"
+  "\tjbe 4f\n"
+  "\tsub $8, %r13\n"
+  "\tmov (%r13), %r14\n"
+  "\tmov %r14, %rdx\n"
+  "\tshr $56, %rdx\n"
+  "\tcmp $2, %edx\n"
+  "\tje 2f\n"
+  "\tmov stderr@GOTPCREL(%rip), %rax\n"
+  "\tmov (%rax), %rdi\n"
+  "\tlea .Lpair(%rip), %rsi\n"
+  "\tmov %r14d, %ecx\n"
+  "\txor %eax, %eax\n"
+  "\tcall fprintf@PLT\n"
+  "\tjmp 1b\n"
+  "2:\tshl $8, %r14\n"
+  "\tshr $8, %r14\n"
+  "\tmov stderr@GOTPCREL(%rip), %rax\n"
+  "\tmov (%rax), %rdi\n"
+  "\tlea .Lpair(%rip), %rsi\n"
+  "\tmov 4(%r14), %ecx\n"
+  "\txor %eax, %eax\n"
+  "\tcall fprintf@PLT\n"
+  "\txor %r15d, %r15d\n"
+  "3:\tcmp 4(%r14), %r15d\n"
+  "\tjg 1b\n"
+  "\tmov stderr@GOTPCREL(%rip), %rax\n"
+  "\tmov (%rax), %rdi\n"
+  "\tlea .Lchar(%rip), %rsi\n"
+  "\tmovsbl 8(%r14,%r15), %edx\n"
+  "\txor %eax, %eax\n"
+  "\tcall fprintf@PLT\n"
+  "\tinc %r15d\n"
+  "\tjmp 3b\n"
+  "4:\tmov stderr@GOTPCREL(%rip), %rax\n"
+  "\tmov (%rax), %rsi\n"
+  "\tlea .Leos(%rip), %rdi\n"
+  "\tcall fputs@PLT\n"
+  "\tpop %r15\n"
+  "\tpop %r14\n"
+  "\tpop %r13\n"
+  "\tret\n"
+  "stackc_equal:\n" /* %rdi and %rsi strings, returns whether they are equal in %eax */
+  "\tmov $1, %eax\n"
+  "\tcmp %rdi, %rsi\n"
+  "\tje 1f\n"
+  "\txor %eax, %eax\n"
+  "\tmovslq 4(%rdi), %rdx\n"
+  "\tcmp 4(%rsi), %edx\n"
+  "\tjne 1f\n"
+  "\tsub $8, %rsp\n"
+  "\tadd $8, %rdi\n"
+  "\tadd $8, %rsi\n"
+  "\tcall memcmp@PLT\n"
+  "\tadd $8, %rsp\n"
+  "\ttest %eax, %eax\n"
+  "\tsete %al\n"
+  "\tmovzbl %al, %eax\n"
+  "1:\tret\n"
+  "stackc_reserve:\n"
+  "\tsub $8, %rsp\n"
+  "\txor %edi, %edi\n"
+  "\tmov $" EXPAND_STRINGIFY(NATIVE_STACK_SIZE) ", %esi\n"
+  "\tmov $3, %edx\n"     /* PROT_READ | PROT_WRITE */
+  "\tmov $0x4022, %ecx\n" /* MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE */
+  "\tmov $-1, %r8d\n"
+  "\txor %r9d, %r9d\n"
+  "\tcall mmap@PLT\n"
+  "\tadd $8, %rsp\n"
+  "\tret\n"
+  "\t.globl main\n"
+  "\t.type main, @function\n"
+  "main:\n"
+  "\tpush %rbx\n"
+  "\tpush %r12\n"
+  "\tpush %rbp\n"
+  "\tmov (%rsi), %rax\n"
+  "\tmov %rax, stackc_name(%rip)\n"
+  /* Output is buffered as the interpreter does: line by line only on a terminal. */
+  "\tmov $1, %edi\n"
+  "\tcall isatty@PLT\n"
+  "\ttest %eax, %eax\n"
+  "\tjnz 1f\n"
+  "\tmov stdout@GOTPCREL(%rip), %rax\n"
+  "\tmov (%rax), %rdi\n"
+  "\txor %esi, %esi\n"
+  "\txor %edx, %edx\n"
+  "\tmov $" EXPAND_STRINGIFY(OUTPUT_SIZE) ", %ecx\n"
+  "\tcall setvbuf@PLT\n"
+  /* The data stack and the machine stack words are called on are reserved up front, and only */
+  /* backed by memory as they are used, so that deep recursion does not run out of stack. */
+  "1:\tcall stackc_reserve\n"
+  "\tmov %rax, %r12\n"
+  "\tmov %rax, %rbx\n"
+  "\tcall stackc_reserve\n"
+  "\tlea " EXPAND_STRINGIFY(NATIVE_STACK_SIZE) "(%rax), %rsp\n";
+
+static const char *const nativeRuntimeData =
+  "\t.data\n"
+  "stackc_name:\n\t.quad 0\n"
+  "\t.section .rodata\n"
+  ".Lerror:\n\t.string \"[%s] Assertion Error: %s\\n\"\n"
+  ".Ltoken:\n\t.string \"-- [%s] Token --\\nPosition: %d %d\\nOP_TYPE: %d\\nValue: %d\\nWord: %s\\n\"\n"
+  ".Lstack:\n\t.string \"-- [%s] Stack (size: %d) --\\n\"\n"
+  ".Lpair:\n\t.string \"%d %d \"\n"
+  ".Lchar:\n\t.string \"%d \"\n"
+  ".Lint:\n\t.string \"%d\"\n"
+  ".Leos:\n\t.string \"EOS\\n\"\n";
+
+typedef struct Native {
+  FILE *out;
+  FILE *stubs;  /* error stubs, written after the code */
+  FILE *data;   /* messages, tokens and string literals */
+  int labels;   /* local labels used so far */
+} Native;
+
+/* Writes length bytes as an assembler string. */
+static void emitBytes(FILE *out, const char *bytes, int length) {
+  int i;
+  fprintf(out, "\t.ascii \"");
+  for (i = 0; i < length; i++) {
+    unsigned char c = bytes[i];
+    if (c == '"' || c == '\\') {
+      fprintf(out, "\\%c", c);
+    } else if (c < ' ' || c > '~') {
+      fprintf(out, "\\%03o", c);
+    } else {
+      fputc(c, out);
+    }
+  }
+  fprintf(out, "\\0\"\n");
+}
+
+/* Jumps to a stub reporting message for the instruction at ip, if jump is taken. */
+static void emitCheck(Native *native, char *jump, char *message, int ip) {
+  int label = native->labels++;
+  fprintf(native->out, "\t%s .E%d\n", jump, label);
+  fprintf(native->stubs, ".E%d:\n\tlea .M%d(%%rip), %%rdi\n\tlea .T%d(%%rip), %%rsi\n\tjmp stackc_error\n", label, label, ip);
+  fprintf(native->data, ".M%d:\n", label);
+  emitBytes(native->data, message, strlen(message));
+}
+
+/* Checks that there are at least count cells on the stack. */
+static void emitDepth(Native *native, int count, char *message, int ip) {
+  fprintf(native->out, "\tlea -%d(%%rbx), %%r8\n\tcmp %%r12, %%r8\n", count * 8);
+  emitCheck(native, "jb", message, ip);
+}
+
+/* Writes the code of the instruction at ip. */
+static void emitInstr(Native *native, Program *program, int ip) {
+  FILE *out = native->out;
+  Instr *instr = &program->code[ip];
+  OPS op = originalOp(instr);
+  int checked = instr->op == op;
+  int label;
+  switch (op) {
+    case OP_UNKNOWN:
+      emitCheck(native, "jmp", arenaPrintf(arena, "Word `%s` not implemented yet.", stringAt(strings, instr->token->word)), ip);
+      break;
+    case OP_INT:
+    case OP_CHAR:
+      fprintf(out, "\tmovabs $0x%llx, %%rax\n\tmov %%rax, (%%rbx)\n\tadd $8, %%rbx\n",
+        (unsigned long long) makeCell(op == OP_INT ? TYPE_INT : TYPE_CHAR, instr->arg));
+      break;
+    case OP_STR:
+      fprintf(out, "\tlea .S%d(%%rip), %%rax\n\tmovabs $0x%llx, %%rcx\n\tor %%rcx, %%rax\n\tmov %%rax, (%%rbx)\n\tadd $8, %%rbx\n",
+        instr->arg, (unsigned long long) makeCell(TYPE_STR, 0));
+      break;
+    case OP_ADD:
+    case OP_SUB: {
+      char *message = op == OP_ADD ? "+ is only defined for int and char." : "- is only defined for int and char.";
+      if (checked) {
+        emitDepth(native, 1, POP_UNDERFLOW, ip);
+      }
+      fprintf(out, "\tmov -8(%%rbx), %%rax\n\tmov %%rax, %%rcx\n\tshr $56, %%rcx\n");
+      if (checked) {
+        fprintf(out, "\tcmp $1, %%ecx\n");
+        emitCheck(native, "ja", message, ip);
+        emitDepth(native, 2, POP_UNDERFLOW, ip);
+      }
+      fprintf(out, "\tmov -16(%%rbx), %%rdx\n\tmov %%rdx, %%rsi\n\tshr $56, %%rsi\n");
+      if (checked) {
+        fprintf(out, "\tcmp $1, %%esi\n");
+        emitCheck(native, "ja", message, ip);
+      }
+      if (op == OP_ADD) {
+        if (checked) {
+          fprintf(out, "\tmov %%ecx, %%edi\n\tand %%esi, %%edi\n");
+          emitCheck(native, "jnz", "char char + not supported", ip);
+        }
+        fprintf(out, "\tadd %%eax, %%edx\n\tor %%rsi, %%rcx\n");
+      } else {
+        if (checked) {
+          fprintf(out, "\ttest %%ecx, %%ecx\n");
+          emitCheck(native, "jnz", "- is only defined for int int - and char int -", ip);
+        }
+        fprintf(out, "\tsub %%eax, %%edx\n\tmov %%rsi, %%rcx\n");
+      }
+      fprintf(out, "\tshl $56, %%rcx\n\tor %%rcx, %%rdx\n\tmov %%rdx, -16(%%rbx)\n\tsub $8, %%rbx\n");
+      break;
+    }
+    case OP_MUL:
+    case OP_DIV:
+    case OP_REM:
+      if (checked) {
+        emitDepth(native, 1, POP_UNDERFLOW, ip);
+        emitDepth(native, 2, POP_UNDERFLOW, ip);
+      }
+      fprintf(out, "\tmov -8(%%rbx), %%rcx\n\tmov -16(%%rbx), %%rax\n");
+      if (checked) {
+        fprintf(out, "\tmov %%rcx, %%rdx\n\tor %%rax, %%rdx\n\tshr $56, %%rdx\n");
+        emitCheck(native, "jnz", op == OP_MUL ? "* is only defined for int" : op == OP_DIV ? "/ is only defined for int" : "% is only defined for int", ip);
+      }
+      if (op == OP_MUL) {
+        fprintf(out, "\timul %%ecx, %%eax\n");
+      } else {
+        fprintf(out, "\tcltd\n\tidiv %%ecx\n");
+        if (op == OP_REM) {
+          fprintf(out, "\tmov %%edx, %%eax\n");
+        }
+      }
+      fprintf(out, "\tmov %%rax, -16(%%rbx)\n\tsub $8, %%rbx\n");
+      break;
+    case OP_EQU:
+    case OP_NEQU:
+      label = native->labels;
+      native->labels += 2;
+      if (checked) {
+        emitDepth(native, 1, POP_UNDERFLOW, ip);
+      }
+      fprintf(out, "\tmov -8(%%rbx), %%rax\n\tmov %%rax, %%rcx\n\tshr $56, %%rcx\n");
+      if (checked) {
+        emitDepth(native, 2, POP_UNDERFLOW, ip);
+      }
+      fprintf(out, "\tmov -16(%%rbx), %%rdx\n\tmov %%rdx, %%rsi\n\tshr $56, %%rsi\n\tcmp $%d, %%ecx\n\tje .Q%d\n", TYPE_STR, label);
+      if (checked) {
+        fprintf(out, "\tcmp $1, %%esi\n");
+        emitCheck(native, "ja", "Invalid types for =", ip);
+      }
+      fprintf(out, "\tcmp %%eax, %%edx\n\t%s %%al\n\tjmp .Q%d\n.Q%d:\n", op == OP_EQU ? "sete" : "setne", label + 1, label);
+      if (checked) {
+        fprintf(out, "\tcmp $%d, %%esi\n", TYPE_STR);
+        emitCheck(native, "jne", "Can only compare strings with each other (=)", ip);
+      }
+      fprintf(out, "\tshl $8, %%rax\n\tshr $8, %%rax\n\tshl $8, %%rdx\n\tshr $8, %%rdx\n"
+        "\tmov %%rax, %%rdi\n\tmov %%rdx, %%rsi\n\tcall stackc_equal\n\ttest %%eax, %%eax\n\t%s %%al\n.Q%d:\n",
+        op == OP_EQU ? "setne" : "sete", label + 1);
+      fprintf(out, "\tmovzbl %%al, %%eax\n\tmov %%rax, -16(%%rbx)\n\tsub $8, %%rbx\n");
+      break;
+    case OP_GTE:
+    case OP_LTE:
+    case OP_GT:
+    case OP_LT:
+      if (checked) {
+        emitDepth(native, 1, POP_UNDERFLOW, ip);
+        emitDepth(native, 2, POP_UNDERFLOW, ip);
+      }
+      fprintf(out, "\tmov -8(%%rbx), %%rcx\n\tmov -16(%%rbx), %%rdx\n");
+      if (checked) {
+        fprintf(out, "\tmov %%rcx, %%rax\n\tor %%rdx, %%rax\n\tshr $56, %%rax\n\tcmp $1, %%eax\n");
+        emitCheck(native, "ja", "Invalid types for inequalities", ip);
+      }
+      fprintf(out, "\tcmp %%ecx, %%edx\n\t%s %%al\n\tmovzbl %%al, %%eax\n\tmov %%rax, -16(%%rbx)\n\tsub $8, %%rbx\n",
+        op == OP_GTE ? "setge" : op == OP_LTE ? "setle" : op == OP_GT ? "setg" : "setl");
+      break;
+    case OP_POP:
+      if (checked) {
+        emitDepth(native, 1, POP_UNDERFLOW, ip);
+      }
+      fprintf(out, "\tsub $8, %%rbx\n\tmov (%%rbx), %%rdi\n\tcall stackc_print\n");
+      break;
+    case OP_SIZE:
+      fprintf(out, "\tcall stackc_size\n");
+      break;
+    case OP_PSTACK:
+      fprintf(out, "\tcall stackc_pstack\n");
+      break;
+    case OP_DUP:
+      if (checked) {
+        emitDepth(native, 1, PEEK_UNDERFLOW, ip);
+      }
+      fprintf(out, "\tmov -8(%%rbx), %%rax\n\tmov %%rax, (%%rbx)\n\tadd $8, %%rbx\n");
+      break;
+    case OP_DROP:
+      if (checked) {
+        emitDepth(native, 1, POP_UNDERFLOW, ip);
+      }
+      fprintf(out, "\tsub $8, %%rbx\n");
+      break;
+    case OP_SWAP:
+      if (checked) {
+        emitDepth(native, 2, "Not enough elements to swap", ip);
+      }
+      fprintf(out, "\tmov -8(%%rbx), %%rax\n\tmov -16(%%rbx), %%rcx\n\tmov %%rcx, -8(%%rbx)\n\tmov %%rax, -16(%%rbx)\n");
+      break;
+    case OP_OVER:
+      if (checked) {
+        emitDepth(native, 1, PEEK_UNDERFLOW, ip);
+        emitDepth(native, 2, "Not enough elements to over", ip);
+      }
+      fprintf(out, "\tmov -16(%%rbx), %%rax\n\tmov %%rax, (%%rbx)\n\tadd $8, %%rbx\n");
+      break;
+    case OP_ROT:
+      if (checked) {
+        emitDepth(native, 1, PEEK_UNDERFLOW, ip);
+        emitDepth(native, 3, "Not enough elements to rot", ip);
+      }
+      /* c b a -> b a c */
+      fprintf(out, "\tmov -24(%%rbx), %%rax\n\tmov -16(%%rbx), %%rcx\n\tmov %%rcx, -24(%%rbx)\n"
+        "\tmov -8(%%rbx), %%rcx\n\tmov %%rcx, -16(%%rbx)\n\tmov %%rax, -8(%%rbx)\n");
+      break;
+    case OP_CAST_INT:
+    case OP_CAST_CHAR:
+      if (checked) {
+        emitDepth(native, 1, POP_UNDERFLOW, ip);
+      }
+      fprintf(out, "\tmov -8(%%rbx), %%rax\n");
+      if (checked) {
+        fprintf(out, "\tmov %%rax, %%rcx\n\tshr $56, %%rcx\n\tcmp $%d, %%ecx\n", op == OP_CAST_INT ? TYPE_CHAR : TYPE_INT);
+        emitCheck(native, "jne", op == OP_CAST_INT ? "Only can cast char -> int." : "Only can cast int -> char.", ip);
+      }
+      fprintf(out, "\tmov %%eax, %%eax\n");
+      if (op == OP_CAST_CHAR) {
+        fprintf(out, "\tmovabs $0x%llx, %%rcx\n\tor %%rcx, %%rax\n", (unsigned long long) makeCell(TYPE_CHAR, 0));
+      }
+      fprintf(out, "\tmov %%rax, -8(%%rbx)\n");
+      break;
+    case OP_THEN:
+      if (checked) {
+        emitDepth(native, 1, POP_UNDERFLOW, ip);
+      }
+      fprintf(out, "\tsub $8, %%rbx\n\tmov (%%rbx), %%rax\n");
+      if (checked) {
+        fprintf(out, "\tmov %%rax, %%rcx\n\tshr $56, %%rcx\n");
+        emitCheck(native, "jnz", "`then` must pop an integer/boolean.", ip);
+      }
+      fprintf(out, "\ttest %%eax, %%eax\n\tje .L%d\n", instr->arg);
+      break;
+    case OP_JUMP:
+      fprintf(out, "\tjmp .L%d\n", instr->arg);
+      break;
+    case OP_CALL:
+      fprintf(out, "\tcall .F%d\n", instr->arg);
+      break;
+    case OP_RETURN:
+      fprintf(out, "\tadd $8, %%rsp\n\tret\n");
+      break;
+    case OP_HALT:
+      fprintf(out, "\txor %%edi, %%edi\n\tcall exit@PLT\n");
+      break;
+    default:
+      emitCheck(native, "jmp", "Control flow word was not compiled.", ip);
+      break;
+  }
+}
+
+/* Writes a program as assembly to out. */
+/* Labels: .L<ip> before each instruction, .F<ip> for the entry of a word with its body at ip, */
+/* .T<ip> for the token of each instruction, .S<n> for literal n, .E/.M<n> for error stubs and .Q<n> within instructions. */
+void emitProgram(Program *program, FILE *out) {
+  Native native = {out, NULL, NULL, 0};
+  char *stubs, *data;
+  size_t stubsSize, dataSize;
+  native.stubs = open_memstream(&stubs, &stubsSize);
+  native.data = open_memstream(&data, &dataSize);
+  assert(native.stubs != NULL && native.data != NULL, "Could not allocate memory.");
+  char *words = (char*) arenaAlloc(arena, program->size);
+  memset(words, 0, program->size);
+  int i;
+  for (i = 0; i < program->size; i++) {
+    if (program->code[i].op == OP_CALL) {
+      words[program->code[i].arg] = 1;
+    }
+  }
+
+  fputs(nativeRuntime, out);
+  for (i = 0; i < program->size; i++) {
+    Instr *instr = &program->code[i];
+    if (words[i]) {
+      /* Keeps the machine stack aligned to 16 bytes for calls into the C library. */
+      fprintf(out, ".F%d:\n\tsub $8, %%rsp\n", i);
+    }
+    fprintf(out, ".L%d:\n", i);
+    emitInstr(&native, program, i);
+    if (instr->token != NULL) {
+      Token *token = instr->token;
+      char *word = stringAt(strings, token->word);
+      fprintf(native.data, "\t.balign 8\n.T%d:\n\t.long %d, %d, %d, %d\n\t.quad .W%d\n.W%d:\n",
+        i, token->row, token->col, token->OP_TYPE, token->value, i, i);
+      emitBytes(native.data, word, strlen(word));
+    }
+  }
+  fclose(native.stubs);
+  fputs(stubs, out);
+  free(stubs);
+
+  fputs(nativeRuntimeData, out);
+  /* Tokens point to their words, which needs relocating in a position independent executable. */
+  fprintf(out, "\t.section .data.rel.ro, \"aw\"\n");
+  fclose(native.data);
+  fputs(data, out);
+  free(data);
+  for (i = 0; i < program->literalCount; i++) {
+    String *literal = program->literals[i];
+    fprintf(out, "\t.balign 8\n.S%d:\n\t.long 1, %d\n", i, literal->size);
+    emitBytes(out, literal->chars, literal->size);
+  }
+  fprintf(out, "\t.section .note.GNU-stack,\"\",@progbits\n");
+}
+
+/* Compiles a program into an executable at filename, assembling and linking it with `cc`. */
+/* With assemblyOnly, the assembly is written to filename instead. */
+void compileNative(Program *program, char *filename, int assemblyOnly) {
+  char *assembly = assemblyOnly ? filename : arenaPrintf(arena, "%s.s", filename);
+  FILE *out = fopen(assembly, "w");
+  assert(out != NULL, arenaPrintf(arena, "Could not write `%s`.", assembly));
+  emitProgram(program, out);
+  assert(fclose(out) == 0, arenaPrintf(arena, "Could not write `%s`.", assembly));
+  if (assemblyOnly) {
+    return;
+  }
+  pid_t pid = fork();
+  assert(pid != -1, "Could not run the assembler.");
+  if (pid == 0) {
+    execlp("cc", "cc", "-o", filename, assembly, (char*) NULL);
+    _exit(127);
+  }
+  int status;
+  waitpid(pid, &status, 0);
+  unlink(assembly);
+  assert(WIFEXITED(status) && WEXITSTATUS(status) == 0, "Could not assemble and link the program with `cc`.");
+}
+
+/* Perfect hash of the keywords, on their length and first and last characters. */
+/* The multipliers are chosen so that no two words in FOR_EACH_OP share a slot, which initKeywords() checks. */
+#define KEYWORD_SLOTS 64
+#define keywordSlot(word, length) (((length) + (unsigned char) (word)[0] * 11 + (unsigned char) (word)[(length) - 1] * 14) & (KEYWORD_SLOTS - 1))
+
+/* Operation of the keyword hashed to each slot, OP_UNKNOWN if there is none. */
+static OPS keywords[KEYWORD_SLOTS];
+
+/* Fills keywords from FOR_EACH_OP. Must be called before makeToken(). */
+void initKeywords(void) {
+  int i;
+  for (i = 0; i < OPS_COUNT; i++) {
+    const char *word = opWords[i];
+    size_t length = strlen(word);
+    if (length == 0) {
+      continue;
+    }
+    int slot = keywordSlot(word, length);
+    assert(keywords[slot] == OP_UNKNOWN, "Keywords collide in keywordSlot(), update its multipliers.");
+    keywords[slot] = i;
+  }
+}
+
+/* Appends the token of the first length characters of word, returning it. */
+Token* makeToken(Tokens *tokens, int row, int col, const char *word, size_t length) {
+  Token* token = pushTokens(tokens);
   token->row = row;
   token->col = col;
   token->value = 0;
   token->OP_TYPE = OP_UNKNOWN;
-  strncpy(token->word, word, MAX_WORD_SIZE);
-  assert(OPS_COUNT == 31, "Update control flow in makeToken().");
-  /* control flow to decide type of operation */
-  char *types[OPS_COUNT] = {
-    "", /* UNKNOWN */
-    "", /* INT */
-    "", /* CHAR */
-    "", /* STR */
-    "+",
-    "-",
-    "*",
-    "/",
-    "%",
-    "=",
-    "!=",
-    ">=",
-    "<=",
-    ">",
-    "<",
-    ".",
-    ".s",
-    ".stack",
-    "dup",
-    "drop",
-    "swap",
-    "over",
-    "rot",
-    "if",
-    "elseif",
-    "while",
-    "then",
-    "def",
-    "end",
-    "(int)",
-    "(char)",
-  };
-  if (isNumber(word)) {
+  /* Measure the word and parse it as an integer in one pass. */
+  /* `-` is allowed at the start, as long as it is not a single `-`. */
+  int negative = word[0] == '-' && length > 1;
+  int isNumber = 1;
+  uint32_t value = 0;
+  size_t i;
+  for (i = negative; i < length; i++) {
+    char current = word[i];
+    if (current < '0' || current > '9') {
+      isNumber = 0;
+    }
+    value = value * 10 + (current - '0');
+  }
+  token->word = internString(strings, word, length);
+  if (isNumber) {
     token->OP_TYPE = OP_INT;
-    token->value = atoi(word);
-    /* isString and isCharacter are overridden anyways. */
+    token->value = negative ? -value : value;
+    /* Strings and characters are overridden anyways. */
   } else {
-    int i;
-    for (i = 0; i < OPS_COUNT; i++) {
-      if (strncmp(word, types[i], MAX_WORD_SIZE) == 0) {
-        token->OP_TYPE = i;
-        break;
-      }
+    OPS op = keywords[keywordSlot(word, length)];
+    if (op != OP_UNKNOWN && strcmp(stringAt(strings, token->word), opWords[op]) == 0) {
+      token->OP_TYPE = op;
     }
   }
   return token;
@@ -1095,141 +4060,956 @@ int endsWith(char *string, char *ending) {
   }
 }
 
-/* Main Function */
-int main(int argc, char* argv[]) {
-  thisName = argv[0];
-  assert(argc > 1, "Not enough arguments.\nUsage: `./stackc filename`");
-  Queue *instructions = newQueue();
-  Stack *stack = newStack();
-  Definitions *definitions = newDefinitions();
-  /* word size is limited to MAX_WORD_SIZE */
-  char word[MAX_WORD_SIZE];
-  memset(word, 0, sizeof(word));
-
-  char* filename = argv[1];
-  assert(endsWith(filename, ".stc"), "File must have \".stc\" extension.");
-
-  if (access(filename, R_OK) != 0) {
-    /* Checks for read permission for programFile. */
-    fprintf(stderr, "[%s] StackC Program File `%s` not found.\n", thisName, filename);
-    return 1;
+/* Character written by an escape sequence, given the character after the backslash. */
+char unescape(char escape) {
+  if (escape == '\\') {
+    return '\\';
+  } else if (escape == 'n') {
+    return '\n';
+  } else if (escape == 'r') {
+    return '\r';
+  } else if (escape == 't') {
+    return '\t';
+  } else if (escape == '"') {
+    return '"';
+  } else if (escape == '\'') {
+    return '\'';
   }
-  FILE *source;
-  source = fopen(filename, "r");
+  fprintf(errorOutput(), "[%s] Ascii of: %d\n", thisName, escape);
+  assert(0, "Unknown Escape Character");
+  return escape;
+}
 
-  if (source == NULL) {
-    char *message;
-    asprintf(&message, "[%s] StackC Program File %s not found.", thisName, filename);
-    assert(source == NULL, message);
+/* Maps a program file into memory, setting size to its length. */
+/* The mapping is private, so the lexer can decode escapes in place without changing the file. */
+char* mapSource(char *filename, size_t *size) {
+  int fd = open(filename, O_RDONLY);
+  if (fd == -1) {
+    assert(0, arenaPrintf(arena, "[%s] StackC Program File %s not found.", thisName, filename));
   }
+  struct stat info;
+  assert(fstat(fd, &info) == 0, "Could not read the program file.");
+  *size = info.st_size;
+  char *source = NULL;
+  if (*size > 0) {
+    source = (char*) mmap(NULL, *size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    assert(source != MAP_FAILED, "Could not map the program file.");
+  }
+  close(fd);
+  return source;
+}
 
-  /* Parsing input line by line. */
-  char *line = NULL;
-  /* Signed integer, includes new line character. */
+/* Splits the source of a program into tokens, line by line. */
+/* Words and strings are passed to makeToken() as slices of source, nothing is copied per token. */
+/* Escapes in strings are decoded in place, shifting the rest of the string down over the backslashes. */
+void lex(Tokens *tokens, char *source, size_t size) {
   int row = 0;
-  ssize_t lengthOfLine;
-  size_t len = 0;
   int parsingString = 0; /* Different behaviour when parsing strings. */
-  int parsingChar = 0; /* Different behaviour when parsing chars. */
-  while ((lengthOfLine = getline(&line, &len, source)) != -1) {
+  char *line = source, *end = source + size;
+  while (line < end) {
+    char *newLine = (char*) memchr(line, '\n', end - line);
+    /* Includes the new line character. */
+    int lengthOfLine = newLine == NULL ? end - line : newLine - line + 1;
+    /* Characters past the end of the line read as NULL. */
+#define lineAt(index) ((index) < lengthOfLine ? line[index] : '\0')
+    /* The current word is wordIndex characters at word, a string always restarts on a new line. */
+    char *word = line;
     int wordIndex = 0;
-    memset(word, 0, sizeof(word));
     int lineIndex;
     for (lineIndex = 0; lineIndex < lengthOfLine; lineIndex++) {
       char c = line[lineIndex];
-      /* Catch comments and ignore the rest (by exiting for loop). */
       if (c == '\'' && wordIndex == 0) {
-        char next = line[++lineIndex];
+        char next = lineAt(lineIndex + 1);
+        lineIndex++;
         if (next == '\\') {
-          char escape = line[++lineIndex];
-          if (escape == '\\') {
-            next = '\\';
-          } else if (escape == 'n') {
-            next = '\n';
-          } else if (escape == 'r') {
-            next = '\r';
-          } else if (escape == 't') {
-            next = '\t';
-          } else if (escape == '"') {
-            next = '"';
-          } else if (escape == '\'') {
-            next = '\'';
-          } else {
-            fprintf(stderr, "[%s] Ascii of: %d\n", thisName, escape);
-            assert(0, "Unknown Escape Character");
-          }
+          lineIndex++;
+          next = unescape(lineAt(lineIndex));
+        }
+        int col = lineIndex - wordIndex + 1;
+        lineIndex++;
+        if (lineAt(lineIndex) != '\'') {
+          assert(0, arenaPrintf(arena, "Invalid character at %d %d", row + 1, col));
         }
-        char *assertMessage;
-        asprintf(&assertMessage, "Invalid character at %d %d", row + 1, lineIndex - wordIndex + 1);
-        assert(line[++lineIndex] == '\'', assertMessage);
-        word[0] = next;
-        word[1] = '\0';
         /* C ensures that next is a valid ascii because it is typed as a char here. */
-        Token *token = makeToken(row + 1, lineIndex - wordIndex + 1, word);
-        pushQueue(instructions, token);
+        Token *token = makeToken(tokens, row + 1, lineIndex - wordIndex + 1, &next, 1);
         /* We already know this is a character. */
         token->OP_TYPE = OP_CHAR;
         token->value = next;
         wordIndex = 0;
       } else if (parsingString == 1) {
         if (c == '\\') {
-          /* Handle Escape Characters */
-          char next = line[++lineIndex];
-          if (next == '\\') {
-            word[wordIndex++] = '\\';
-          } else if (next == 'n') {
-            word[wordIndex++] = '\n';
-          } else if (next == 'r') {
-            word[wordIndex++] = '\r';
-          } else if (next == 't') {
-            word[wordIndex++] = '\t';
-          } else if (next == '"') {
-            word[wordIndex++] = '"';
-          } else if (next == '\'') {
-            word[wordIndex++] = '\'';
-          } else {
-            fprintf(stderr, "[%s] Ascii of: %d\n", thisName, next);
-            assert(0, "Unknown Escape Character");
-          }
+          lineIndex++;
+          word[wordIndex++] = unescape(lineAt(lineIndex));
         } else if (c == '"') {
-          word[wordIndex++] = '\0';
           parsingString = 0;
-          Token *token = makeToken(row + 1, lineIndex - wordIndex + 1, word);
-          pushQueue(instructions, token);
+          /* Columns are counted as if the string was followed by a NULL character. */
+          Token *token = makeToken(tokens, row + 1, lineIndex - wordIndex, word, wordIndex);
           /* We already know this is a string. */
           token->OP_TYPE = OP_STR;
           wordIndex = 0;
-          memset(word, 0, sizeof(word));
         } else {
           assert(wordIndex < MAX_WORD_SIZE, "Word is too long!");
-          word[wordIndex++] = c;
+          if (word + wordIndex != line + lineIndex) {
+            word[wordIndex] = c;
+          }
+          wordIndex++;
         }
-      } else if (c == '"' && parsingChar == 0) {
+      } else if (c == '"') {
         parsingString = 1;
+        if (wordIndex == 0) {
+          word = line + lineIndex + 1;
+        }
       } else if (c == '/' && lineIndex < lengthOfLine - 1 && line[lineIndex+1] == '/') {
-        /* Catch comments and stop parsing. */
+        /* Catch comments and ignore the rest of the line. */
         break;
       } else if (c == ' ' || c == '\n') {
         if (wordIndex == 0) {
           /* Skipping multiple spaces. */
           continue;
         }
-        Token *token = makeToken(row + 1, lineIndex - wordIndex + 1, word);
-        pushQueue(instructions, token);
+        makeToken(tokens, row + 1, lineIndex - wordIndex + 1, word, wordIndex);
         wordIndex = 0;
-        memset(word, 0, sizeof(word));
       } else {
         assert(wordIndex < MAX_WORD_SIZE, "Word is too long!");
-        word[wordIndex++] = c;
+        if (wordIndex == 0) {
+          word = line + lineIndex;
+        } else if (word + wordIndex != line + lineIndex) {
+          word[wordIndex] = c;
+        }
+        wordIndex++;
       }
     }
+#undef lineAt
+    line += lengthOfLine;
     row++;
   }
-  fclose(source);
+}
+
+/* Compiled programs are cached next to their source with -C, as prog.stcb for prog.stc. */
+/* A cache holds everything lexing and compiling produced: the strings, tokens, instructions, */
+/* literals and definitions. It is used for as long as the source hashes the same, if it was */
+/* written by the same build with the same optimizations. Strings and tokens are used in place */
+/* from the mapped file, instructions are copied out of it, since the optimizer rewrites them. */
+
+#define CACHE_MAGIC 0x42435453 /* "STCB" */
+#define CACHE_VERSION 1
+#define CACHE_ALIGN(size) (((size) + 7) & ~(size_t) 7)
+
+typedef struct CacheHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t ops;         /* OPS_COUNT, the numbering of ops changes as they are added */
+  uint32_t tokenSize;   /* sizeof(Token) */
+  uint64_t sourceHash;
+  uint64_t sourceSize;
+  int inlineConstants;  /* passed to compile() */
+  int strings;          /* bytes of strings */
+  int tokens;
+  int instructions;
+  int literals;
+  int definitions;
+} CacheHeader;
+
+/* An instruction, with the index of its token instead of a pointer, -1 for none. */
+typedef struct CacheInstr {
+  uint16_t op;
+  uint16_t len;
+  int arg;
+  int token;
+} CacheInstr;
+
+typedef struct CacheDefinition {
+  int word;
+  int body;
+  int constant;
+} CacheDefinition;
+
+/* FNV-1a hash of the source of a program. */
+uint64_t hashSource(const char *source, size_t size) {
+  uint64_t hash = 14695981039346656037ull;
+  size_t i;
+  for (i = 0; i < size; i++) {
+    hash = (hash ^ (unsigned char) source[i]) * 1099511628211ull;
+  }
+  return hash;
+}
+
+/* Sorts definitions in the order they were added, so that the same words shadow each other. */
+static int compareDefinitions(const void *a, const void *b) {
+  return ((CacheDefinition*) a)->body - ((CacheDefinition*) b)->body;
+}
+
+/* Writes the cache of a program compiled from a source with the given hash and size. */
+/* It is written to a temporary file first, so a cache is never seen half written. */
+/* Failing to write it is not an error, the program runs all the same. */
+void saveCache(char *path, uint64_t hash, size_t sourceSize, int inlineConstants,
+    Tokens *tokens, Program *program, Definitions *definitions) {
+  CacheHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = CACHE_MAGIC;
+  header.version = CACHE_VERSION;
+  header.ops = OPS_COUNT;
+  header.tokenSize = sizeof(Token);
+  header.sourceHash = hash;
+  header.sourceSize = sourceSize;
+  header.inlineConstants = inlineConstants;
+  header.strings = strings->size;
+  header.instructions = program->size;
+  header.literals = program->literalCount;
+  header.definitions = definitions->size;
+
+  CacheInstr *code = (CacheInstr*) arenaAlloc(arena, sizeof(CacheInstr) * program->size);
+  int *literals = (int*) arenaAlloc(arena, sizeof(int) * (program->literalCount + 1));
+  /* Tokens made while compiling, such as those of folded constants, are written after the lexed ones. */
+  Token **made = (Token**) arenaAlloc(arena, sizeof(Token*) * (program->size + 1));
+  int madeCount = 0;
+  int i, j;
+  for (i = 0; i < program->size; i++) {
+    Instr *instr = &program->code[i];
+    code[i].op = instr->op;
+    code[i].len = instr->len;
+    code[i].arg = instr->arg;
+    if (instr->token == NULL) {
+      code[i].token = -1;
+    } else if (instr->token >= tokens->tokens && instr->token < tokens->tokens + tokens->size) {
+      code[i].token = (int) (instr->token - tokens->tokens);
+    } else {
+      for (j = 0; j < madeCount && made[j] != instr->token; j++);
+      if (j == madeCount) {
+        made[madeCount++] = instr->token;
+      }
+      code[i].token = tokens->size + j;
+    }
+    if (instr->op == OP_STR) {
+      literals[instr->arg] = code[i].token;
+    }
+  }
+  CacheDefinition *words = (CacheDefinition*) arenaAlloc(arena, sizeof(CacheDefinition) * (definitions->size + 1));
+  int count = 0;
+  for (i = 0; i < definitions->capacity; i++) {
+    DefWord *definition;
+    for (definition = definitions->buckets[i]; definition != NULL; definition = definition->next) {
+      words[count].word = definition->word;
+      words[count].body = definition->body;
+      words[count].constant = definition->constant;
+      count++;
+    }
+  }
+  qsort(words, count, sizeof(CacheDefinition), compareDefinitions);
+  header.tokens = tokens->size + madeCount;
+
+  char *temporary = arenaPrintf(arena, "%s.XXXXXX", path);
+  int fd = mkstemp(temporary);
+  if (fd == -1) {
+    return;
+  }
+  fchmod(fd, 0644);
+  FILE *file = fdopen(fd, "w");
+  static const char padding[8];
+  int written = file != NULL
+    && fwrite(&header, sizeof(header), 1, file) == 1
+    && fwrite(strings->chars, 1, strings->size, file) == (size_t) strings->size
+    && fwrite(padding, 1, CACHE_ALIGN(strings->size) - strings->size, file) == CACHE_ALIGN(strings->size) - strings->size
+    && fwrite(tokens->tokens, sizeof(Token), tokens->size, file) == (size_t) tokens->size;
+  for (i = 0; written && i < madeCount; i++) {
+    written = fwrite(made[i], sizeof(Token), 1, file) == 1;
+  }
+  written = written
+    && fwrite(code, sizeof(CacheInstr), program->size, file) == (size_t) program->size
+    && fwrite(literals, sizeof(int), program->literalCount, file) == (size_t) program->literalCount
+    && fwrite(words, sizeof(CacheDefinition), count, file) == (size_t) count;
+  if (file == NULL ? close(fd) != 0 : fclose(file) != 0) {
+    written = 0;
+  }
+  if (!written || rename(temporary, path) != 0) {
+    unlink(temporary);
+  } else if (verbose) {
+    fprintf(stderr, "[%s] Cached the compiled program in %s\n", thisName, path);
+  }
+}
+
+/* Reads the program cached at path into program, which is empty, setting up strings, tokens and */
+/* definitions as compiling would. Returns 0 if there is no cache, or it is not of this source, */
+/* build or optimizations. */
+int loadCache(char *path, uint64_t hash, size_t sourceSize, int inlineConstants,
+    Program *program, Tokens *tokens, Definitions *definitions) {
+  int fd = open(path, O_RDONLY);
+  if (fd == -1) {
+    return 0;
+  }
+  struct stat info;
+  char *cache = MAP_FAILED;
+  if (fstat(fd, &info) == 0 && (size_t) info.st_size >= sizeof(CacheHeader)) {
+    cache = (char*) mmap(NULL, info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (cache == MAP_FAILED) {
+    return 0;
+  }
+  CacheHeader *header = (CacheHeader*) cache;
+  char *chars = cache + sizeof(CacheHeader);
+  Token *cachedTokens = (Token*) (chars + CACHE_ALIGN(header->strings));
+  CacheInstr *code = (CacheInstr*) (cachedTokens + header->tokens);
+  int *literals = (int*) (code + header->instructions);
+  CacheDefinition *words = (CacheDefinition*) (literals + header->literals);
+  int valid = header->magic == CACHE_MAGIC && header->version == CACHE_VERSION && header->ops == OPS_COUNT
+    && header->tokenSize == sizeof(Token) && header->sourceHash == hash && header->sourceSize == sourceSize
+    && header->inlineConstants == inlineConstants
+    && (char*) (words + header->definitions) - cache == info.st_size;
+  int i;
+  for (i = 0; valid && i < header->instructions; i++) {
+    valid = code[i].token >= -1 && code[i].token < header->tokens;
+  }
+  for (i = 0; valid && i < header->literals; i++) {
+    valid = literals[i] >= 0 && literals[i] < header->tokens;
+  }
+  if (!valid) {
+    munmap(cache, info.st_size);
+    return 0;
+  }
+
+  strings->chars = chars;
+  strings->size = strings->capacity = header->strings;
+  tokens->tokens = cachedTokens;
+  tokens->size = tokens->capacity = header->tokens;
+  program->code = (Instr*) arenaGrow(arena, program->code,
+    sizeof(Instr) * program->capacity, sizeof(Instr) * header->instructions);
+  program->size = program->capacity = header->instructions;
+  for (i = 0; i < header->instructions; i++) {
+    Instr *instr = &program->code[i];
+    instr->op = code[i].op;
+    instr->len = code[i].len;
+    instr->arg = code[i].arg;
+    instr->token = code[i].token == -1 ? NULL : &cachedTokens[code[i].token];
+  }
+  for (i = 0; i < header->literals; i++) {
+    addLiteral(program, &cachedTokens[literals[i]]);
+  }
+  for (i = 0; i < header->definitions; i++) {
+    addDefinition(definitions, words[i].word, words[i].body);
+    findDefinition(definitions, words[i].word)->constant = words[i].constant;
+  }
+  if (verbose) {
+    fprintf(stderr, "[%s] Using the compiled program cached in %s\n", thisName, path);
+  }
+  return 1;
+}
+
+/* Embedding: a context (StackC) loads and runs programs from memory, with errors returned as */
+/* STACKC_ERROR instead of exiting and output captured into a buffer if asked. Its state is kept */
+/* in the globals of its thread while it is used, so a thread uses its contexts one after another, */
+/* and threads each use their own at once. A program runs on the thread that loaded it. */
+/* stackc.h declares these for libstackc.a, main() is built on them too. */
+
+/* Releases the strings of a program's literals, once it is done with. */
+static void releaseLiterals(Program *program) {
+  int i;
+  for (i = 0; i < program->literalCount; i++) {
+    releaseCell(makePointerCell(TYPE_STR, program->literals[i]));
+  }
+}
+
+static pthread_once_t keywordsReady = PTHREAD_ONCE_INIT;
+
+/* Makes context the one being used, returning the one that was. */
+static StackC* enterContext(StackC *context) {
+  StackC *previous = current;
+  if (previous != context) {
+    flushOutput();
+  }
+  current = context;
+  arena = context->arena;
+  strings = context->strings;
+  thisName = context->name;
+  output.lineBuffered = (context->options & STACKC_LINE_BUFFERED) != 0;
+  return previous;
+}
+
+/* Goes back to using the context that was, after everything printed is written out. */
+static void leaveContext(StackC *previous) {
+  flushOutput();
+  current->escape = NULL;
+  current = previous;
+  if (previous != NULL) {
+    arena = previous->arena;
+    strings = previous->strings;
+    thisName = previous->name;
+    output.lineBuffered = (previous->options & STACKC_LINE_BUFFERED) != 0;
+  }
+}
+
+/* Creates a context, named in its errors as stackc is by its path. */
+StackC* stackcNew(const char *name) {
+  StackC *context = (StackC*) allocate(sizeof(StackC));
+  assert(context != NULL, "Out of memory while creating an interpreter.");
+  memset(context, 0, sizeof(StackC));
+  context->name = (char*) allocate(strlen(name) + 1);
+  assert(context->name != NULL, "Out of memory while creating an interpreter.");
+  strcpy(context->name, name);
+  context->arena = newArena();
+  StackC *previous = enterContext(context);
+  pthread_once(&keywordsReady, initKeywords);
+  context->strings = strings = newStrings();
+  context->stack = newStack();
+  leaveContext(previous);
+  return context;
+}
+
+/* Sets the options of the programs loaded from now on. */
+void stackcOptions(StackC *context, int options) {
+  context->options = options;
+}
+
+/* Captures the output of the programs run from now on into the capacity bytes at buffer, */
+/* or writes it to stdout again if buffer is NULL. Errors and .stack are kept for */
+/* stackcDiagnostics() while output is captured, instead of going to stderr. */
+void stackcCaptureOutput(StackC *context, char *buffer, size_t capacity) {
+  if (context->growCapture) {
+    free(context->capture);
+    context->growCapture = 0;
+  }
+  context->capture = buffer;
+  context->captureCapacity = buffer == NULL ? 0 : capacity;
+  context->captured = 0;
+  if (buffer != NULL && context->diagnostics == NULL) {
+    context->diagnostics = open_memstream(&context->diagnosticText, &context->diagnosticSize);
+  }
+}
+
+/* Bytes printed since output was captured or the context was reset, */
+/* more than the capacity of the buffer if some were cut off. */
+size_t stackcOutputSize(StackC *context) {
+  return context->captured;
+}
+
+/* Message of the error that stopped the last program loaded or run, NULL if there was none. */
+const char* stackcError(StackC *context) {
+  return context->error[0] != '\0' ? context->error : NULL;
+}
+
+/* Everything printed on stderr while output is captured: errors and their tokens, and .stack. */
+const char* stackcDiagnostics(StackC *context) {
+  if (context->diagnostics == NULL) {
+    return "";
+  }
+  fflush(context->diagnostics);
+  return context->diagnosticText;
+}
+
+/* Forgets the program loaded and its words, returning the arena for the next one. */
+/* The values on the stack are kept, moved to a new stack as the old one was in the arena. */
+static void releaseProgram(StackC *context) {
+  Stack *stack = context->stack;
+  int size = stack->size;
+  Cell *values = NULL;
+  if (size > 0) {
+    values = (Cell*) allocate(sizeof(Cell) * size);
+    assert(values != NULL, "Out of memory while loading a program.");
+    memcpy(values, stack->values, sizeof(Cell) * size);
+  }
+  if (context->program != NULL) {
+    releaseLiterals(context->program);
+  }
+  releaseJitMemory(&context->jit, 1);
+  resetArena(context->arena);
+  context->strings = strings = newStrings();
+  context->stack = stack = newStack();
+  while (stack->capacity < size) {
+    growStack(stack);
+  }
+  if (size > 0) {
+    memcpy(stack->values, values, sizeof(Cell) * size);
+    stack->size = size;
+    free(values);
+  }
+  context->tokens = NULL;
+  context->definitions = NULL;
+  context->program = NULL;
+}
+
+/* Lexes and compiles source in place, then readies it to run with the context's options. */
+static int loadProgram(StackC *context, char *source, size_t size) {
+  jmp_buf escape;
+  StackC *previous = enterContext(context);
+  context->error[0] = '\0';
+  context->program = NULL;
+  context->escape = &escape;
+  if (setjmp(escape) != 0) {
+    /* The strings of its literals are released, however far it was compiled. */
+    if (context->program != NULL) {
+      releaseLiterals(context->program);
+    }
+    context->program = NULL;
+    leaveContext(previous);
+    return STACKC_ERROR;
+  }
+  int optimizeProgram = (context->options & STACKC_NO_OPTIMIZE) == 0;
+  int checkProgram = (context->options & STACKC_CHECK) != 0;
+  context->tokens = newTokens();
+  context->definitions = newDefinitions();
+  /* The program is the context's while it is built, but only runs once it is ready. */
+  Program *program = context->program = newProgram();
+  int cached = 0;
+  uint64_t hash = 0;
+  if (context->cache != NULL) {
+    hash = hashSource(source, size);
+    enterPhase(PHASE_COMPILE);
+    cached = loadCache(context->cache, hash, size, optimizeProgram, program, context->tokens, context->definitions);
+    if (stats != NULL) {
+      stats->cached = cached;
+    }
+  }
+  if (!cached) {
+    enterPhase(PHASE_LEX);
+    lex(context->tokens, source, size);
+    enterPhase(PHASE_COMPILE);
+    compile(program, context->tokens, context->definitions, optimizeProgram);
+    if (context->cache != NULL) {
+      saveCache(context->cache, hash, size, optimizeProgram, context->tokens, program, context->definitions);
+    }
+  }
+  enterPhase(PHASE_OPTIMIZE);
+  /* Compiled natively from the instructions as written, the optimizer's fused ops are only for execute(). */
+  if (optimizeProgram && !context->native) {
+    optimize(program);
+  }
+  if ((checkProgram || optimizeProgram) && analyze(program, context->stack->size == 0, checkProgram, optimizeProgram) > 0) {
+    snprintf(context->error, sizeof(context->error), "The program fails as reported.");
+    releaseLiterals(program);
+    context->program = NULL;
+    leaveContext(previous);
+    return STACKC_ERROR;
+  }
+  if (optimizeProgram && JIT_SUPPORTED && (context->options & STACKC_NO_JIT) == 0 && !context->native) {
+    enableJit(program);
+  }
+  leaveContext(previous);
+  return STACKC_OK;
+}
+
+/* Loads the program in the size bytes at source, replacing the one loaded before. */
+/* The stack is kept from the programs run before, until the context is reset. */
+int stackcLoad(StackC *context, const char *source, size_t size) {
+  StackC *previous = enterContext(context);
+  releaseProgram(context);
+  /* The lexer decodes escapes in place. */
+  char *copy = (char*) arenaAlloc(arena, size + 1);
+  memcpy(copy, source, size);
+  leaveContext(previous);
+  return loadProgram(context, copy, size);
+}
+
+/* Runs the program loaded, until it ends or fails. */
+int stackcRun(StackC *context) {
+  if (context->program == NULL) {
+    snprintf(context->error, sizeof(context->error), "No program loaded.");
+    return STACKC_ERROR;
+  }
+  jmp_buf escape;
+  StackC *previous = enterContext(context);
+  context->error[0] = '\0';
+  context->escape = &escape;
+  if (setjmp(escape) != 0) {
+    leaveContext(previous);
+    return STACKC_ERROR;
+  }
+  execute(context->stack, context->program, 0);
+  leaveContext(previous);
+  return STACKC_OK;
+}
+
+/* Forgets the program loaded, its words and the stack, and clears output and errors, */
+/* keeping the memory of the context for the next program. */
+void stackcReset(StackC *context) {
+  StackC *previous = enterContext(context);
+  Stack *stack = context->stack;
+  while (stack->size > 0) {
+    releaseCell(stack->values[--stack->size]);
+  }
+  releaseProgram(context);
+  context->captured = 0;
+  context->error[0] = '\0';
+  if (context->diagnostics != NULL) {
+    fclose(context->diagnostics);
+    free(context->diagnosticText);
+    context->diagnostics = open_memstream(&context->diagnosticText, &context->diagnosticSize);
+  }
+  leaveContext(previous);
+}
+
+/* Frees a context and everything of its programs. */
+void stackcFree(StackC *context) {
+  stackcReset(context);
+  if (context->diagnostics != NULL) {
+    fclose(context->diagnostics);
+    free(context->diagnosticText);
+  }
+  if (context->growCapture) {
+    free(context->capture);
+  }
+  releaseJitMemory(&context->jit, 0);
+  freeArena(context->arena);
+  free(context->name);
+  free(context);
+}
+
+#ifndef STACKC_NO_MAIN
+/* --batch runs many programs in one process, on a pool of threads with a context each. */
+/* The programs are split into a range per thread. A thread runs its own from the front, and */
+/* once it has none left, steals the back half of another's, so a long program only holds */
+/* up the thread running it. Each program's output goes to <directory>/<name>.o, or to stdout */
+/* framed by a line `=== <status> <bytes> <path>` before it and a new line after it, as it */
+/* would print with stderr on stdout. */
+
+#define BATCH_CAPTURE_SIZE (64 * 1024)
+
+/* Programs left to a thread, those from top up to bottom. */
+typedef struct BatchQueue {
+  pthread_mutex_t lock;
+  int top;
+  int bottom;
+} BatchQueue;
+
+typedef struct Batch {
+  char *name;               /* thisName of each thread */
+  char **programs;
+  int count;
+  BatchQueue *queues;
+  int threads;
+  int options;
+  char *directory;          /* NULL for framed output on stdout */
+  pthread_mutex_t outputLock;
+  int failed;               /* programs that did not run to the end, under outputLock */
+} Batch;
+
+/* Thread and the batch it runs for. */
+typedef struct BatchWorker {
+  Batch *batch;
+  int index;
+  pthread_t thread;
+} BatchWorker;
+
+/* Adds the programs to run for a file, or each .stc file in a directory, by name. */
+static void addBatchPrograms(Batch *batch, int *capacity, char *path) {
+  struct stat info;
+  struct dirent **entries;
+  int count = 0, i;
+  if (stat(path, &info) == 0 && S_ISDIR(info.st_mode)) {
+    count = scandir(path, &entries, NULL, alphasort);
+    assert(count >= 0, arenaPrintf(arena, "[%s] Could not read the directory %s.", thisName, path));
+  }
+  for (i = 0; i < (count > 0 ? count : 1); i++) {
+    char *program = path;
+    if (count > 0) {
+      if (!endsWith(entries[i]->d_name, ".stc")) {
+        free(entries[i]);
+        continue;
+      }
+      program = arenaPrintf(arena, "%s/%s", path, entries[i]->d_name);
+      free(entries[i]);
+    }
+    if (batch->count == *capacity) {
+      *capacity = *capacity * 2 + 16;
+      batch->programs = (char**) realloc(batch->programs, sizeof(char*) * *capacity);
+      assert(batch->programs != NULL, "Out of memory while listing programs.");
+    }
+    batch->programs[batch->count++] = program;
+  }
+  if (count > 0) {
+    free(entries);
+  }
+}
+
+/* Next program for a thread to run, from its own queue or stolen, or -1 once there are none. */
+static int nextBatchProgram(Batch *batch, int index) {
+  BatchQueue *queue = &batch->queues[index];
+  pthread_mutex_lock(&queue->lock);
+  int program = queue->top < queue->bottom ? queue->top++ : -1;
+  pthread_mutex_unlock(&queue->lock);
+  int i;
+  for (i = 1; program == -1 && i < batch->threads; i++) {
+    BatchQueue *victim = &batch->queues[(index + i) % batch->threads];
+    pthread_mutex_lock(&victim->lock);
+    int left = victim->bottom - victim->top;
+    int stolen = (left + 1) / 2;
+    victim->bottom -= stolen;
+    pthread_mutex_unlock(&victim->lock);
+    if (stolen > 0) {
+      /* The first is run now, the rest are left where other threads can steal them back. */
+      pthread_mutex_lock(&queue->lock);
+      program = victim->bottom;
+      queue->top = program + 1;
+      queue->bottom = program + stolen;
+      pthread_mutex_unlock(&queue->lock);
+    }
+  }
+  return program;
+}
+
+/* Loads and runs a program file in a context, keeping the source mapped until it has run. */
+static int runBatchProgram(StackC *context, char *filename) {
+  jmp_buf escape;
+  size_t size = 0;
+  char *source = NULL;
+  StackC *previous = enterContext(context);
+  context->escape = &escape;
+  if (setjmp(escape) != 0) {
+    leaveContext(previous);
+    return STACKC_ERROR;
+  }
+  assert(endsWith(filename, ".stc"), "File must have \".stc\" extension.");
+  source = mapSource(filename, &size);
+  leaveContext(previous);
+  int status = loadProgram(context, source, size);
+  if (status == STACKC_OK) {
+    status = stackcRun(context);
+  }
+  if (source != NULL) {
+    munmap(source, size);
+  }
+  return status;
+}
+
+/* File name of a program without its directory. */
+static char* batchBaseName(char *filename) {
+  return strrchr(filename, '/') != NULL ? strrchr(filename, '/') + 1 : filename;
+}
+
+static int compareBaseNames(const void *a, const void *b) {
+  return strcmp(batchBaseName(*(char**) a), batchBaseName(*(char**) b));
+}
+
+/* Writes what a program printed, to its file in the directory or framed on stdout. */
+static void writeBatchOutput(Batch *batch, StackC *context, char *filename, int status) {
+  const char *diagnostics = stackcDiagnostics(context);
+  size_t diagnosticSize = strlen(diagnostics);
+  if (batch->directory != NULL) {
+    char *name = batchBaseName(filename);
+    char *path = arenaPrintf(arena, "%s/%.*s.o", batch->directory, (int) strlen(name) - 4, name);
+    FILE *file = fopen(path, "w");
+    int written = file != NULL
+      && fwrite(diagnostics, 1, diagnosticSize, file) == diagnosticSize
+      && fwrite(context->capture, 1, context->captured, file) == context->captured;
+    if (file == NULL || fclose(file) != 0 || !written) {
+      fprintf(stderr, "[%s] Could not write the output of %s to %s.\n", thisName, filename, path);
+      status = STACKC_ERROR;
+    }
+  }
+  pthread_mutex_lock(&batch->outputLock);
+  if (batch->directory == NULL) {
+    printf("=== %d %zu %s\n", status, diagnosticSize + context->captured, filename);
+    fwrite(diagnostics, 1, diagnosticSize, stdout);
+    fwrite(context->capture, 1, context->captured, stdout);
+    putchar('\n');
+  }
+  if (status != STACKC_OK) {
+    batch->failed++;
+  }
+  pthread_mutex_unlock(&batch->outputLock);
+}
+
+/* Runs programs with a context of its own until there are none left. */
+static void* runBatchWorker(void *argument) {
+  BatchWorker *worker = (BatchWorker*) argument;
+  Batch *batch = worker->batch;
+  StackC *context = stackcNew(batch->name);
+  stackcOptions(context, batch->options);
+  stackcCaptureOutput(context, (char*) malloc(BATCH_CAPTURE_SIZE), BATCH_CAPTURE_SIZE);
+  context->growCapture = 1;
+  int program;
+  while ((program = nextBatchProgram(batch, worker->index)) != -1) {
+    char *filename = batch->programs[program];
+    int status = runBatchProgram(context, filename);
+    /* arena is the context's while writing, for the path of the output. */
+    StackC *previous = enterContext(context);
+    writeBatchOutput(batch, context, filename, status);
+    leaveContext(previous);
+    stackcReset(context);
+  }
+  stackcFree(context);
+  return NULL;
+}
+
+/* Runs the programs at paths, files or directories, on threads, returning how many failed. */
+static int runBatch(char **paths, int pathCount, int threads, int options, char *directory) {
+  Batch batch;
+  memset(&batch, 0, sizeof(batch));
+  batch.name = thisName;
+  batch.options = options;
+  batch.directory = directory;
+  int capacity = 0, i;
+  for (i = 0; i < pathCount; i++) {
+    addBatchPrograms(&batch, &capacity, paths[i]);
+  }
+  if (directory != NULL) {
+    /* Outputs are named after the programs without their directories, which must not clash. */
+    char **names = (char**) arenaAlloc(arena, sizeof(char*) * (batch.count + 1));
+    memcpy(names, batch.programs, sizeof(char*) * batch.count);
+    qsort(names, batch.count, sizeof(char*), compareBaseNames);
+    for (i = 1; i < batch.count; i++) {
+      assert(compareBaseNames(&names[i - 1], &names[i]) != 0,
+        arenaPrintf(arena, "[%s] %s and %s would both write their output to %s/%.*s.o.", thisName,
+          names[i - 1], names[i], directory, (int) strlen(batchBaseName(names[i])) - 4, batchBaseName(names[i])));
+    }
+    assert(mkdir(directory, 0777) == 0 || errno == EEXIST,
+      arenaPrintf(arena, "[%s] Could not create the directory %s.", thisName, directory));
+  }
+  batch.threads = threads < batch.count ? threads : batch.count;
+  if (batch.threads < 1) {
+    batch.threads = 1;
+  }
+  batch.queues = (BatchQueue*) calloc(batch.threads, sizeof(BatchQueue));
+  BatchWorker *workers = (BatchWorker*) calloc(batch.threads, sizeof(BatchWorker));
+  assert(batch.queues != NULL && workers != NULL, "Out of memory while starting threads.");
+  pthread_mutex_init(&batch.outputLock, NULL);
+  for (i = 0; i < batch.threads; i++) {
+    pthread_mutex_init(&batch.queues[i].lock, NULL);
+    batch.queues[i].top = (long) batch.count * i / batch.threads;
+    batch.queues[i].bottom = (long) batch.count * (i + 1) / batch.threads;
+    workers[i].batch = &batch;
+    workers[i].index = i;
+  }
+  for (i = 0; i < batch.threads; i++) {
+    assert(pthread_create(&workers[i].thread, NULL, runBatchWorker, &workers[i]) == 0,
+      "Could not start a thread.");
+  }
+  for (i = 0; i < batch.threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+  }
+  fflush(stdout);
+  if (verbose) {
+    fprintf(stderr, "[%s] Ran %d programs on %d threads, %d failed.\n", thisName, batch.count, batch.threads, batch.failed);
+  }
+  for (i = 0; i < batch.threads; i++) {
+    pthread_mutex_destroy(&batch.queues[i].lock);
+  }
+  pthread_mutex_destroy(&batch.outputLock);
+  free(batch.queues);
+  free(workers);
+  free(batch.programs);
+  return batch.failed;
+}
+
+/* Main Function */
+int main(int argc, char* argv[]) {
+  thisName = argv[0];
+  int options = isatty(STDOUT_FILENO) ? STACKC_LINE_BUFFERED : 0;
+  int useCache = 0;
+  int assemblyOnly = 0;
+  char *nativeOutput = NULL;
+  char *profilePath = NULL;
+  int collectStats = 0;
+  char *statsPath = NULL;
+  int batch = 0;
+  int threads = 0;
+  char *batchDirectory = NULL;
+  static struct option longOptions[] = {
+    {"batch", no_argument, NULL, 'B'},
+    {"profile", required_argument, NULL, 'p'},
+    {"stats", optional_argument, NULL, 's'},
+    {NULL, 0, NULL, 0}
+  };
+  int opt;
+  while ((opt = getopt_long(argc, argv, "clvCDJO:o:p:s::Sj:d:", longOptions, NULL)) != -1) {
+    switch (opt) {
+      case 'B': batch = 1; break;
+      case 'j':
+        threads = atoi(optarg);
+        if (threads < 1) {
+          printUsage;
+          exit(1);
+        }
+        break;
+      case 'd': batchDirectory = optarg; break;
+      case 'c': options |= STACKC_CHECK; break;
+      case 'C': useCache = 1; break;
+      case 'D': jitDump = 1; break;
+      case 'J': options |= STACKC_NO_JIT; break;
+      case 'o': nativeOutput = optarg; break;
+      case 'p': profilePath = optarg; break;
+      case 's': collectStats = 1; statsPath = optarg; break;
+      case 'S': assemblyOnly = 1; break;
+      case 'l': options |= STACKC_LINE_BUFFERED; break;
+      case 'v': verbose = 1; break;
+      case 'O':
+        if (atoi(optarg) > 0) {
+          options &= ~STACKC_NO_OPTIMIZE;
+        } else {
+          options |= STACKC_NO_OPTIMIZE;
+        }
+        break;
+      default:
+        printUsage;
+        exit(1);
+    }
+  }
+  if (!batch && (threads != 0 || batchDirectory != NULL)) {
+    printUsage;
+    exit(1);
+  }
+  assert(optind < argc, "Not enough arguments.\nUsage: `./stackc [-clvCDJS] [-O0] [-o output] [-p|--profile profile] [-s[stats]|--stats[=stats]] filename`");
+  /* Compiled code runs without going through the ops, so it is not used while they are counted. */
+  if (profilePath != NULL || collectStats) {
+    options |= STACKC_NO_JIT;
+  }
+  StackC *context = stackcNew(argv[0]);
+  stackcOptions(context, options);
+  /* Used throughout, for the files and statistics of this program. */
+  enterContext(context);
+  atexit(flushOutput);
+
+  if (batch) {
+    if (useCache || nativeOutput != NULL || assemblyOnly || profilePath != NULL || collectStats) {
+      printUsage;
+      exit(1);
+    }
+    if (threads == 0) {
+      threads = (int) sysconf(_SC_NPROCESSORS_ONLN);
+    }
+    /* Each program is run and printed as a whole, there is no terminal to write lines to. */
+    return runBatch(argv + optind, argc - optind, threads, options & ~STACKC_LINE_BUFFERED, batchDirectory) > 0;
+  }
+  char* filename = argv[optind];
+  assert(endsWith(filename, ".stc"), "File must have \".stc\" extension.");
 
-  while (!isEmptyQueue(instructions)) {
-    parseQueue(stack, instructions, definitions, pollQueue(instructions));
+  if (access(filename, R_OK) != 0) {
+    /* Checks for read permission for programFile. */
+    fprintf(stderr, "[%s] StackC Program File `%s` not found.\n", thisName, filename);
+    return 1;
+  }
+  if (collectStats) {
+    stats = newStats(filename, statsPath);
+    atexit(writeStats);
+  }
+  enterPhase(PHASE_LEX);
+  size_t size;
+  char *source = mapSource(filename, &size);
+  if (useCache) {
+    context->cache = arenaPrintf(arena, "%sb", filename);
+  }
+  context->native = nativeOutput != NULL;
+  if (loadProgram(context, source, size) != STACKC_OK) {
+    return 1;
+  }
+  if (nativeOutput != NULL) {
+    compileNative(context->program, nativeOutput, assemblyOnly);
+    return 0;
+  }
+  if (profilePath != NULL || stats != NULL) {
+    profile = newProfile(context->program, filename, profilePath);
+  }
+  if (profilePath != NULL) {
+    atexit(writeProfile);
+    startProfile(profile);
+  }
+  enterPhase(PHASE_EXECUTE);
+  if (stackcRun(context) != STACKC_OK) {
+    return 1;
+  }
+  if (stats != NULL) {
+    stats->completed = 1;
   }
 
   return 0;
 }
+#endif
@@ -0,0 +1,48 @@
+/* Embedding API of the StackC interpreter, built from stackc.c as libstackc.a with `make libstackc.a`. */
+/* A context loads a program from memory and runs it. Errors are returned as STACKC_ERROR instead */
+/* of exiting, and output can be captured into a buffer. A thread uses its contexts one after */
+/* another, threads can each use their own at the same time. A program runs on the thread that */
+/* loaded it. Link with -pthread. */
+
+#ifndef STACKC_H
+#define STACKC_H
+
+#include <stddef.h>
+
+typedef struct StackC StackC;
+
+#define STACKC_OK 0
+#define STACKC_ERROR 1
+
+/* Options of stackcOptions(), the flags of stackc. */
+#define STACKC_NO_OPTIMIZE 1    /* -O0 */
+#define STACKC_CHECK 2          /* -c */
+#define STACKC_NO_JIT 4         /* -J */
+#define STACKC_LINE_BUFFERED 8  /* -l */
+
+/* Creates a context, named in its errors as stackc is by its path. */
+StackC* stackcNew(const char *name);
+/* Frees a context and everything of its programs. */
+void stackcFree(StackC *context);
+/* Sets the options of the programs loaded from now on. */
+void stackcOptions(StackC *context, int options);
+/* Captures the output of the programs run from now on into the capacity bytes at buffer, or */
+/* writes it to stdout again if buffer is NULL. Errors and .stack are kept for stackcDiagnostics() */
+/* while output is captured, instead of going to stderr. */
+void stackcCaptureOutput(StackC *context, char *buffer, size_t capacity);
+/* Bytes printed since output was captured or the context was reset, */
+/* more than the capacity of the buffer if some were cut off. */
+size_t stackcOutputSize(StackC *context);
+/* Loads the program in the size bytes at source, freeing the one loaded before and its words. */
+/* The stack is kept from the programs run before, until the context is reset. */
+int stackcLoad(StackC *context, const char *source, size_t size);
+/* Runs the program loaded, until it ends or fails. */
+int stackcRun(StackC *context);
+/* Message of the error that stopped the last program loaded or run, NULL if there was none. */
+const char* stackcError(StackC *context);
+/* Everything printed on stderr while output is captured: errors and their tokens, and .stack. */
+const char* stackcDiagnostics(StackC *context);
+/* Forgets the program loaded, its words and the stack, and clears output and errors. */
+void stackcReset(StackC *context);
+
+#endif
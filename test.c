@@ -2,13 +2,21 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 
+#include "stackc.h"
+
 #define IN_EXT ".stc"
 #define OUT_EXT ".o"
+/* Output captured from a program at first, more if it prints more. */
+#define OUTPUT_CAPACITY (1024 * 1024)
+/* Tests listed by time taken after the results. */
+#define SLOWEST 5
 
-#define getCommand(command, programFile) asprintf(&command, "./stackc %s 2>&1", programFile)
-#define printUsage fprintf(stderr, "Usage: `%s [-duv] [directory]` or `%s [-uv] [files...]\n", thisName, thisName)
+#define getCommand(command, options, programFile) asprintf(&command, "./stackc %s%s 2>&1", options, programFile)
+#define printUsage fprintf(stderr, "Usage: `%s [-duocnpbv] [-j jobs] [directory]` or `%s [-uocnpbv] [-j jobs] [files...]\n", thisName, thisName)
 
 /* Run tests on all files. */
 static int testDirectory = 0;
@@ -16,34 +24,140 @@ static int testDirectory = 0;
 static int forceUpdate = 0;
 /* Logs standard output. */
 static int verboseOutput = 0;
+/* Compares output with the optimizer against output without it, instead of the output files. */
+static int compareOptimized = 0;
+/* Runs each program from the cache written by running it once with -C before, failing if a */
+/* cache was written but not used. */
+static int compareCached = 0;
+/* Compiles each program to a native executable and runs that instead. */
+static int compareNative = 0;
+/* Runs each program while profiling it and collecting statistics, leaving out the summary of the */
+/* profile printed at exit. */
+static int compareProfiled = 0;
+/* Runs every program at once in `stackc --batch` before the tests, which compare what it wrote. */
+static int compareBatch = 0;
+/* Where the batch writes the output of each program. */
+static char batchDir[] = "/tmp/stackc-batch-XXXXXX";
+/* Where executables are compiled to, named after the interpreter so that errors read the same. */
+static char nativeDir[] = "/tmp/stackc-test-XXXXXX";
 
 static char *thisName;
 
+/* A test run by a child process, its output kept until it is reported. */
+typedef struct Job {
+  char *name;
+  pid_t pid;
+  FILE *output;
+  double start;
+  double elapsed;
+  int done;
+  int passed;
+} Job;
+
+int addJob(Job **, int *, int *, char *);
+int runBatch(Job *, int, long);
+int compareJobNames(const void *, const void *);
+int compareJobTimes(const void *, const void *);
 int chopEnd(char *, char *);
 int compareFiles(FILE *, FILE *);
 int runTest(char *);
+FILE *withoutProfile(FILE *);
+FILE *openText(char *, size_t);
+FILE *runProgram(char *, int);
 void updateTest(char *);
+int runJobs(Job *, int, int);
+void printSlowest(Job *, int);
 
+/* Compares a block at a time, reading both to their end. */
 int compareFiles(FILE *program, FILE *expected) {
-  char c = 1, d = 1;
+  char c[4096], d[4096];
+  size_t read, readExpected;
   int result = 1;
 
   do {
-    if (c != EOF) {
-      c = fgetc(program);
+    read = fread(c, 1, sizeof(c), program);
+    readExpected = fread(d, 1, sizeof(d), expected);
+    if (verboseOutput != 0) {
+      fwrite(c, 1, read, stdout);
     }
-    if (d != EOF) {
-      d = fgetc(expected);
+    if (read != readExpected || memcmp(c, d, read) != 0) {
+      result = 0;
     }
-    if (c != EOF && verboseOutput != 0) {
-      fputc(c, stdout);
+  } while (read > 0 || readExpected > 0);
+
+  return result;
+}
+
+/* Reads the output of a program up to the summary of its profile. */
+FILE *withoutProfile(FILE *program) {
+  char *output = NULL;
+  size_t size = 0;
+  FILE *copy = open_memstream(&output, &size);
+  if (copy == NULL) {
+    return NULL;
+  }
+  int c;
+  while ((c = fgetc(program)) != EOF) {
+    fputc(c, copy);
+  }
+  fclose(copy);
+  char *summary = strstr(output, "[./stackc] Profile: ");
+  if (summary != NULL) {
+    size = summary - output;
+  }
+  return openText(output, size);
+}
+
+/* Opens the size characters of text for reading. */
+FILE *openText(char *text, size_t size) {
+  return size > 0 ? fmemopen(text, size, "r") : fopen("/dev/null", "r");
+}
+
+/* Runs a program in this process with libstackc, returning what `./stackc` would print, */
+/* errors first as they are written to stderr right away, then the output. */
+FILE *runProgram(char *programFile, int options) {
+  FILE *file = fopen(programFile, "r");
+  if (file == NULL) {
+    return NULL;
+  }
+  char *source = NULL;
+  size_t size = 0;
+  FILE *copy = open_memstream(&source, &size);
+  char buffer[4096];
+  size_t read;
+  while ((read = fread(buffer, 1, sizeof(buffer), file)) > 0) {
+    fwrite(buffer, 1, read, copy);
+  }
+  fclose(copy);
+  fclose(file);
+
+  StackC *context = stackcNew("./stackc");
+  stackcOptions(context, options);
+  size_t capacity = OUTPUT_CAPACITY;
+  char *output = malloc(capacity);
+  while (1) {
+    stackcCaptureOutput(context, output, capacity);
+    if (stackcLoad(context, source, size) == STACKC_OK) {
+      stackcRun(context);
     }
-    if (c != d) {
-      result = 0;
+    if (stackcOutputSize(context) <= capacity) {
+      break;
     }
-  } while (c != EOF || d != EOF);
+    capacity = stackcOutputSize(context);
+    output = realloc(output, capacity);
+    stackcReset(context);
+  }
 
-  return result && c == EOF && d == EOF;
+  char *text = NULL;
+  size_t length = 0;
+  copy = open_memstream(&text, &length);
+  fputs(stackcDiagnostics(context), copy);
+  fwrite(output, 1, stackcOutputSize(context), copy);
+  fclose(copy);
+  stackcFree(context);
+  free(output);
+  free(source);
+  return openText(text, length);
 }
 
 int runTest(char *fileName) {
@@ -59,24 +173,52 @@ int runTest(char *fileName) {
     fprintf(stderr, "StackC Program File `%s%s` not found.\n", fileName, IN_EXT);
     return 0;
   }
-  getCommand(command, programFile);
-  program = popen(command, "r");
+  if (compareNative != 0) {
+    /* A directory for each test, as tests run at the same time. */
+    char *directory;
+    asprintf(&directory, "%s/%d", nativeDir, (int) getpid());
+    asprintf(&command, "mkdir %s && ./stackc -o %s/stackc %s 2>&1 && (cd %s && ./stackc 2>&1); rm -rf %s",
+      directory, directory, programFile, directory, directory);
+  } else if (compareProfiled != 0) {
+    getCommand(command, "--profile /dev/null -s/dev/null ", programFile);
+  } else if (compareBatch != 0) {
+    asprintf(&command, "cat %s/%s%s", batchDir, strrchr(fileName, '/') != NULL ? strrchr(fileName, '/') + 1 : fileName, OUT_EXT);
+  } else if (compareCached != 0) {
+    asprintf(&command, "./stackc -C %s > /dev/null 2>&1; "
+      "if [ -f %sb ]; then ./stackc -Cv %s 2>&1 > /dev/null | grep -q 'Using the compiled program' || echo 'Cache not used'; fi; "
+      "./stackc -C %s 2>&1; rm -f %sb", programFile, programFile, programFile, programFile, programFile);
+  } else {
+    command = NULL;
+  }
+  program = command != NULL ? popen(command, "r") : runProgram(programFile, 0);
   if (program == NULL) {
     fprintf(stderr, "Something went wrong executing StackC Program File `%s%s`.\n", fileName, IN_EXT);
     return 0;
   }
 
-  char *expectedFile;
-  asprintf(&expectedFile, "%s%s", fileName, OUT_EXT);
-  expected = fopen(expectedFile, "r");
-  if (expected == NULL) {
-    fprintf(stderr, "Expected Output File `%s` not found.\n", expectedFile);
-    return 0;
+  if (compareOptimized != 0) {
+    expected = runProgram(programFile, STACKC_NO_OPTIMIZE);
+    if (expected == NULL) {
+      fprintf(stderr, "Something went wrong executing StackC Program File `%s%s` unoptimized.\n", fileName, IN_EXT);
+      return 0;
+    }
+  } else {
+    char *expectedFile;
+    asprintf(&expectedFile, "%s%s", fileName, OUT_EXT);
+    expected = fopen(expectedFile, "r");
+    if (expected == NULL) {
+      fprintf(stderr, "Expected Output File `%s` not found.\n", expectedFile);
+      return 0;
+    }
   }
 
-  int result = compareFiles(program, expected);
+  FILE *output = compareProfiled != 0 ? withoutProfile(program) : program;
+  int result = output != NULL && compareFiles(output, expected);
+  if (output != NULL && output != program) {
+    fclose(output);
+  }
 
-  int status = pclose(program);
+  int status = command != NULL ? pclose(program) : fclose(program);
   fclose(expected);
   /* int errcode = WEXITSTATUS(status); */
   if (status == -1) {
@@ -92,15 +234,14 @@ void updateTest(char *fileName) {
   }
 
   FILE *program, *expected;
-  char *command, *programFile;
+  char *programFile;
   asprintf(&programFile, "%s%s", fileName, IN_EXT);
   if (access(programFile, R_OK) != 0) {
     /* Checks for read permission for programFile. */
     fprintf(stderr, "StackC Program File `%s%s` not found.\n", fileName, IN_EXT);
     return;
   }
-  getCommand(command, programFile);
-  program = popen(command, "r");
+  program = runProgram(programFile, 0);
   if (program == NULL) {
     fprintf(stderr, "Something went wrong executing StackC Program File `%s%s`.\n", fileName, IN_EXT);
     return;
@@ -126,11 +267,8 @@ void updateTest(char *fileName) {
     }
   } while (c != EOF);
 
-  int status = pclose(program);
+  fclose(program);
   fclose(expected);
-  if (status == -1) {
-    fprintf(stderr, "Error closing file with `pclose`.\n");
-  }
 }
 
 /* Returns 0 if ending not found. Will not be chopped. */
@@ -155,14 +293,169 @@ int chopEnd(char *string, char *ending) {
   }
 }
 
+static double now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int addJob(Job **jobs, int *count, int *capacity, char *name) {
+  if (*count == *capacity) {
+    *capacity *= 2;
+    *jobs = realloc(*jobs, sizeof(Job) * *capacity);
+  }
+  Job *job = &(*jobs)[(*count)++];
+  memset(job, 0, sizeof(Job));
+  job->name = name;
+  return *count;
+}
+
+int compareJobNames(const void *a, const void *b) {
+  return strcmp(((Job *) a)->name, ((Job *) b)->name);
+}
+
+int compareJobTimes(const void *a, const void *b) {
+  double x = (*(Job **) a)->elapsed, y = (*(Job **) b)->elapsed;
+  return (x < y) - (x > y);
+}
+
+/* Starts a child running a test, with its output to a temporary file. */
+static void startJob(Job *job) {
+  job->output = tmpfile();
+  if (job->output == NULL) {
+    fprintf(stderr, "Could not create a file for the output of %s.\n", job->name);
+    exit(1);
+  }
+  fflush(stdout);
+  fflush(stderr);
+  job->start = now();
+  job->pid = fork();
+  if (job->pid == 0) {
+    dup2(fileno(job->output), STDOUT_FILENO);
+    dup2(fileno(job->output), STDERR_FILENO);
+    int passed = 1;
+    if (forceUpdate != 0) {
+      updateTest(job->name);
+    } else {
+      passed = runTest(job->name);
+    }
+    fflush(stdout);
+    fflush(stderr);
+    _exit(passed ? 0 : 1);
+  } else if (job->pid == -1) {
+    fprintf(stderr, "Could not start a process for %s.\n", job->name);
+    exit(1);
+  }
+}
+
+/* Prints the output and result of a finished test. */
+static void reportJob(Job *job) {
+  char buffer[4096];
+  size_t read;
+  rewind(job->output);
+  while ((read = fread(buffer, 1, sizeof(buffer), job->output)) > 0) {
+    fwrite(buffer, 1, read, stdout);
+  }
+  fclose(job->output);
+  if (forceUpdate != 0) {
+    return;
+  }
+  if (job->passed) {
+    fprintf(stdout, "[%s] %s passed in %.3f s.\n", thisName, job->name, job->elapsed);
+  } else {
+    fflush(stdout);
+    fprintf(stderr, "[%s] %s failed in %.3f s.\n", thisName, job->name, job->elapsed);
+  }
+}
+
+/* Runs the tests with up to workers children at once, reporting each in order once it and every */
+/* test before it have finished. Returns the number of tests passed. */
+int runJobs(Job *jobs, int count, int workers) {
+  int started = 0, running = 0, reported = 0, passed = 0;
+  while (reported < count) {
+    while (running < workers && started < count) {
+      startJob(&jobs[started++]);
+      running++;
+    }
+    int status;
+    pid_t pid = wait(&status);
+    if (pid == -1) {
+      fprintf(stderr, "Lost track of the running tests.\n");
+      exit(1);
+    }
+    int i;
+    for (i = reported; i < started; i++) {
+      if (jobs[i].pid == pid && !jobs[i].done) {
+        jobs[i].elapsed = now() - jobs[i].start;
+        jobs[i].done = 1;
+        jobs[i].passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+        passed += jobs[i].passed;
+        running--;
+        break;
+      }
+    }
+    while (reported < count && jobs[reported].done) {
+      reportJob(&jobs[reported++]);
+    }
+  }
+  return passed;
+}
+
+/* Runs the programs of every test in one `stackc --batch` on as many threads as workers, */
+/* into batchDir. Returns 0 if it could not be run at all. */
+int runBatch(Job *jobs, int count, long workers) {
+  if (mkdtemp(batchDir) == NULL) {
+    fprintf(stderr, "Could not create a directory for the output of the batch.\n");
+    return 0;
+  }
+  char *command, *programs;
+  size_t size;
+  FILE *list = open_memstream(&programs, &size);
+  int i;
+  for (i = 0; i < count; i++) {
+    fprintf(list, " %s%s", jobs[i].name, IN_EXT);
+  }
+  fclose(list);
+  asprintf(&command, "./stackc --batch -j %ld -d %s%s", workers, batchDir, programs);
+  int status = system(command);
+  free(programs);
+  /* Programs that fail make it exit with 1, anything else is the batch failing. */
+  if (status == -1 || !WIFEXITED(status) || WEXITSTATUS(status) > 1) {
+    fprintf(stderr, "`%s` failed.\n", command);
+    return 0;
+  }
+  return 1;
+}
+
+void printSlowest(Job *jobs, int count) {
+  Job **slowest = malloc(sizeof(Job *) * count);
+  int i;
+  for (i = 0; i < count; i++) {
+    slowest[i] = &jobs[i];
+  }
+  qsort(slowest, count, sizeof(Job *), compareJobTimes);
+  fprintf(stdout, "\n[%s] Slowest tests:\n", thisName);
+  for (i = 0; i < count && i < SLOWEST; i++) {
+    fprintf(stdout, "  %8.3f s  %s\n", slowest[i]->elapsed, slowest[i]->name);
+  }
+  free(slowest);
+}
+
 int main(int argc, char* argv[]) {
   thisName = argv[0];
+  long workers = sysconf(_SC_NPROCESSORS_ONLN);
   int opt;
-  while ((opt = getopt(argc, argv, "duv")) != -1) {
+  while ((opt = getopt(argc, argv, "duocnpbvj:")) != -1) {
     switch (opt) {
       case 'd': testDirectory = 1; break;
       case 'u': forceUpdate = 1; break;
+      case 'o': compareOptimized = 1; break;
+      case 'c': compareCached = 1; break;
+      case 'n': compareNative = 1; break;
+      case 'p': compareProfiled = 1; break;
+      case 'b': compareBatch = 1; break;
       case 'v': verboseOutput = 1; break;
+      case 'j': workers = atoi(optarg); break;
       default:
         printUsage;
         exit(1);
@@ -170,48 +463,32 @@ int main(int argc, char* argv[]) {
   }
 
   if (verboseOutput != 0) {
-    printf("testDirectory: %d forceUpdate: %d verboseOutput: %d\n", testDirectory, forceUpdate, verboseOutput);
+    printf("testDirectory: %d forceUpdate: %d compareOptimized: %d compareCached: %d compareNative: %d compareProfiled: %d compareBatch: %d verboseOutput: %d workers: %ld\n", testDirectory, forceUpdate, compareOptimized, compareCached, compareNative, compareProfiled, compareBatch, verboseOutput, workers);
+  }
+  if (workers < 1) {
+    workers = 1;
+  }
+  if (compareNative != 0 && mkdtemp(nativeDir) == NULL) {
+    fprintf(stderr, "Could not create a directory for native executables.\n");
+    return 1;
   }
 
-  int tests = 0;
-  int passed = 0;
-
+  /* The tests, in the order they are given, or sorted if read from a directory. */
+  int tests = 0, capacity = 16;
+  Job *jobs = malloc(sizeof(Job) * capacity);
   if (testDirectory == 0) {
     int i;
-    for (i = 1; i < argc; i++) {
-      char *arg = argv[i];
-      if (arg[0] == '-') {
-        continue;
-      }
-      tests++;
-      if (forceUpdate != 0) {
-        updateTest(arg);
-      } else if (runTest(arg)) {
-        passed++;
-      } else {
-        fprintf(stderr, "[%s] %s failed.\n", thisName, arg);
-      }
-    }
-    if (tests == 0) {
-      printUsage;
-      return 1;
+    for (i = optind; i < argc; i++) {
+      addJob(&jobs, &tests, &capacity, argv[i]);
     }
   } else {
-    char *testDir = NULL;
-    int i;
-    for (i = 1; i < argc; i++) {
-      char *arg = argv[i];
-      if (arg[0] != '-') {
-        testDir = arg;
-        break;
-      }
-    }
-    if (testDir == NULL) {
+    if (optind >= argc) {
       printUsage;
       return 1;
     }
+    char *testDir;
     /* Add a `/` to the end of testDir. */
-    asprintf(&testDir, "%s/", testDir);
+    asprintf(&testDir, "%s/", argv[optind]);
     DIR *d = opendir(testDir);
     struct dirent *dir;
     if (d == NULL) {
@@ -225,28 +502,40 @@ int main(int argc, char* argv[]) {
       if (chopEnd(fileName, IN_EXT)) {
         char *fileWithDir;
         asprintf(&fileWithDir, "%s%s", testDir, fileName);
-        tests++;
-        if (forceUpdate != 0) {
-          updateTest(fileWithDir);
-        } else if (runTest(fileWithDir)) {
-          passed++;
-        } else {
-          fprintf(stderr, "[%s] %s failed.\n", thisName, fileWithDir);
-        }
+        addJob(&jobs, &tests, &capacity, fileWithDir);
       }
     }
 
     closedir(d);
+    qsort(jobs, tests, sizeof(Job), compareJobNames);
+  }
+  if (tests == 0) {
+    printUsage;
+    return 1;
+  }
+
+  if (compareBatch != 0 && !runBatch(jobs, tests, workers)) {
+    return 1;
   }
+  int passed = runJobs(jobs, tests, workers);
 
   if (forceUpdate != 0) {
     fprintf(stdout, "\nDone updating.\n");
   } else {
+    printSlowest(jobs, tests);
     fprintf(stdout, "\n[%s] Tests: %d/%d\n", thisName, passed, tests);
     if (passed == tests) {
       fprintf(stdout, "[%s] All tests passed! 🎉\n", thisName);
     }
   }
+  if (compareNative != 0) {
+    rmdir(nativeDir);
+  }
+  if (compareBatch != 0) {
+    char *command;
+    asprintf(&command, "rm -rf %s", batchDir);
+    system(command);
+  }
 
   return 0;
 }
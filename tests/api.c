@@ -0,0 +1,211 @@
+/* Tests of the embedding API of stackc.h, run against libstackc.a by `make`. */
+/* Programs are loaded and run many times over, checking their output each time and that the */
+/* memory of the process, including the machine code compiled for them, stops growing once the */
+/* first few have run. */
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "../stackc.h"
+
+/* Loads after which memory is measured, then loads it must not grow over. */
+#define WARMUP 1000
+#define LOADS 20000
+/* Growth allowed over LOADS, in KB, far less than a program's memory kept each time. */
+#define MAX_GROWTH 1024
+
+static char *thisName;
+
+/* Peak memory of the process, in KB. */
+static long peakMemory(void) {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_maxrss;
+}
+
+/* Loads and runs source in context, returning whether it printed expected. */
+static int runSource(StackC *context, const char *source, const char *expected) {
+  char output[256];
+  stackcCaptureOutput(context, output, sizeof(output));
+  if (stackcLoad(context, source, strlen(source)) != STACKC_OK || stackcRun(context) != STACKC_OK) {
+    fprintf(stderr, "[%s] `%s` failed: %s\n", thisName, source, stackcError(context));
+    return 0;
+  }
+  size_t size = stackcOutputSize(context);
+  if (size != strlen(expected) || memcmp(output, expected, size) != 0) {
+    fprintf(stderr, "[%s] `%s` printed `%.*s`, expected `%s`\n", thisName, source, (int) size, output, expected);
+    return 0;
+  }
+  return 1;
+}
+
+/* Loads a program over the one before in the same context, without resetting it. */
+static int testReload(void) {
+  const char *source = "def greet \"hi\" . '\\n' . end\n1 2 + . '\\n' . greet\n";
+  StackC *context = stackcNew("./stackc");
+  long memory = 0;
+  int i, passed = 1;
+  for (i = 0; i < WARMUP + LOADS && passed; i++) {
+    if (i == WARMUP) {
+      memory = peakMemory();
+    }
+    passed = runSource(context, source, "3\nhi\n");
+  }
+  /* The stack is kept from one program to the next. */
+  passed = passed && runSource(context, "1 2\n", "") && runSource(context, "+ .\n", "3");
+  if (passed && peakMemory() - memory > MAX_GROWTH) {
+    fprintf(stderr, "[%s] Reloading grew memory by %ld KB\n", thisName, peakMemory() - memory);
+    passed = 0;
+  }
+  stackcFree(context);
+  return passed;
+}
+
+/* Loads source with -c, returning whether its errors were found as expected. */
+static int checkSource(const char *source, int status) {
+  char output[256];
+  StackC *context = stackcNew("./stackc");
+  stackcOptions(context, STACKC_CHECK);
+  stackcCaptureOutput(context, output, sizeof(output));
+  int passed = stackcLoad(context, source, strlen(source)) == status;
+  if (!passed) {
+    fprintf(stderr, "[%s] `%s` with -c did not return %d:\n%s", thisName, source, status, stackcDiagnostics(context));
+  }
+  stackcFree(context);
+  return passed;
+}
+
+/* -c reports only the errors certain to happen when the top level or a word runs. */
+static int testCheck(void) {
+  StackC *context = stackcNew("./stackc");
+  stackcOptions(context, STACKC_CHECK);
+  /* A program starts on the cells left by the one before, which are not missing. */
+  int passed = runSource(context, "1 2\n", "") && runSource(context, "+ .\n", "3");
+  stackcFree(context);
+  return passed
+    && checkSource("\"a\" 1 + .\n", STACKC_ERROR)
+    && checkSource("def f \"a\" 1 + end f\n", STACKC_ERROR)
+    && checkSource("0 if dup then \"a\" 1 + . end\n", STACKC_OK)
+    && checkSource("0 while dup then \"a\" 1 + end drop\n", STACKC_OK)
+    && checkSource("1 if 0 then 1 elseif \"a\" 1 + then 2 end\n", STACKC_OK)
+    && checkSource("def f if dup then \"a\" 1 + . end end 0 f\n", STACKC_OK);
+}
+
+/* Loads a program that fails to compile over and over, after its literals were made into strings. */
+static int testFailedLoad(void) {
+  char source[256];
+  memset(source, 'a', sizeof(source));
+  memcpy(source, "\"", 1);
+  strcpy(source + 200, "\" . if 1\n");
+  char output[256];
+  StackC *context = stackcNew("./stackc");
+  stackcCaptureOutput(context, output, sizeof(output));
+  long memory = 0;
+  int i, passed = 1;
+  for (i = 0; i < WARMUP + LOADS && passed; i++) {
+    if (i == WARMUP) {
+      memory = peakMemory();
+    }
+    passed = stackcLoad(context, source, strlen(source)) == STACKC_ERROR;
+    /* Clears the error reported. */
+    stackcReset(context);
+  }
+  if (passed && peakMemory() - memory > MAX_GROWTH) {
+    fprintf(stderr, "[%s] Failed loads grew memory by %ld KB\n", thisName, peakMemory() - memory);
+    passed = 0;
+  }
+  stackcFree(context);
+  return passed;
+}
+
+/* Hot loops, with superinstructions for their guards and steps with the JIT off and compiled */
+/* with it on, print the same, down to the guard given a string going back to checking it. */
+static int testSuperinstructions(void) {
+  const char *source = "0 while dup 3000 <= then 1 + end . '\\n' .\n"
+    "def countdown while dup 0 > then 1 - end end\n"
+    "5000 countdown . 'z' countdown (int) . '\\n' .\n"
+    "0 3000 while over over < then swap 1 + swap end . . '\\n' .\n"
+    "\"abc\" countdown\n";
+  const char *expected = "3001\n00\n30003000\n";
+  const char *error = "[./stackc] Assertion Error: Invalid types for inequalities";
+  static const int options[] = {STACKC_NO_JIT, 0};
+  int i, passed = 1;
+  for (i = 0; i < 2 && passed; i++) {
+    char output[256];
+    StackC *context = stackcNew("./stackc");
+    stackcOptions(context, options[i]);
+    stackcCaptureOutput(context, output, sizeof(output));
+    passed = stackcLoad(context, source, strlen(source)) == STACKC_OK && stackcRun(context) == STACKC_ERROR
+      && stackcOutputSize(context) == strlen(expected) && memcmp(output, expected, strlen(expected)) == 0
+      && strncmp(stackcDiagnostics(context), error, strlen(error)) == 0;
+    if (!passed) {
+      fprintf(stderr, "[%s] Guards %s printed `%.*s`:\n%s", thisName, options[i] ? "without the JIT" : "with the JIT",
+        (int) stackcOutputSize(context), output, stackcDiagnostics(context));
+    }
+    stackcFree(context);
+  }
+  return passed;
+}
+
+/* A loop and a word hot enough to be compiled to machine code. */
+static const char *hotSource = "def inc 1 + end\n0 while dup 2000 < then inc end . '\\n' .\n";
+
+/* Creates, runs a program compiled to machine code in, and frees a context over and over. */
+static int testJitFree(void) {
+  long memory = 0;
+  int i, passed = 1;
+  for (i = 0; i < WARMUP + LOADS && passed; i++) {
+    if (i == WARMUP) {
+      memory = peakMemory();
+    }
+    StackC *context = stackcNew("./stackc");
+    passed = runSource(context, hotSource, "2000\n");
+    stackcFree(context);
+  }
+  if (passed && peakMemory() - memory > MAX_GROWTH) {
+    fprintf(stderr, "[%s] Compiled code grew memory by %ld KB over freed contexts\n", thisName, peakMemory() - memory);
+    passed = 0;
+  }
+  return passed;
+}
+
+/* Runs a program compiled to machine code in one context, reset in between. */
+static int testJitReset(void) {
+  StackC *context = stackcNew("./stackc");
+  long memory = 0;
+  int i, passed = 1;
+  for (i = 0; i < WARMUP + LOADS && passed; i++) {
+    if (i == WARMUP) {
+      memory = peakMemory();
+    }
+    passed = runSource(context, hotSource, "2000\n");
+    stackcReset(context);
+  }
+  if (passed && peakMemory() - memory > MAX_GROWTH) {
+    fprintf(stderr, "[%s] Compiled code grew memory by %ld KB over resets\n", thisName, peakMemory() - memory);
+    passed = 0;
+  }
+  stackcFree(context);
+  return passed;
+}
+
+int main(int argc, char *argv[]) {
+  thisName = argv[0];
+  (void) argc;
+  int tests = 0, passed = 0;
+  tests++;
+  passed += testReload();
+  tests++;
+  passed += testCheck();
+  tests++;
+  passed += testFailedLoad();
+  tests++;
+  passed += testSuperinstructions();
+  tests++;
+  passed += testJitFree();
+  tests++;
+  passed += testJitReset();
+  fprintf(stdout, "[%s] Tests: %d/%d\n", thisName, passed, tests);
+  return passed == tests ? 0 : 1;
+}